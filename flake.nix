@@ -18,7 +18,7 @@
           src = ./.;
           buildInputs = [ pkgs.musl ];
           buildPhase = ''
-            ${pkgs.musl.dev}/bin/musl-gcc -std=c23 -Wall -Wextra -O2 -static src/build_iso.c -o build_iso
+            ${pkgs.musl.dev}/bin/musl-gcc -std=c23 -Wall -Wextra -O2 -static -pthread src/build_iso.c -o build_iso
           '';
           installPhase = ''
             mkdir -p $out/bin
@@ -46,6 +46,7 @@
             pkgs.gnumake
             pkgs.bear
             pkgs.qemu_kvm
+            pkgs.libarchive
             pkgs.OVMF
             pkgs.podman
             pkgs.distrobox
@@ -1,10 +1,48 @@
 #!/bin/bash
 
+ANSWER_NAME="tonarchy-answers.toml"
+
+find_answer_file() {
+    local candidate="/run/archiso/bootmnt/${ANSWER_NAME}"
+    if [[ -f "$candidate" ]]; then
+        cp "$candidate" "/tmp/${ANSWER_NAME}" && return 0
+    fi
+
+    local mnt dev disk rm tran
+    local -a removable=()
+    while read -r disk rm tran; do
+        if [[ $rm == 1 || $tran == usb ]]; then
+            removable+=("$disk")
+        fi
+    done < <(lsblk -dnrpo NAME,RM,TRAN)
+    (( ${#removable[@]} )) || return 1
+
+    mnt=$(mktemp -d)
+    while read -r dev; do
+        mount -o ro "$dev" "$mnt" 2>/dev/null || continue
+        if [[ -f "${mnt}/${ANSWER_NAME}" ]]; then
+            cp "${mnt}/${ANSWER_NAME}" "/tmp/${ANSWER_NAME}"
+            umount "$mnt"
+            rmdir "$mnt"
+            return 0
+        fi
+        umount "$mnt"
+    done < <(lsblk -rpno NAME,FSTYPE,MOUNTPOINT "${removable[@]}" | awk '$2 != "" && $2 != "swap" && $3 == "" {print $1}')
+    rmdir "$mnt"
+    return 1
+}
+
 if [[ $(tty) == "/dev/tty1" ]]; then
+    if grep -qw tonarchy.bootmarks /proc/cmdline; then
+        echo "<5>tonarchy-boot: autologin" > /dev/kmsg
+    fi
     setfont ter-v32b
-    pacman-key --init
-    pacman-key --populate archlinux
     clear
-    /usr/local/bin/tonarchy
+    if find_answer_file; then
+        chmod 600 "/tmp/${ANSWER_NAME}"
+        /usr/local/bin/tonarchy --config "/tmp/${ANSWER_NAME}"
+    else
+        /usr/local/bin/tonarchy
+    fi
     exec /bin/bash
 fi
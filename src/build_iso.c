@@ -2,6 +2,8 @@
 #include <stdarg.h>
 
 static FILE *log_file = NULL;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void logger_init(const char *log_path) {
     log_file = fopen(log_path, "a");
@@ -23,10 +25,12 @@ void logger_close(void) {
 
 void log_info(const char *fmt, ...) {
     va_list args;
+    pthread_mutex_lock(&log_lock);
     va_start(args, fmt);
     printf("[INFO] ");
     vprintf(fmt, args);
     printf("\n");
+    fflush(stdout);
     va_end(args);
 
     if (log_file) {
@@ -37,10 +41,12 @@ void log_info(const char *fmt, ...) {
         fflush(log_file);
         va_end(args);
     }
+    pthread_mutex_unlock(&log_lock);
 }
 
 void log_error(const char *fmt, ...) {
     va_list args;
+    pthread_mutex_lock(&log_lock);
     va_start(args, fmt);
     fprintf(stderr, "[ERROR] ");
     vfprintf(stderr, fmt, args);
@@ -55,10 +61,12 @@ void log_error(const char *fmt, ...) {
         fflush(log_file);
         va_end(args);
     }
+    pthread_mutex_unlock(&log_lock);
 }
 
 void log_warn(const char *fmt, ...) {
     va_list args;
+    pthread_mutex_lock(&log_lock);
     va_start(args, fmt);
     fprintf(stderr, "[WARN] ");
     vfprintf(stderr, fmt, args);
@@ -73,6 +81,7 @@ void log_warn(const char *fmt, ...) {
         fflush(log_file);
         va_end(args);
     }
+    pthread_mutex_unlock(&log_lock);
 }
 
 int run_command(const char *cmd) {
@@ -95,11 +104,12 @@ int run_command_in_container(const char *cmd, const Build_Config *config) {
     } else if (config->container_type == CONTAINER_PODMAN) {
         snprintf(container_cmd, sizeof(container_cmd),
                  "podman run --rm --privileged "
+                 PACMAN_CACHE_MOUNT
                  "-v '%s:/src' "
                  "-v '%s:/profile' "
                  "-v '%s:/out' "
                  "-v '%s:/work' "
-                 "docker.io/archlinux:latest sh -c '%s'",
+                 BUILDER_IMAGE " sh -c '%s'",
                  config->tonarchy_src,
                  config->iso_profile,
                  config->out_dir,
@@ -141,6 +151,173 @@ int check_distrobox_exists(const char *name) {
     return system(cmd) == 0;
 }
 
+int hash_inputs(const Build_Config *config, const char *inputs, const char *extra, char *out) {
+    char prune[CMD_MAX_LEN / 4];
+    snprintf(prune, sizeof(prune),
+             "\\( -path '%s/airootfs/usr' -o -path '%s/airootfs/opt' \\) -prune -o",
+             config->iso_profile, config->iso_profile);
+
+    char cmd[CMD_MAX_LEN];
+    snprintf(cmd, sizeof(cmd),
+             "{ printf '%%s\\n' '%s'; "
+             "find %s %s -type l -printf '%%p -> %%l\\n' 2>/dev/null | LC_ALL=C sort; "
+             "find %s %s -type f -print0 2>/dev/null | LC_ALL=C sort -z | xargs -0r sha256sum; "
+             "} | sha256sum",
+             extra, inputs, prune, inputs, prune);
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    char line[256] = "";
+    char *read = fgets(line, sizeof(line), fp);
+    int status = pclose(fp);
+    if (!read || status != 0 || strspn(line, "0123456789abcdef") != HASH_HEX_LEN) {
+        log_warn("Failed to hash build inputs");
+        out[0] = '\0';
+        return 0;
+    }
+
+    memcpy(out, line, HASH_HEX_LEN);
+    out[HASH_HEX_LEN] = '\0';
+    return 1;
+}
+
+void manifest_load(const Build_Config *config, Build_Manifest *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s/" BUILD_MANIFEST, config->out_dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+
+    char line[PATH_MAX_LEN + 128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *value = strchr(line, ' ');
+        if (!value) continue;
+        *value++ = '\0';
+
+        if (strcmp(line, "binary") == 0) {
+            snprintf(manifest->binary, sizeof(manifest->binary), "%s", value);
+        } else if (strcmp(line, "packages") == 0) {
+            snprintf(manifest->packages, sizeof(manifest->packages), "%s", value);
+        } else if (strcmp(line, "repo") == 0) {
+            snprintf(manifest->repo, sizeof(manifest->repo), "%s", value);
+        } else if (strcmp(line, "iso") == 0) {
+            snprintf(manifest->iso, sizeof(manifest->iso), "%s", value);
+        } else if (strcmp(line, "iso_path") == 0) {
+            snprintf(manifest->iso_path, sizeof(manifest->iso_path), "%s", value);
+        }
+    }
+    fclose(fp);
+}
+
+static int manifest_write(const Build_Config *config, const Build_Manifest *manifest) {
+    if (!create_directory(config->out_dir, 0755)) {
+        return 0;
+    }
+
+    char path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN + 8];
+    snprintf(path, sizeof(path), "%s/" BUILD_MANIFEST, config->out_dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        log_warn("Failed to write build manifest %s", path);
+        return 0;
+    }
+    fprintf(fp, "binary %s\npackages %s\nrepo %s\niso %s\niso_path %s\n",
+            manifest->binary, manifest->packages, manifest->repo, manifest->iso, manifest->iso_path);
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        log_warn("Failed to write build manifest %s", path);
+        unlink(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+int manifest_save(const Build_Config *config, const Build_Manifest *manifest) {
+    pthread_mutex_lock(&manifest_lock);
+    int result = manifest_write(config, manifest);
+    pthread_mutex_unlock(&manifest_lock);
+    return result;
+}
+
+int manifest_set(const Build_Config *config, Build_Manifest *manifest, char *field, const char *value) {
+    pthread_mutex_lock(&manifest_lock);
+    snprintf(field, HASH_HEX_LEN + 1, "%s", value);
+    int result = manifest_write(config, manifest);
+    pthread_mutex_unlock(&manifest_lock);
+    return result;
+}
+
+void detect_source_date_epoch(Build_Config *config) {
+    const char *env = getenv("SOURCE_DATE_EPOCH");
+    if (env && *env) {
+        snprintf(config->source_date_epoch, sizeof(config->source_date_epoch), "%s", env);
+        return;
+    }
+
+    char cmd[CMD_MAX_LEN];
+    snprintf(cmd, sizeof(cmd), "git -C '%s' log -1 --format=%%ct 2>/dev/null", config->tonarchy_src);
+    FILE *fp = popen(cmd, "r");
+    if (fp) {
+        char line[32] = "";
+        if (fgets(line, sizeof(line), fp) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(config->source_date_epoch, sizeof(config->source_date_epoch), "%s", line);
+        }
+        pclose(fp);
+    }
+
+    if (config->source_date_epoch[0] == '\0') {
+        log_warn("SOURCE_DATE_EPOCH not set and no git history, the ISO will not be reproducible");
+        return;
+    }
+    setenv("SOURCE_DATE_EPOCH", config->source_date_epoch, 1);
+}
+
+int ensure_builder_image(const Build_Config *config) {
+    char cmd[CMD_MAX_LEN];
+    if (!config->refresh_builder && system("sudo podman image exists " BUILDER_IMAGE) == 0) {
+        log_info("Reusing builder image %s", BUILDER_IMAGE);
+        return 1;
+    }
+
+    log_info("Building builder image %s...", BUILDER_IMAGE);
+    if (!create_directory(BUILDER_DIR, 0755)) {
+        return 0;
+    }
+
+    FILE *fp = fopen(BUILDER_DIR "/Containerfile", "w");
+    if (!fp) {
+        log_error("Failed to write " BUILDER_DIR "/Containerfile");
+        return 0;
+    }
+    fprintf(fp,
+            "FROM " BUILDER_BASE_IMAGE "\n"
+            "RUN pacman -Syu --noconfirm --needed " BUILDER_PACKAGES "\n");
+    if (fclose(fp) != 0) {
+        log_error("Failed to write " BUILDER_DIR "/Containerfile");
+        return 0;
+    }
+
+    snprintf(cmd, sizeof(cmd),
+             "sudo podman build --pull=always "
+             PACMAN_CACHE_MOUNT
+             "-t " BUILDER_IMAGE " " BUILDER_DIR);
+    if (!run_command(cmd)) {
+        log_error("Failed to build builder image");
+        return 0;
+    }
+    return 1;
+}
+
 int build_tonarchy_static(const Build_Config *config) {
     log_info("Building tonarchy static binary...");
 
@@ -151,9 +328,8 @@ int build_tonarchy_static(const Build_Config *config) {
         snprintf(cmd, sizeof(cmd),
                  "sudo podman run --rm "
                  "-v '%s:/src' "
-                 "docker.io/archlinux:latest "
-                 "sh -c 'pacman -Sy --noconfirm musl gcc && "
-                 "cd /src && rm -f tonarchy tonarchy-static && "
+                 BUILDER_IMAGE " "
+                 "sh -c 'cd /src && rm -f tonarchy tonarchy-static && "
                  "musl-gcc -std=c23 -Wall -Wextra -O2 -static src/tonarchy.c -o tonarchy-static'",
                  config->tonarchy_src);
         if (!run_command(cmd)) {
@@ -163,7 +339,7 @@ int build_tonarchy_static(const Build_Config *config) {
     } else if (config->use_container && config->container_type == CONTAINER_DISTROBOX) {
         snprintf(cmd, sizeof(cmd),
                  "sudo pacman -S --noconfirm --needed musl && "
-                 "cd '%s' && make clean && make static CC=musl-gcc",
+                 "cd '%s' && rm -f tonarchy-static && make static CC=musl-gcc",
                  config->tonarchy_src);
         if (!run_command_in_container(cmd, config)) {
             log_error("Failed to build tonarchy-static in distrobox");
@@ -171,7 +347,7 @@ int build_tonarchy_static(const Build_Config *config) {
         }
     } else {
         snprintf(cmd, sizeof(cmd),
-                 "cd '%s' && make clean && make static CC=musl-gcc",
+                 "cd '%s' && rm -f tonarchy-static && make static CC=musl-gcc",
                  config->tonarchy_src);
         if (!run_command(cmd)) {
             log_error("Failed to build tonarchy-static");
@@ -207,26 +383,68 @@ int clean_airootfs(const Build_Config *config) {
         log_warn("Failed to clean airootfs/root/tonarchy");
     }
 
+    if (!config->offline_repo) {
+        snprintf(cmd, sizeof(cmd), "sudo rm -rf '%s/airootfs/opt/tonarchy'", config->iso_profile);
+        if (!run_command(cmd)) {
+            log_warn("Failed to clean airootfs/opt/tonarchy");
+        }
+    }
+
     return 1;
 }
 
-int clean_work_dir(const Build_Config *config) {
-    log_info("Cleaning work directory...");
-
+int move_work_dir_aside(const Build_Config *config) {
     char cmd[CMD_MAX_LEN];
 
     snprintf(cmd, sizeof(cmd), "sudo umount -R '%s' 2>/dev/null || true", config->work_dir);
     run_command(cmd);
 
-    snprintf(cmd, sizeof(cmd), "sudo rm -rf '%s'", config->work_dir);
+    struct stat st;
+    if (stat(config->work_dir, &st) != 0) {
+        return 1;
+    }
+
+    log_info("Moving old work directory aside...");
+    snprintf(cmd, sizeof(cmd), "sudo mv '%s' '%s" WORK_DIR_ASIDE_SUFFIX "%ld-%d'",
+             config->work_dir, config->work_dir, (long)time(NULL), (int)getpid());
     if (!run_command(cmd)) {
-        log_error("Failed to remove work directory: %s", config->work_dir);
+        log_error("Failed to move work directory aside: %s", config->work_dir);
         return 0;
     }
+    return 1;
+}
 
-    sync();
-    sleep(1);
+int clean_work_dir(const Build_Config *config) {
+    log_info("Removing old work directories...");
+
+    char cmd[CMD_MAX_LEN];
+    snprintf(cmd, sizeof(cmd), "sudo rm -rf '%s'" WORK_DIR_ASIDE_SUFFIX "*", config->work_dir);
+    if (!run_command(cmd)) {
+        log_warn("Failed to remove old work directories next to %s", config->work_dir);
+        return 0;
+    }
+    return 1;
+}
+
+int reset_work_dir(const Build_Config *config) {
+    struct stat st;
+    if (stat(config->work_dir, &st) != 0) {
+        return 1;
+    }
 
+    log_info("Package inputs unchanged, reusing installed packages in %s", config->work_dir);
+
+    char cmd[CMD_MAX_LEN];
+    snprintf(cmd, sizeof(cmd), "sudo umount -R '%s' 2>/dev/null || true", config->work_dir);
+    run_command(cmd);
+
+    snprintf(cmd, sizeof(cmd),
+             "sudo find '%s' -maxdepth 1 -type f -name '*._*' ! -name '*._make_packages' -delete",
+             config->work_dir);
+    if (!run_command(cmd)) {
+        log_error("Failed to reset build stages in %s", config->work_dir);
+        return 0;
+    }
     return 1;
 }
 
@@ -249,20 +467,6 @@ int prepare_airootfs(const Build_Config *config) {
         return 0;
     }
 
-    snprintf(src_path, sizeof(src_path), "%s/tonarchy-static", config->tonarchy_src);
-    snprintf(dest_path, sizeof(dest_path), "%s/airootfs/usr/local/bin/tonarchy", config->iso_profile);
-    snprintf(cmd, sizeof(cmd), "cp '%s' '%s'", src_path, dest_path);
-    if (!run_command(cmd)) {
-        log_error("Failed to copy tonarchy binary");
-        return 0;
-    }
-
-    snprintf(cmd, sizeof(cmd), "chmod 755 '%s'", dest_path);
-    if (!run_command(cmd)) {
-        log_error("Failed to set permissions on tonarchy binary");
-        return 0;
-    }
-
     snprintf(src_path, sizeof(src_path), "%s/assets", config->tonarchy_src);
     snprintf(dest_path, sizeof(dest_path), "%s/airootfs/usr/share/tonarchy", config->iso_profile);
     snprintf(cmd, sizeof(cmd), "mkdir -p '%s'", dest_path);
@@ -282,6 +486,30 @@ int prepare_airootfs(const Build_Config *config) {
         log_warn("Failed to copy wallpapers");
     }
 
+    return 1;
+}
+
+int install_tonarchy_binary(const Build_Config *config) {
+    log_info("Installing tonarchy into airootfs...");
+
+    char cmd[CMD_MAX_LEN];
+    char src_path[PATH_MAX_LEN];
+    char dest_path[PATH_MAX_LEN];
+
+    snprintf(src_path, sizeof(src_path), "%s/tonarchy-static", config->tonarchy_src);
+    snprintf(dest_path, sizeof(dest_path), "%s/airootfs/usr/local/bin/tonarchy", config->iso_profile);
+    snprintf(cmd, sizeof(cmd), "cp '%s' '%s'", src_path, dest_path);
+    if (!run_command(cmd)) {
+        log_error("Failed to copy tonarchy binary");
+        return 0;
+    }
+
+    snprintf(cmd, sizeof(cmd), "chmod 755 '%s'", dest_path);
+    if (!run_command(cmd)) {
+        log_error("Failed to set permissions on tonarchy binary");
+        return 0;
+    }
+
     log_info("Setting proper ownership for airootfs...");
     snprintf(cmd, sizeof(cmd), "sudo chown -R root:root '%s/airootfs/usr'", config->iso_profile);
     if (!run_command(cmd)) {
@@ -292,6 +520,105 @@ int prepare_airootfs(const Build_Config *config) {
     return 1;
 }
 
+static int read_package_set(const Build_Config *config, char *packages, size_t size) {
+    char cmd[CMD_MAX_LEN];
+    snprintf(cmd, sizeof(cmd), "'%s/tonarchy-static' --list-packages", config->tonarchy_src);
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    size_t used = 0;
+    int count = 0;
+    char line[256];
+    packages[0] = '\0';
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0') continue;
+        int n = snprintf(packages + used, size - used, "%s%s", used ? " " : "", line);
+        if (n < 0 || (size_t)n >= size - used) {
+            pclose(fp);
+            return 0;
+        }
+        used += (size_t)n;
+        count++;
+    }
+
+    if (pclose(fp) != 0 || count == 0) {
+        return 0;
+    }
+    log_info("Offline repository covers %d packages and their dependencies", count);
+    return 1;
+}
+
+int build_offline_repo(const Build_Config *config, Build_Manifest *manifest) {
+    log_info("Building offline package repository...");
+
+    char packages[CMD_MAX_LEN / 2];
+    if (!read_package_set(config, packages, sizeof(packages))) {
+        log_error("Failed to read the installer package set");
+        return 0;
+    }
+
+    char inputs[PATH_MAX_LEN + 16];
+    char key[HASH_HEX_LEN + 1];
+    char db_path[PATH_MAX_LEN];
+    struct stat st;
+    snprintf(inputs, sizeof(inputs), "'%s/pacman.conf'", config->iso_profile);
+    snprintf(db_path, sizeof(db_path), "%s/" OFFLINE_REPO_PATH "/" OFFLINE_REPO_NAME ".db", config->iso_profile);
+    if (hash_inputs(config, inputs, packages, key) && strcmp(key, manifest->repo) == 0 && stat(db_path, &st) == 0) {
+        log_info("Offline repository inputs unchanged, reusing it");
+        return 1;
+    }
+
+    bool podman = config->use_container && config->container_type == CONTAINER_PODMAN;
+    const char *profile = podman ? "/profile" : config->iso_profile;
+
+    char script[CMD_MAX_LEN];
+    snprintf(script, sizeof(script),
+             "rm -rf \"%s/" OFFLINE_REPO_PATH "\" && "
+             "mkdir -p \"%s/" OFFLINE_REPO_PATH "\" /tmp/tonarchy-repo-db && "
+             "pacman -Syw --noconfirm --config \"%s/pacman.conf\" --dbpath /tmp/tonarchy-repo-db %s && "
+             "pacman -Sp --print-format %%f --config \"%s/pacman.conf\" --dbpath /tmp/tonarchy-repo-db %s "
+             "| xargs -I{} cp /var/cache/pacman/pkg/{} \"%s/" OFFLINE_REPO_PATH "/\" && "
+             "repo-add -q \"%s/" OFFLINE_REPO_PATH "/" OFFLINE_REPO_NAME ".db.tar.gz\" "
+             "\"%s/" OFFLINE_REPO_PATH "\"/*.pkg.tar.zst && "
+             "rm -rf /tmp/tonarchy-repo-db",
+             profile, profile, profile, packages, profile, packages, profile, profile, profile);
+
+    char cmd[CMD_MAX_LEN];
+    if (podman) {
+        snprintf(cmd, sizeof(cmd),
+                 "sudo podman run --rm "
+                 PACMAN_CACHE_MOUNT
+                 "-v '%s:/profile' "
+                 BUILDER_IMAGE " "
+                 "sh -c '%s'",
+                 config->iso_profile, script);
+        if (!run_command(cmd)) {
+            log_error("Failed to build offline repository in podman");
+            return 0;
+        }
+    } else if (config->use_container && config->container_type == CONTAINER_DISTROBOX) {
+        snprintf(cmd, sizeof(cmd), "sudo sh -c '%s'", script);
+        if (!run_command_in_container(cmd, config)) {
+            log_error("Failed to build offline repository in distrobox");
+            return 0;
+        }
+    } else {
+        snprintf(cmd, sizeof(cmd), "sudo sh -c '%s'", script);
+        if (!run_command(cmd)) {
+            log_error("Failed to build offline repository");
+            return 0;
+        }
+    }
+
+    log_info("Offline repository ready in %s/" OFFLINE_REPO_PATH, config->iso_profile);
+    manifest_set(config, manifest, manifest->repo, key);
+    return 1;
+}
+
 int run_mkarchiso(const Build_Config *config) {
     log_info("Building ISO with mkarchiso...");
 
@@ -304,8 +631,8 @@ int run_mkarchiso(const Build_Config *config) {
     }
 
     char cmd[CMD_MAX_LEN];
-    snprintf(cmd, sizeof(cmd), "sudo mkarchiso -v -w '%s' -o '%s' '%s'",
-             config->work_dir, config->out_dir, config->iso_profile);
+    snprintf(cmd, sizeof(cmd), "sudo env SOURCE_DATE_EPOCH='%s' mkarchiso -v -w '%s' -o '%s' '%s'",
+             config->source_date_epoch, config->work_dir, config->out_dir, config->iso_profile);
 
     if (!run_command(cmd)) {
         log_error("mkarchiso failed");
@@ -334,11 +661,14 @@ int run_mkarchiso_in_container(const Build_Config *config) {
 
     snprintf(cmd, sizeof(cmd),
              "sudo podman run --rm --privileged "
+             "-e SOURCE_DATE_EPOCH='%s' "
              "-v '%s:/profile' "
              "-v '%s:/out' "
              "-v '%s:/work' "
-             "docker.io/archlinux:latest "
-             "sh -c 'pacman -Sy --noconfirm archiso && mkarchiso -v -w /work -o /out /profile'",
+             PACMAN_CACHE_MOUNT
+             BUILDER_IMAGE " "
+             "mkarchiso -v -w /work -o /out /profile",
+             config->source_date_epoch,
              config->iso_profile,
              config->out_dir,
              config->work_dir);
@@ -351,6 +681,717 @@ int run_mkarchiso_in_container(const Build_Config *config) {
     return 1;
 }
 
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    Build_Job *job;
+    Build_Context *ctx;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+} Job_Thread;
+
+static void *job_thread_main(void *arg) {
+    Job_Thread *t = arg;
+    int result = t->job->run(t->ctx);
+
+    pthread_mutex_lock(t->lock);
+    t->job->end = monotonic_seconds();
+    t->job->state = result ? JOB_DONE : JOB_FAILED;
+    pthread_cond_broadcast(t->cond);
+    pthread_mutex_unlock(t->lock);
+    return NULL;
+}
+
+static Build_Job *find_job(Build_Job *jobs, size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(jobs[i].name, name) == 0) {
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+int run_jobs(Build_Job *jobs, size_t count, Build_Context *ctx) {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    Job_Thread threads[count];
+    double start = monotonic_seconds();
+
+    for (size_t i = 0; i < count; i++) {
+        jobs[i].state = jobs[i].enabled ? JOB_PENDING : JOB_DONE;
+        jobs[i].start = jobs[i].end = start;
+        jobs[i].joinable = false;
+    }
+
+    pthread_mutex_lock(&lock);
+    size_t running = 0;
+    for (;;) {
+        size_t settled = 0;
+        for (size_t i = 0; i < count; i++) {
+            Build_Job *job = &jobs[i];
+            if (job->state == JOB_PENDING) {
+                bool ready = true;
+                for (size_t d = 0; d < MAX_JOB_DEPS && job->deps[d]; d++) {
+                    Build_Job *dep = find_job(jobs, count, job->deps[d]);
+                    if (dep && dep->state == JOB_FAILED) {
+                        log_error("Stage %s skipped, %s failed", job->name, dep->name);
+                        job->state = JOB_FAILED;
+                        ready = false;
+                        break;
+                    }
+                    if (dep && dep->state != JOB_DONE) {
+                        ready = false;
+                    }
+                }
+
+                if (ready) {
+                    threads[i] = (Job_Thread){ .job = job, .ctx = ctx, .lock = &lock, .cond = &cond };
+                    job->start = monotonic_seconds();
+                    job->state = JOB_RUNNING;
+                    if (pthread_create(&job->thread, NULL, job_thread_main, &threads[i]) != 0) {
+                        log_error("Failed to start stage %s", job->name);
+                        job->state = JOB_FAILED;
+                    } else {
+                        job->joinable = true;
+                        running++;
+                    }
+                }
+            }
+            if (job->state == JOB_DONE || job->state == JOB_FAILED) {
+                settled++;
+            }
+        }
+
+        if (settled == count && running == 0) {
+            break;
+        }
+        pthread_cond_wait(&cond, &lock);
+
+        for (size_t i = 0; i < count; i++) {
+            if (jobs[i].joinable && jobs[i].state != JOB_RUNNING) {
+                pthread_join(jobs[i].thread, NULL);
+                jobs[i].joinable = false;
+                running--;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    int ok = 1;
+    log_info("Stage timings:");
+    for (size_t i = 0; i < count; i++) {
+        if (!jobs[i].enabled) continue;
+        log_info("  %-22s %8.2fs  (+%.2fs)  %s", jobs[i].name, jobs[i].end - jobs[i].start,
+                 jobs[i].start - start, jobs[i].state == JOB_DONE ? "ok" : "failed");
+        if (jobs[i].state != JOB_DONE) ok = 0;
+    }
+    log_info("  %-22s %8.2fs", "total", monotonic_seconds() - start);
+    return ok;
+}
+
+static const Compression_Profile COMPRESSION_PROFILES[] = {
+    {"zstd-15-512k",    "squashfs", "'-comp' 'zstd' '-Xcompression-level' '15' '-b' '512K'"},
+    {"zstd-19-1m",      "squashfs", "'-comp' 'zstd' '-Xcompression-level' '19' '-b' '1M'"},
+    {"zstd-9-256k",     "squashfs", "'-comp' 'zstd' '-Xcompression-level' '9' '-b' '256K'"},
+    {"zstd-3-128k",     "squashfs", "'-comp' 'zstd' '-Xcompression-level' '3' '-b' '128K'"},
+    {"xz-1m",           "squashfs", "'-comp' 'xz' '-Xbcj' 'x86' '-b' '1M'"},
+    {"lz4hc-256k",      "squashfs", "'-comp' 'lz4' '-Xhc' '-b' '256K'"},
+    {"lz4-128k",        "squashfs", "'-comp' 'lz4' '-b' '128K'"},
+    {"erofs-lz4hc",     "erofs",    "'-zlz4hc,12' '-Eztailpacking'"},
+    {"erofs-lz4hc-64k", "erofs",    "'-zlz4hc,12' '-Eztailpacking' '-C65536'"},
+};
+
+#define COMPRESSION_PROFILE_COUNT (sizeof(COMPRESSION_PROFILES) / sizeof(COMPRESSION_PROFILES[0]))
+
+static const char BENCH_SCRIPT[] =
+    "#!/bin/bash\n"
+    "src=$1\n"
+    "scratch=$2\n"
+    "here=$(dirname \"$0\")\n"
+    "TIMEFORMAT='%R %U %S'\n"
+    "mkdir -p \"$scratch/mnt\"\n"
+    ": > \"$here/results\"\n"
+    "while IFS='|' read -r name type opts; do\n"
+    "    img=\"$scratch/$name.img\"\n"
+    "    rm -f \"$img\"\n"
+    "    eval \"set -- $opts\"\n"
+    "    if [ \"$type\" = erofs ]; then\n"
+    "        build=$( { time mkfs.erofs \"$@\" \"$img\" \"$src\" >/dev/null 2>&1; } 2>&1 )\n"
+    "    else\n"
+    "        build=$( { time mksquashfs \"$src\" \"$img\" -noappend -no-progress \"$@\" >/dev/null 2>&1; } 2>&1 )\n"
+    "    fi\n"
+    "    if [ ! -s \"$img\" ] || ! mount -o loop,ro -t \"$type\" \"$img\" \"$scratch/mnt\"; then\n"
+    "        echo \"$name failed\" >> \"$here/results\"\n"
+    "        rm -f \"$img\"\n"
+    "        continue\n"
+    "    fi\n"
+    "    size=$(stat -c %s \"$img\")\n"
+    "    sync\n"
+    "    echo 3 > /proc/sys/vm/drop_caches\n"
+    "    read=$( { time (find \"$scratch/mnt\" -type f -print0 | shuf -z --random-source=<(yes) "
+    "| xargs -0 cat | wc -c > \"$scratch/bytes\"); } 2>&1 )\n"
+    "    umount \"$scratch/mnt\"\n"
+    "    rm -f \"$img\"\n"
+    "    echo \"$name ok $size $build $(cat \"$scratch/bytes\") $read\" >> \"$here/results\"\n"
+    "done < \"$here/configs\"\n"
+    "rm -rf \"$scratch\"\n";
+
+const Compression_Profile *find_compression_profile(const char *name) {
+    for (size_t i = 0; i < COMPRESSION_PROFILE_COUNT; i++) {
+        if (strcmp(COMPRESSION_PROFILES[i].name, name) == 0) {
+            return &COMPRESSION_PROFILES[i];
+        }
+    }
+    return NULL;
+}
+
+static const Compression_Profile *current_compression_profile(const Build_Config *config) {
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s/profiledef.sh", config->iso_profile);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return NULL;
+    }
+
+    char type[32] = "";
+    char options[512] = "";
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "airootfs_image_type=\"%31[^\"]\"", type) == 1) continue;
+        if (strncmp(line, "airootfs_image_tool_options=(", 29) == 0) {
+            snprintf(options, sizeof(options), "%s", line + 29);
+            options[strcspn(options, ")")] = '\0';
+        }
+    }
+    fclose(fp);
+
+    for (size_t i = 0; i < COMPRESSION_PROFILE_COUNT; i++) {
+        if (strcmp(COMPRESSION_PROFILES[i].image_type, type) == 0 &&
+            strcmp(COMPRESSION_PROFILES[i].tool_options, options) == 0) {
+            return &COMPRESSION_PROFILES[i];
+        }
+    }
+    return NULL;
+}
+
+int apply_compression_profile(const Build_Config *config, const Compression_Profile *profile) {
+    char path[PATH_MAX_LEN];
+    char tmp_path[PATH_MAX_LEN + 8];
+    snprintf(path, sizeof(path), "%s/profiledef.sh", config->iso_profile);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        log_error("Failed to read %s", path);
+        return 0;
+    }
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        log_error("Failed to write %s", tmp_path);
+        fclose(in);
+        return 0;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (strncmp(line, "airootfs_image_type=", 20) == 0) {
+            fprintf(out, "airootfs_image_type=\"%s\"\n", profile->image_type);
+        } else if (strncmp(line, "airootfs_image_tool_options=", 28) == 0) {
+            fprintf(out, "airootfs_image_tool_options=(%s)\n", profile->tool_options);
+        } else {
+            fputs(line, out);
+        }
+    }
+    fclose(in);
+
+    if (fclose(out) != 0 || chmod(tmp_path, 0755) != 0 || rename(tmp_path, path) != 0) {
+        log_error("Failed to update %s", path);
+        unlink(tmp_path);
+        return 0;
+    }
+
+    log_info("Live image compression set to %s (%s %s)", profile->name, profile->image_type, profile->tool_options);
+    return 1;
+}
+
+static int write_bench_inputs(void) {
+    if (!create_directory(BENCH_DIR, 0755)) {
+        return 0;
+    }
+
+    FILE *fp = fopen(BENCH_DIR "/bench.sh", "w");
+    if (!fp) {
+        return 0;
+    }
+    fputs(BENCH_SCRIPT, fp);
+    if (fclose(fp) != 0) {
+        return 0;
+    }
+
+    fp = fopen(BENCH_DIR "/configs", "w");
+    if (!fp) {
+        return 0;
+    }
+    for (size_t i = 0; i < COMPRESSION_PROFILE_COUNT; i++) {
+        fprintf(fp, "%s|%s|%s\n", COMPRESSION_PROFILES[i].name,
+                COMPRESSION_PROFILES[i].image_type, COMPRESSION_PROFILES[i].tool_options);
+    }
+    return fclose(fp) == 0;
+}
+
+static size_t read_bench_results(Bench_Result *results) {
+    FILE *fp = fopen(BENCH_DIR "/results", "r");
+    if (!fp) {
+        return 0;
+    }
+
+    size_t count = 0;
+    char line[512];
+    while (count < COMPRESSION_PROFILE_COUNT && fgets(line, sizeof(line), fp) != NULL) {
+        char name[64];
+        char status[16];
+        double user, sys, read_user, read_sys;
+        Bench_Result *r = &results[count];
+        memset(r, 0, sizeof(*r));
+
+        int fields = sscanf(line, "%63s %15s %llu %lf %lf %lf %llu %lf %lf %lf", name, status,
+                            &r->image_bytes, &r->build_seconds, &user, &sys,
+                            &r->read_bytes, &r->read_seconds, &read_user, &read_sys);
+        r->profile = fields >= 2 ? find_compression_profile(name) : NULL;
+        if (!r->profile) continue;
+
+        r->ok = strcmp(status, "ok") == 0 && fields == 10 && r->read_seconds > 0;
+        r->build_cpu_seconds = user + sys;
+        r->score = (double)r->image_bytes / (BENCH_USB_MIB_PER_SEC * 1024 * 1024) + r->read_seconds;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static void report_bench_results(const Build_Config *config, const Bench_Result *results, size_t count) {
+    const Compression_Profile *current = current_compression_profile(config);
+    const Bench_Result *best = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].ok && (!best || results[i].score < best->score)) {
+            best = &results[i];
+        }
+    }
+
+    char report_path[PATH_MAX_LEN];
+    snprintf(report_path, sizeof(report_path), "%s/" BENCH_REPORT, config->out_dir);
+    FILE *fp = create_directory(config->out_dir, 0755) ? fopen(report_path, "w") : NULL;
+
+    char line[512];
+    const char *header = "| profile         | type     | size MiB | build s | CPU % | read MiB/s | est. USB load s | note          |";
+    log_info("%s", header);
+    if (fp) {
+        fprintf(fp, "#+TITLE: Live image compression benchmark\n\n");
+        fprintf(fp, "Estimated USB load time assumes %.0f MiB/s sequential reads plus the measured\n", BENCH_USB_MIB_PER_SEC);
+        fprintf(fp, "random-read decompression time of the whole image.\n\n");
+        fprintf(fp, "%s\n|-\n", header);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const Bench_Result *r = &results[i];
+        const char *mark = r == best ? (r->profile == current ? "best, current" : "best")
+            : r->profile == current ? "current" : "";
+        if (!r->ok) {
+            snprintf(line, sizeof(line), "| %-15s | %-8s | %8s | %7s | %5s | %10s | %15s | %-13s |",
+                     r->profile->name, r->profile->image_type, "-", "-", "-", "-", "failed", mark);
+        } else {
+            snprintf(line, sizeof(line), "| %-15s | %-8s | %8.1f | %7.1f | %5.0f | %10.1f | %15.1f | %-13s |",
+                     r->profile->name, r->profile->image_type,
+                     (double)r->image_bytes / (1024 * 1024), r->build_seconds,
+                     r->build_seconds > 0 ? r->build_cpu_seconds / r->build_seconds * 100 : 0,
+                     (double)r->read_bytes / (1024 * 1024) / r->read_seconds, r->score, mark);
+        }
+        log_info("%s", line);
+        if (fp) fprintf(fp, "%s\n", line);
+    }
+
+    if (best) {
+        log_info("Best: %s, select it with: ./build_iso --compression %s", best->profile->name, best->profile->name);
+        if (fp) fprintf(fp, "\nBest: =%s= (=./build_iso --compression %s=)\n", best->profile->name, best->profile->name);
+    }
+    if (fp) {
+        fclose(fp);
+        log_info("Report written to %s", report_path);
+    }
+}
+
+int run_compression_bench(const Build_Config *config) {
+    log_info("Benchmarking live image compression...");
+
+    char airootfs[PATH_MAX_LEN];
+    snprintf(airootfs, sizeof(airootfs), "%s/x86_64/airootfs", config->work_dir);
+    struct stat st;
+    if (stat(airootfs, &st) != 0) {
+        log_error("No airootfs in %s, build the ISO once before benchmarking", config->work_dir);
+        return 0;
+    }
+
+    if (!write_bench_inputs()) {
+        log_error("Failed to write benchmark script to " BENCH_DIR);
+        return 0;
+    }
+
+    char cmd[CMD_MAX_LEN];
+    if (config->use_container && config->container_type == CONTAINER_PODMAN) {
+        if (!ensure_builder_image(config)) {
+            return 0;
+        }
+        snprintf(cmd, sizeof(cmd),
+                 "sudo podman run --rm --privileged "
+                 "-v '%s:/work' "
+                 "-v '" BENCH_DIR ":/bench' "
+                 BUILDER_IMAGE " "
+                 "bash /bench/bench.sh /work/x86_64/airootfs /work/bench",
+                 config->work_dir);
+    } else {
+        snprintf(cmd, sizeof(cmd), "sudo bash " BENCH_DIR "/bench.sh '%s' '%s/bench'", airootfs, config->work_dir);
+    }
+    if (!run_command(cmd)) {
+        log_error("Compression benchmark failed");
+        return 0;
+    }
+
+    Bench_Result results[COMPRESSION_PROFILE_COUNT];
+    size_t count = read_bench_results(results);
+    if (count == 0) {
+        log_error("Compression benchmark produced no results");
+        return 0;
+    }
+
+    report_bench_results(config, results, count);
+    return 1;
+}
+
+static const Boot_Milestone BOOT_MILESTONES[] = {
+    {"firmware_handoff",      "Booting from ROM",                        false},
+    {"kernel_start",          "Linux version ",                          true},
+    {"initramfs_start",       "Run /init as init process",               true},
+    {"airootfs_mounted",      "running in system mode",                  true},
+    {"autologin",             BOOT_MARK_PREFIX "autologin",              true},
+    {"installer_first_frame", BOOT_MARK_PREFIX "installer-first-frame",  true},
+    {"keyring_ready",         BOOT_MARK_PREFIX "keyring-ready",          true},
+};
+
+#define BOOT_MILESTONE_COUNT (sizeof(BOOT_MILESTONES) / sizeof(BOOT_MILESTONES[0]))
+
+static int read_boot_entry(const char *iso_path, Boot_Entry *entry) {
+    char cmd[CMD_MAX_LEN];
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf " BOOT_BENCH_DIR " && mkdir -p " BOOT_BENCH_DIR " && "
+             "bsdtar -xf '%s' -C " BOOT_BENCH_DIR " boot/syslinux/syslinux.cfg",
+             iso_path);
+    if (!run_command(cmd)) {
+        log_error("Failed to read the boot entry from %s (is bsdtar installed?)", iso_path);
+        return 0;
+    }
+
+    FILE *fp = fopen(BOOT_BENCH_DIR "/boot/syslinux/syslinux.cfg", "r");
+    if (!fp) {
+        log_error("No syslinux.cfg in %s", iso_path);
+        return 0;
+    }
+
+    char kernel[PATH_MAX_LEN] = "";
+    char initrd[PATH_MAX_LEN] = "";
+    entry->cmdline[0] = '\0';
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *p = line + strspn(line, " \t");
+        p[strcspn(p, "\r\n")] = '\0';
+        if (strncasecmp(p, "LINUX ", 6) == 0 && !kernel[0]) {
+            snprintf(kernel, sizeof(kernel), "%s", p + 6 + strspn(p + 6, " /"));
+        } else if (strncasecmp(p, "INITRD ", 7) == 0 && !initrd[0]) {
+            snprintf(initrd, sizeof(initrd), "%s", p + 7 + strspn(p + 7, " /"));
+        } else if (strncasecmp(p, "APPEND ", 7) == 0 && !entry->cmdline[0]) {
+            snprintf(entry->cmdline, sizeof(entry->cmdline), "%s", p + 7 + strspn(p + 7, " "));
+        }
+    }
+    fclose(fp);
+
+    if (!kernel[0] || !initrd[0]) {
+        log_error("Could not find the default boot entry in %s", iso_path);
+        return 0;
+    }
+
+    snprintf(cmd, sizeof(cmd), "bsdtar -xf '%s' -C " BOOT_BENCH_DIR " '%s' '%s'", iso_path, kernel, initrd);
+    if (!run_command(cmd)) {
+        log_error("Failed to extract the kernel and initramfs from %s", iso_path);
+        return 0;
+    }
+
+    snprintf(entry->kernel, sizeof(entry->kernel), BOOT_BENCH_DIR "/%s", kernel);
+    snprintf(entry->initrd, sizeof(entry->initrd), BOOT_BENCH_DIR "/%s", initrd);
+    return 1;
+}
+
+static pid_t spawn_boot_vm(const char *iso_path, const Boot_Entry *entry, bool kvm, int *out_fd) {
+    char append[2048];
+    char drive[PATH_MAX_LEN + 64];
+    char smp[16];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    snprintf(append, sizeof(append), "%s " BOOT_BENCH_CMDLINE, entry->cmdline);
+    snprintf(drive, sizeof(drive), "file=%s,media=cdrom,readonly=on", iso_path);
+    snprintf(smp, sizeof(smp), "%ld", cpus > 4 ? 4 : cpus > 0 ? cpus : 1);
+
+    char *const argv[] = {
+        "qemu-system-x86_64",
+        "-machine", kvm ? "q35,accel=kvm" : "q35,accel=tcg",
+        "-cpu", kvm ? "host" : "max",
+        "-smp", smp,
+        "-m", "4096",
+        "-display", "none",
+        "-monitor", "none",
+        "-no-reboot",
+        "-kernel", (char *)entry->kernel,
+        "-initrd", (char *)entry->initrd,
+        "-append", append,
+        "-drive", drive,
+        "-netdev", "user,id=net0",
+        "-device", "virtio-net-pci,netdev=net0",
+        "-chardev", "stdio,id=console,mux=on,signal=off",
+        "-serial", "chardev:console",
+        "-device", "isa-debugcon,iobase=0x402,chardev=console",
+        NULL
+    };
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        log_error("Failed to create a pipe for the VM console");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_error("Failed to fork QEMU");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    *out_fd = fds[0];
+    return pid;
+}
+
+static void boot_trace_line(Boot_Trace *trace, const char *line, double host) {
+    double guest;
+    bool stamped = sscanf(line, "[%lf]", &guest) == 1;
+    if (stamped && (!trace->have_offset || host - guest < trace->kernel_offset)) {
+        trace->kernel_offset = host - guest;
+        trace->have_offset = true;
+    }
+
+    for (size_t i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+        const Boot_Milestone *m = &BOOT_MILESTONES[i];
+        if (trace->seen[i] || (m->guest_clock && !stamped) || !strstr(line, m->pattern)) continue;
+        trace->seen[i] = true;
+        trace->seconds[i] = m->guest_clock ? guest : host;
+        trace->remaining--;
+        log_info("Boot milestone %s after %.2fs", m->name, host);
+    }
+}
+
+static int trace_boot(const char *iso_path, const Boot_Entry *entry, bool kvm, const char *serial_log, Boot_Trace *trace) {
+    memset(trace, 0, sizeof(*trace));
+    trace->remaining = BOOT_MILESTONE_COUNT;
+
+    int fd;
+    double launch = monotonic_seconds();
+    pid_t pid = spawn_boot_vm(iso_path, entry, kvm, &fd);
+    if (pid < 0) {
+        return 0;
+    }
+
+    FILE *log_fp = fopen(serial_log, "w");
+    char buf[4096];
+    char line[1024];
+    size_t len = 0;
+    while (trace->remaining > 0) {
+        double left = launch + BOOT_BENCH_TIMEOUT - monotonic_seconds();
+        if (left <= 0) {
+            log_warn("Timed out after %ds waiting for the installer", BOOT_BENCH_TIMEOUT);
+            break;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, (int)(left * 1000) + 1);
+        if (ready <= 0) continue;
+
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            log_warn("QEMU exited before the installer started, see %s", serial_log);
+            break;
+        }
+
+        double now = monotonic_seconds() - launch;
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == '\r') continue;
+            if (buf[i] != '\n' && len < sizeof(line) - 1) {
+                line[len++] = buf[i];
+                continue;
+            }
+            line[len] = '\0';
+            if (log_fp) fprintf(log_fp, "%10.3f %s\n", now, line);
+            boot_trace_line(trace, line, now);
+            len = 0;
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(fd);
+    if (log_fp) fclose(log_fp);
+    return 1;
+}
+
+static void load_previous_boot_report(const char *path, double *previous, bool *have_previous) {
+    memset(have_previous, 0, BOOT_MILESTONE_COUNT * sizeof(bool));
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char name[64];
+        double value;
+        if (sscanf(line, " \"%63[^\"]\": %lf", name, &value) != 2) continue;
+        for (size_t i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+            if (strcmp(BOOT_MILESTONES[i].name, name) == 0) {
+                previous[i] = value;
+                have_previous[i] = true;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static int report_boot_bench(const Build_Config *config, const char *iso_path, bool kvm, const Boot_Trace *trace) {
+    char report_path[PATH_MAX_LEN];
+    snprintf(report_path, sizeof(report_path), "%s/" BOOT_BENCH_REPORT, config->out_dir);
+
+    double previous[BOOT_MILESTONE_COUNT];
+    bool have_previous[BOOT_MILESTONE_COUNT];
+    load_previous_boot_report(report_path, previous, have_previous);
+
+    double seconds[BOOT_MILESTONE_COUNT];
+    bool seen[BOOT_MILESTONE_COUNT];
+    for (size_t i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+        seen[i] = trace->seen[i] && (!BOOT_MILESTONES[i].guest_clock || trace->have_offset);
+        seconds[i] = BOOT_MILESTONES[i].guest_clock ? trace->kernel_offset + trace->seconds[i] : trace->seconds[i];
+    }
+
+    Build_Manifest manifest;
+    manifest_load(config, &manifest);
+    const Compression_Profile *profile = current_compression_profile(config);
+    struct stat st;
+    long long iso_bytes = stat(iso_path, &st) == 0 ? (long long)st.st_size : 0;
+
+    FILE *fp = create_directory(config->out_dir, 0755) ? fopen(report_path, "w") : NULL;
+    if (!fp) {
+        log_error("Failed to write %s", report_path);
+        return 0;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"iso\": \"%s\",\n", iso_path);
+    fprintf(fp, "  \"iso_bytes\": %lld,\n", iso_bytes);
+    fprintf(fp, "  \"build\": \"%s\",\n", strcmp(manifest.iso_path, iso_path) == 0 ? manifest.iso : "");
+    fprintf(fp, "  \"compression\": \"%s\",\n", profile ? profile->name : "custom");
+    fprintf(fp, "  \"accel\": \"%s\",\n", kvm ? "kvm" : "tcg");
+    fprintf(fp, "  \"complete\": %s,\n", trace->remaining == 0 ? "true" : "false");
+    fprintf(fp, "  \"milestones\": {\n");
+    for (size_t i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+        const char *sep = i + 1 < BOOT_MILESTONE_COUNT ? "," : "";
+        if (seen[i]) {
+            fprintf(fp, "    \"%s\": %.3f%s\n", BOOT_MILESTONES[i].name, seconds[i], sep);
+        } else {
+            fprintf(fp, "    \"%s\": null%s\n", BOOT_MILESTONES[i].name, sep);
+        }
+    }
+    fprintf(fp, "  }\n}\n");
+    if (fclose(fp) != 0) {
+        log_error("Failed to write %s", report_path);
+        return 0;
+    }
+
+    log_info("| milestone             | seconds | phase s | vs last |");
+    double last = 0;
+    for (size_t i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+        if (!seen[i]) {
+            log_info("| %-21s | %7s | %7s | %7s |", BOOT_MILESTONES[i].name, "-", "-", "-");
+            continue;
+        }
+        char delta[16] = "-";
+        if (have_previous[i]) {
+            snprintf(delta, sizeof(delta), "%+.2f", seconds[i] - previous[i]);
+        }
+        log_info("| %-21s | %7.2f | %7.2f | %7s |", BOOT_MILESTONES[i].name, seconds[i], seconds[i] - last, delta);
+        last = seconds[i];
+    }
+    log_info("Report written to %s", report_path);
+    return 1;
+}
+
+int run_boot_bench(const Build_Config *config) {
+    const char *iso_path = config->bench_iso[0] ? config->bench_iso : find_latest_iso(config->out_dir);
+    if (!iso_path || access(iso_path, R_OK) != 0) {
+        log_error("No ISO to boot, build one first or pass --bench-boot PATH");
+        return 0;
+    }
+    if (system("command -v qemu-system-x86_64 >/dev/null 2>&1") != 0) {
+        log_error("qemu-system-x86_64 not found");
+        return 0;
+    }
+
+    bool kvm = access("/dev/kvm", R_OK | W_OK) == 0;
+    if (!kvm) {
+        log_warn("/dev/kvm not available, booting with TCG emulation (much slower)");
+    }
+    log_info("Measuring boot latency of %s (%s)", iso_path, kvm ? "KVM" : "TCG");
+
+    Boot_Entry entry;
+    if (!read_boot_entry(iso_path, &entry)) {
+        return 0;
+    }
+
+    char serial_log[PATH_MAX_LEN];
+    snprintf(serial_log, sizeof(serial_log), "%s/" BOOT_BENCH_SERIAL_LOG, config->out_dir);
+    if (!create_directory(config->out_dir, 0755)) {
+        return 0;
+    }
+
+    Boot_Trace trace;
+    if (!trace_boot(iso_path, &entry, kvm, serial_log, &trace)) {
+        return 0;
+    }
+
+    int reported = report_boot_bench(config, iso_path, kvm, &trace);
+    if (trace.remaining > 0) {
+        log_error("Boot did not reach every milestone, serial console saved to %s", serial_log);
+        return 0;
+    }
+    return reported;
+}
+
 const char *find_latest_iso(const char *out_dir) {
     static char iso_path[PATH_MAX_LEN];
     char cmd[CMD_MAX_LEN];
@@ -379,6 +1420,12 @@ static void print_usage(const char *prog_name) {
     printf("  --out-dir PATH        Output directory for ISO (default: ./out)\n");
     printf("  --container [TYPE]    Build using container (podman or distrobox)\n");
     printf("  --distrobox NAME      Distrobox container name (default: arch)\n");
+    printf("  --offline-repo        Bake every installer package into the ISO\n");
+    printf("  --clean               Ignore the build manifest and rebuild every stage\n");
+    printf("  --refresh-builder     Rebuild the podman builder image\n");
+    printf("  --bench-compression   Benchmark live image compression on the last build's airootfs\n");
+    printf("  --compression NAME    Set the live image compression profile in profiledef.sh\n");
+    printf("  --bench-boot [ISO]    Boot an ISO headless in QEMU and time it up to the installer\n");
     printf("  -h, --help            Show this help message\n");
 }
 
@@ -407,6 +1454,21 @@ static int parse_args(int argc, char *argv[], Build_Config *config) {
             snprintf(config->distrobox_name, sizeof(config->distrobox_name), "%s", argv[++i]);
             config->use_container = true;
             config->container_type = CONTAINER_DISTROBOX;
+        } else if (strcmp(argv[i], "--offline-repo") == 0) {
+            config->offline_repo = true;
+        } else if (strcmp(argv[i], "--clean") == 0) {
+            config->clean = true;
+        } else if (strcmp(argv[i], "--refresh-builder") == 0) {
+            config->refresh_builder = true;
+        } else if (strcmp(argv[i], "--bench-compression") == 0) {
+            config->bench_compression = true;
+        } else if (strcmp(argv[i], "--bench-boot") == 0) {
+            config->bench_boot = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                snprintf(config->bench_iso, sizeof(config->bench_iso), "%s", argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--compression") == 0 && i + 1 < argc) {
+            snprintf(config->compression, sizeof(config->compression), "%s", argv[++i]);
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             print_usage(argv[0]);
             exit(0);
@@ -419,6 +1481,94 @@ static int parse_args(int argc, char *argv[], Build_Config *config) {
     return 1;
 }
 
+static bool stage_fresh(const char *saved, const char *current) {
+    return current[0] != '\0' && strcmp(saved, current) == 0;
+}
+
+static int stage_builder_image(Build_Context *ctx) {
+    return ensure_builder_image(ctx->config);
+}
+
+static int stage_static_binary(Build_Context *ctx) {
+    char binary_path[PATH_MAX_LEN];
+    snprintf(binary_path, sizeof(binary_path), "%s/tonarchy-static", ctx->config->tonarchy_src);
+    if (stage_fresh(ctx->manifest->binary, ctx->current->binary) && access(binary_path, X_OK) == 0) {
+        log_info("Installer sources unchanged, reusing %s", binary_path);
+        return 1;
+    }
+
+    if (!build_tonarchy_static(ctx->config)) {
+        return 0;
+    }
+    manifest_set(ctx->config, ctx->manifest, ctx->manifest->binary, ctx->current->binary);
+    return 1;
+}
+
+static int stage_clean_airootfs(Build_Context *ctx) {
+    return clean_airootfs(ctx->config);
+}
+
+static int stage_assets(Build_Context *ctx) {
+    return prepare_airootfs(ctx->config);
+}
+
+static int stage_install_binary(Build_Context *ctx) {
+    return install_tonarchy_binary(ctx->config);
+}
+
+static int stage_offline_repo(Build_Context *ctx) {
+    return build_offline_repo(ctx->config, ctx->manifest);
+}
+
+static int stage_work_dir(Build_Context *ctx) {
+    int ready = stage_fresh(ctx->manifest->packages, ctx->current->packages)
+        ? reset_work_dir(ctx->config)
+        : move_work_dir_aside(ctx->config);
+    if (!ready) {
+        return 0;
+    }
+
+    manifest_set(ctx->config, ctx->manifest, ctx->manifest->packages, "");
+    manifest_set(ctx->config, ctx->manifest, ctx->manifest->iso, "");
+    return 1;
+}
+
+static int stage_remove_old_work(Build_Context *ctx) {
+    return clean_work_dir(ctx->config);
+}
+
+static int stage_mkarchiso(Build_Context *ctx) {
+    const Build_Config *config = ctx->config;
+    if (config->use_container && config->container_type == CONTAINER_PODMAN) {
+        return run_mkarchiso_in_container(config);
+    }
+    return run_mkarchiso(config);
+}
+
+static void compute_stage_keys(const Build_Config *config, Build_Manifest *keys) {
+    memset(keys, 0, sizeof(*keys));
+
+    const char *container = !config->use_container ? "native"
+        : config->container_type == CONTAINER_PODMAN ? "podman" : "distrobox";
+    char inputs[CMD_MAX_LEN / 2];
+    char extra[256];
+
+    snprintf(inputs, sizeof(inputs), "'%s/src/tonarchy.c' '%s/src/tonarchy.h'",
+             config->tonarchy_src, config->tonarchy_src);
+    hash_inputs(config, inputs, container, keys->binary);
+
+    snprintf(inputs, sizeof(inputs),
+             "'%s/packages.x86_64' '%s/pacman.conf' '%s/profiledef.sh' '%s/airootfs/etc/mkinitcpio.conf.d'",
+             config->iso_profile, config->iso_profile, config->iso_profile, config->iso_profile);
+    snprintf(extra, sizeof(extra), "offline=%d", config->offline_repo);
+    hash_inputs(config, inputs, extra, keys->packages);
+
+    snprintf(inputs, sizeof(inputs), "'%s/src' '%s/assets' '%s'",
+             config->tonarchy_src, config->tonarchy_src, config->iso_profile);
+    snprintf(extra, sizeof(extra), "%s offline=%d epoch=%s", container, config->offline_repo, config->source_date_epoch);
+    hash_inputs(config, inputs, extra, keys->iso);
+}
+
 int main(int argc, char *argv[]) {
     logger_init("/tmp/build_iso.log");
 
@@ -428,7 +1578,8 @@ int main(int argc, char *argv[]) {
         .work_dir = "/tmp/tonarchy_iso_work",
         .distrobox_name = "arch",
         .container_type = CONTAINER_NONE,
-        .use_container = false
+        .use_container = false,
+        .offline_repo = false
     };
 
     if (getcwd(config.tonarchy_src, sizeof(config.tonarchy_src)) == NULL) {
@@ -457,45 +1608,86 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (!build_tonarchy_static(&config)) {
-        log_error("Build failed");
-        logger_close();
-        return 1;
+    if (config.compression[0]) {
+        const Compression_Profile *profile = find_compression_profile(config.compression);
+        if (!profile) {
+            log_error("Unknown compression profile: %s", config.compression);
+            for (size_t i = 0; i < COMPRESSION_PROFILE_COUNT; i++) {
+                log_error("  %s", COMPRESSION_PROFILES[i].name);
+            }
+            logger_close();
+            return 1;
+        }
+        if (!apply_compression_profile(&config, profile)) {
+            logger_close();
+            return 1;
+        }
     }
 
-    if (!clean_airootfs(&config)) {
-        log_error("Failed to clean airootfs");
+    if (config.bench_compression) {
+        int benched = run_compression_bench(&config);
         logger_close();
-        return 1;
+        return benched ? 0 : 1;
     }
 
-    if (!clean_work_dir(&config)) {
-        log_error("Failed to clean work directory");
+    if (config.bench_boot) {
+        int benched = run_boot_bench(&config);
         logger_close();
-        return 1;
+        return benched ? 0 : 1;
     }
 
-    if (!prepare_airootfs(&config)) {
-        log_error("Failed to prepare airootfs");
-        logger_close();
-        return 1;
+    detect_source_date_epoch(&config);
+    if (config.source_date_epoch[0]) {
+        log_info("SOURCE_DATE_EPOCH: %s", config.source_date_epoch);
     }
 
-    int build_result;
-    if (config.use_container && config.container_type == CONTAINER_PODMAN) {
-        build_result = run_mkarchiso_in_container(&config);
-    } else {
-        build_result = run_mkarchiso(&config);
+    Build_Manifest manifest;
+    manifest_load(&config, &manifest);
+    if (config.clean) {
+        memset(&manifest, 0, sizeof(manifest));
     }
 
-    if (!build_result) {
-        log_error("Failed to build ISO");
+    Build_Manifest current;
+    compute_stage_keys(&config, &current);
+
+    if (stage_fresh(manifest.iso, current.iso) && access(manifest.iso_path, F_OK) == 0) {
+        log_info("===================================");
+        log_info("ISO inputs unchanged, nothing to build");
+        log_info("Location: %s", manifest.iso_path);
+        log_info("===================================");
         logger_close();
-        return 1;
+        return 0;
     }
 
-    if (!clean_work_dir(&config)) {
-        log_warn("Failed to clean work directory after build");
+    bool podman = config.use_container && config.container_type == CONTAINER_PODMAN;
+    Build_Context ctx = { .config = &config, .manifest = &manifest, .current = &current };
+    Build_Job jobs[] = {
+        { .name = "builder image",   .run = stage_builder_image,   .enabled = podman },
+        { .name = "static binary",   .run = stage_static_binary,   .enabled = true,
+          .deps = { "builder image" } },
+        { .name = "clean airootfs",  .run = stage_clean_airootfs,  .enabled = true },
+        { .name = "stage assets",    .run = stage_assets,          .enabled = true,
+          .deps = { "clean airootfs" } },
+        { .name = "install binary",  .run = stage_install_binary,  .enabled = true,
+          .deps = { "static binary", "stage assets" } },
+        { .name = "offline repo",    .run = stage_offline_repo,    .enabled = config.offline_repo,
+          .deps = { "static binary", "clean airootfs", "builder image" } },
+        { .name = "work dir",        .run = stage_work_dir,        .enabled = true },
+        { .name = "remove old work", .run = stage_remove_old_work, .enabled = true,
+          .deps = { "work dir" } },
+        { .name = "mkarchiso",       .run = stage_mkarchiso,       .enabled = true,
+          .deps = { "install binary", "offline repo", "work dir", "builder image" } },
+    };
+
+    time_t build_start = time(NULL);
+    if (!run_jobs(jobs, sizeof(jobs) / sizeof(jobs[0]), &ctx)) {
+        Build_Job *mkarchiso = &jobs[sizeof(jobs) / sizeof(jobs[0]) - 1];
+        if (mkarchiso->state != JOB_DONE) {
+            log_error("Failed to build ISO");
+            logger_close();
+            return 1;
+        }
+        log_warn("ISO built, but a background stage failed");
     }
 
     log_info("Syncing filesystem...");
@@ -503,7 +1695,18 @@ int main(int argc, char *argv[]) {
     sleep(2);
 
     const char *iso_path = find_latest_iso(config.out_dir);
+    struct stat iso_st;
+    if (iso_path && (stat(iso_path, &iso_st) != 0 || iso_st.st_mtime < build_start)) {
+        log_error("mkarchiso did not write a new ISO, newest is %s", iso_path);
+        logger_close();
+        return 1;
+    }
     if (iso_path) {
+        snprintf(manifest.packages, sizeof(manifest.packages), "%s", current.packages);
+        snprintf(manifest.iso, sizeof(manifest.iso), "%s", current.iso);
+        snprintf(manifest.iso_path, sizeof(manifest.iso_path), "%s", iso_path);
+        manifest_save(&config, &manifest);
+
         log_info("===================================");
         log_info("ISO created successfully!");
         log_info("Location: %s", iso_path);
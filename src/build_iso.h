@@ -11,9 +11,37 @@
 #include <sys/types.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #define PATH_MAX_LEN 1024
 #define CMD_MAX_LEN 4096
+#define OFFLINE_REPO_PATH "airootfs/opt/tonarchy/repo"
+#define OFFLINE_REPO_NAME "tonarchy"
+#define BUILDER_IMAGE "localhost/tonarchy-builder:2"
+#define BUILDER_BASE_IMAGE "docker.io/archlinux:latest"
+#define BUILDER_PACKAGES "archiso musl gcc make erofs-utils"
+#define BUILDER_DIR "/tmp/tonarchy-builder"
+#define PACMAN_CACHE_VOLUME "tonarchy-pacman-cache"
+#define PACMAN_CACHE_MOUNT "-v " PACMAN_CACHE_VOLUME ":/var/cache/pacman/pkg "
+#define BUILD_MANIFEST ".build-manifest"
+#define WORK_DIR_ASIDE_SUFFIX ".old-"
+#define MAX_JOB_DEPS 4
+#define BENCH_DIR "/tmp/tonarchy-bench"
+#define BENCH_REPORT "compression-bench.org"
+#define BENCH_USB_MIB_PER_SEC 40.0
+#define HASH_HEX_LEN 64
+#define BOOT_BENCH_DIR "/tmp/tonarchy-boot-bench"
+#define BOOT_BENCH_REPORT "boot-bench.json"
+#define BOOT_BENCH_SERIAL_LOG "boot-bench-serial.log"
+#define BOOT_BENCH_TIMEOUT 600
+#define BOOT_BENCH_CMDLINE "console=ttyS0,115200 printk.time=1 printk.devkmsg=on tonarchy.bootmarks"
+#define BOOT_MARK_PREFIX "tonarchy-boot: "
+#define BOOT_MILESTONE_MAX 8
 
 typedef enum {
     CONTAINER_NONE,
@@ -29,8 +57,86 @@ typedef struct {
     char distrobox_name[128];
     Container_Type container_type;
     bool use_container;
+    bool offline_repo;
+    bool clean;
+    bool refresh_builder;
+    bool bench_compression;
+    char compression[32];
+    bool bench_boot;
+    char bench_iso[PATH_MAX_LEN];
+    char source_date_epoch[32];
 } Build_Config;
 
+typedef struct {
+    char binary[HASH_HEX_LEN + 1];
+    char packages[HASH_HEX_LEN + 1];
+    char repo[HASH_HEX_LEN + 1];
+    char iso[HASH_HEX_LEN + 1];
+    char iso_path[PATH_MAX_LEN];
+} Build_Manifest;
+
+typedef struct {
+    const char *name;
+    const char *image_type;
+    const char *tool_options;
+} Compression_Profile;
+
+typedef struct {
+    const Compression_Profile *profile;
+    bool ok;
+    unsigned long long image_bytes;
+    double build_seconds;
+    double build_cpu_seconds;
+    unsigned long long read_bytes;
+    double read_seconds;
+    double score;
+} Bench_Result;
+
+typedef struct {
+    const char *name;
+    const char *pattern;
+    bool guest_clock;
+} Boot_Milestone;
+
+typedef struct {
+    char kernel[PATH_MAX_LEN];
+    char initrd[PATH_MAX_LEN];
+    char cmdline[1024];
+} Boot_Entry;
+
+typedef struct {
+    double seconds[BOOT_MILESTONE_MAX];
+    bool seen[BOOT_MILESTONE_MAX];
+    double kernel_offset;
+    bool have_offset;
+    size_t remaining;
+} Boot_Trace;
+
+typedef struct {
+    const Build_Config *config;
+    Build_Manifest *manifest;
+    const Build_Manifest *current;
+} Build_Context;
+
+typedef enum {
+    JOB_PENDING,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED
+} Job_State;
+
+typedef struct {
+    const char *name;
+    int (*run)(Build_Context *ctx);
+    const char *deps[MAX_JOB_DEPS];
+    bool enabled;
+    Job_State state;
+    double start;
+    double end;
+    pthread_t thread;
+    bool joinable;
+} Build_Job;
+
 void logger_init(const char *log_path);
 void logger_close(void);
 
@@ -42,13 +148,31 @@ int run_command(const char *cmd);
 int run_command_in_container(const char *cmd, const Build_Config *config);
 int create_directory(const char *path, mode_t mode);
 
+int hash_inputs(const Build_Config *config, const char *inputs, const char *extra, char *out);
+void manifest_load(const Build_Config *config, Build_Manifest *manifest);
+int manifest_save(const Build_Config *config, const Build_Manifest *manifest);
+int manifest_set(const Build_Config *config, Build_Manifest *manifest, char *field, const char *value);
+void detect_source_date_epoch(Build_Config *config);
+
+int ensure_builder_image(const Build_Config *config);
 int build_tonarchy_static(const Build_Config *config);
 int clean_airootfs(const Build_Config *config);
+int move_work_dir_aside(const Build_Config *config);
 int clean_work_dir(const Build_Config *config);
+int reset_work_dir(const Build_Config *config);
 int prepare_airootfs(const Build_Config *config);
+int install_tonarchy_binary(const Build_Config *config);
+int build_offline_repo(const Build_Config *config, Build_Manifest *manifest);
 int run_mkarchiso(const Build_Config *config);
 int run_mkarchiso_in_container(const Build_Config *config);
 
+int run_jobs(Build_Job *jobs, size_t count, Build_Context *ctx);
+
+const Compression_Profile *find_compression_profile(const char *name);
+int apply_compression_profile(const Build_Config *config, const Compression_Profile *profile);
+int run_compression_bench(const Build_Config *config);
+int run_boot_bench(const Build_Config *config);
+
 const char *find_latest_iso(const char *out_dir);
 
 int detect_container_runtime(void);
@@ -2,9 +2,11 @@
 #include <string.h>
 #include <ctype.h>
 
-static FILE *log_file = NULL;
 static const char *level_strings[] = {"DEBUG", "INFO", "WARN", "ERROR"};
 static struct termios orig_termios;
+static pthread_mutex_t ui_lock = PTHREAD_MUTEX_INITIALIZER;
+static Target_Status *target_status = NULL;
+static char install_log_path[PATH_MAX] = "/tmp/tonarchy-install.log";
 
 static void part_path(char *out, size_t size, const char *disk, int part) {
     if (isdigit(disk[strlen(disk) - 1])) {
@@ -23,1528 +25,6204 @@ static const char *XFCE_PACKAGES = "base base-devel linux linux-firmware linux-h
 
 static const char *OXWM_PACKAGES = "base base-devel linux linux-firmware linux-headers networkmanager git vim neovim curl wget htop btop man-db man-pages openssh sudo xorg-server xorg-xinit xorg-xsetroot xorg-xrandr xorg-xset libx11 libxft freetype2 fontconfig pkg-config lua firefox alacritty vlc evince eog cargo ttf-iosevka-nerd ttf-jetbrains-mono-nerd picom xclip xwallpaper maim rofi pulseaudio pulseaudio-alsa pavucontrol alsa-utils fastfetch ripgrep fd pcmanfm lxappearance papirus-icon-theme gnome-themes-extra";
 
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 static int is_uefi_system(void) {
     struct stat st;
     return stat("/sys/firmware/efi", &st) == 0;
 }
 
-void logger_init(const char *log_path) {
-    log_file = fopen(log_path, "a");
-    if (log_file) {
-        time_t now = time(NULL);
-        char *timestamp = ctime(&now);
-        timestamp[strlen(timestamp) - 1] = '\0';
-        fprintf(log_file, "\n=== Tonarchy Installation Log - %s ===\n", timestamp);
-        fflush(log_file);
+static bool boot_marks;
+
+static bool kernel_cmdline_has(const char *param) {
+    char cmdline[4096] = "";
+    FILE *fp = fopen("/proc/cmdline", "r");
+    if (!fp) return false;
+    bool found = fgets(cmdline, sizeof(cmdline), fp) != NULL && strstr(cmdline, param) != NULL;
+    fclose(fp);
+    return found;
+}
+
+static void boot_mark(const char *milestone) {
+    if (!boot_marks) return;
+    int fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    dprintf(fd, "<5>" BOOT_MARK_PREFIX "%s\n", milestone);
+    close(fd);
+}
+
+static Log_Ring log_ring = { .fd = -1 };
+static pthread_t log_flusher;
+static atomic_bool log_running;
+static atomic_flag log_consumer = ATOMIC_FLAG_INIT;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void log_write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_ring.fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= (size_t)n;
     }
 }
 
-void logger_close(void) {
-    if (log_file) {
-        fclose(log_file);
-        log_file = NULL;
+static size_t log_drain(void) {
+    static char batch[LOG_BATCH_SIZE];
+    size_t used = 0;
+    size_t drained = 0;
+
+    uint64_t dropped = atomic_exchange(&log_ring.dropped, 0);
+    if (dropped > 0) {
+        used += (size_t)snprintf(batch, sizeof(batch), "[WARN] %llu log lines dropped\n", (unsigned long long)dropped);
+    }
+
+    for (;;) {
+        uint64_t pos = log_ring.read_pos;
+        Log_Slot *slot = &log_ring.slots[pos & (LOG_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) break;
+
+        if (used + LOG_LINE_MAX + 64 > sizeof(batch)) {
+            log_write_all(batch, used);
+            used = 0;
+        }
+
+        uint64_t ns = slot->ns - log_ring.start_ns;
+        int len = snprintf(batch + used, sizeof(batch) - used, "[%llu.%09llu] [%s] %s\n",
+                           (unsigned long long)(ns / 1000000000ull),
+                           (unsigned long long)(ns % 1000000000ull),
+                           level_strings[slot->level], slot->text);
+        if (len > 0) used += (size_t)len < sizeof(batch) - used ? (size_t)len : sizeof(batch) - used - 1;
+
+        atomic_store_explicit(&slot->seq, pos + LOG_RING_SLOTS, memory_order_release);
+        log_ring.read_pos = pos + 1;
+        drained++;
     }
+
+    if (used > 0) log_write_all(batch, used);
+    return drained;
 }
 
-void log_msg(Log_Level level, const char *fmt, ...) {
-    if (!log_file) return;
+static void *log_flusher_main(void *arg) {
+    (void)arg;
+    struct timespec idle = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
 
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-
-    fprintf(
-        log_file,
-        "[%02d:%02d:%02d] [%s] ",
-        t->tm_hour,
-        t->tm_min,
-        t->tm_sec,
-        level_strings[level]
-    );
+    while (atomic_load(&log_running)) {
+        size_t drained = 0;
+        if (!atomic_flag_test_and_set(&log_consumer)) {
+            drained = log_drain();
+            atomic_flag_clear(&log_consumer);
+        }
+        if (drained == 0) nanosleep(&idle, NULL);
+    }
 
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(log_file, fmt, args);
-    va_end(args);
+    return NULL;
+}
 
-    fprintf(log_file, "\n");
-    fflush(log_file);
+static void log_crash_handler(int sig) {
+    for (int i = 0; i < 1000 && atomic_flag_test_and_set(&log_consumer); i++) {
+        struct timespec wait = { 0, 1000000L };
+        nanosleep(&wait, NULL);
+    }
+    if (log_ring.fd >= 0) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "[FATAL] signal %d, draining log\n", sig);
+        log_drain();
+        log_write_all(msg, (size_t)len);
+        fsync(log_ring.fd);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-int write_file(const char *path, const char *content) {
-    LOG_INFO("Writing file: %s", path);
-    FILE *fp = fopen(path, "w");
-    if (!fp) {
-        LOG_ERROR("Failed to open file for writing: %s", path);
-        return 0;
+void logger_init(const char *log_path) {
+    log_ring.fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_ring.fd < 0) return;
+
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&log_ring.slots[i].seq, i);
     }
+    atomic_init(&log_ring.write_pos, 0);
+    atomic_init(&log_ring.dropped, 0);
+    log_ring.read_pos = 0;
+    log_ring.start_ns = monotonic_ns();
 
-    if (fprintf(fp, "%s", content) < 0) {
-        LOG_ERROR("Failed to write to file: %s", path);
-        fclose(fp);
-        return 0;
+    time_t now = time(NULL);
+    char *timestamp = ctime(&now);
+    timestamp[strlen(timestamp) - 1] = '\0';
+    char header[128];
+    int len = snprintf(header, sizeof(header), "\n=== Tonarchy Installation Log - %s ===\n", timestamp);
+    log_write_all(header, (size_t)len);
+
+    static const int CRASH_SIGNALS[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    for (size_t i = 0; i < sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]); i++) {
+        signal(CRASH_SIGNALS[i], log_crash_handler);
     }
 
-    fclose(fp);
-    LOG_DEBUG("Successfully wrote file: %s", path);
-    return 1;
+    atomic_store(&log_running, true);
+    if (pthread_create(&log_flusher, NULL, log_flusher_main, NULL) != 0) {
+        atomic_store(&log_running, false);
+    }
 }
 
-int write_file_fmt(const char *path, const char *fmt, ...) {
-    char content[MAX_CMD_SIZE];
-    va_list args;
-
-    va_start(args, fmt);
-    vsnprintf(content, sizeof(content), fmt, args);
-    va_end(args);
+void logger_reopen(const char *log_path) {
+    if (log_ring.fd >= 0) close(log_ring.fd);
+    log_ring.fd = -1;
+    atomic_store(&log_running, false);
+    atomic_flag_clear(&log_consumer);
+    logger_init(log_path);
+}
 
-    return write_file(path, content);
+void logger_flush(void) {
+    if (log_ring.fd < 0) return;
+
+    uint64_t target = atomic_load(&log_ring.write_pos);
+    struct timespec wait = { 0, 1000000L };
+    for (int i = 0; i < 1000; i++) {
+        if (!atomic_flag_test_and_set(&log_consumer)) {
+            log_drain();
+            uint64_t done = log_ring.read_pos;
+            atomic_flag_clear(&log_consumer);
+            if (done >= target) return;
+        }
+        nanosleep(&wait, NULL);
+    }
 }
 
-int set_file_perms(const char *path, mode_t mode, const char *owner, const char *group) {
-    LOG_INFO("Setting permissions for %s: mode=%o owner=%s group=%s", path, mode, owner, group);
+void logger_close(void) {
+    if (log_ring.fd < 0) return;
 
-    if (chmod(path, mode) != 0) {
-        LOG_ERROR("Failed to chmod %s", path);
-        return 0;
+    if (atomic_exchange(&log_running, false)) {
+        pthread_join(log_flusher, NULL);
     }
+    logger_flush();
+    close(log_ring.fd);
+    log_ring.fd = -1;
+}
 
-    char chown_cmd[512];
-    if (strncmp(path, CHROOT_PATH, strlen(CHROOT_PATH)) == 0) {
-        const char *chroot_path = path + strlen(CHROOT_PATH);
-        snprintf(chown_cmd, sizeof(chown_cmd),
-            "arch-chroot %s chown %s:%s %s 2>> /tmp/tonarchy-install.log",
-            CHROOT_PATH, owner, group, chroot_path);
-    } else {
-        snprintf(chown_cmd, sizeof(chown_cmd), "chown %s:%s %s", owner, group, path);
+void log_msg(Log_Level level, const char *fmt, ...) {
+    if (log_ring.fd < 0) return;
+
+    uint64_t pos = atomic_load_explicit(&log_ring.write_pos, memory_order_relaxed);
+    Log_Slot *slot;
+    for (;;) {
+        slot = &log_ring.slots[pos & (LOG_RING_SLOTS - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_ring.write_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&log_ring.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_ring.write_pos, memory_order_relaxed);
+        }
     }
 
-    if (system(chown_cmd) != 0) {
-        LOG_ERROR("Failed to chown %s", path);
-        return 0;
+    slot->ns = monotonic_ns();
+    slot->level = level;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    va_end(args);
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static Trace_Span *trace_spans = NULL;
+static size_t trace_count = 0;
+static size_t trace_cap = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int trace_next_tid = 1;
+static _Thread_local int trace_tid = 0;
+
+long trace_begin(const char *category, const char *name) {
+    if (trace_tid == 0) trace_tid = atomic_fetch_add(&trace_next_tid, 1);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_count == trace_cap) {
+        size_t cap = trace_cap ? trace_cap * 2 : 256;
+        Trace_Span *spans = realloc(trace_spans, cap * sizeof(*spans));
+        if (!spans) {
+            pthread_mutex_unlock(&trace_lock);
+            return -1;
+        }
+        trace_spans = spans;
+        trace_cap = cap;
     }
 
-    return 1;
+    long id = (long)trace_count++;
+    Trace_Span *span = &trace_spans[id];
+    memset(span, 0, sizeof(*span));
+    snprintf(span->name, sizeof(span->name), "%s", name);
+    snprintf(span->category, sizeof(span->category), "%s", category);
+    span->tid = trace_tid;
+    span->status = -1;
+    span->start_ns = monotonic_ns();
+    pthread_mutex_unlock(&trace_lock);
+
+    return id;
 }
 
-int create_directory(const char *path, mode_t mode) {
-    LOG_INFO("Creating directory: %s", path);
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s", path);
+void trace_end(long id, int status, size_t output_bytes) {
+    if (id < 0) return;
+    uint64_t now = monotonic_ns();
 
-    if (system(cmd) != 0) {
-        LOG_ERROR("Failed to create directory: %s", path);
+    pthread_mutex_lock(&trace_lock);
+    if ((size_t)id < trace_count) {
+        trace_spans[id].end_ns = now;
+        trace_spans[id].status = status;
+        trace_spans[id].output_bytes = output_bytes;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_write_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+int trace_write(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        LOG_WARN("Failed to open trace file %s", path);
         return 0;
     }
 
-    if (chmod(path, mode) != 0) {
-        LOG_WARN("Failed to set permissions on directory: %s", path);
+    pthread_mutex_lock(&trace_lock);
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tonarchy\"}}");
+    for (size_t i = 0; i < trace_count; i++) {
+        const Trace_Span *span = &trace_spans[i];
+        uint64_t end = span->end_ns ? span->end_ns : span->start_ns;
+        fprintf(fp, ",\n{\"name\":");
+        trace_write_string(fp, span->name);
+        fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"status\":%d,\"output_bytes\":%zu}}",
+                span->category, span->tid,
+                (double)(span->start_ns - log_ring.start_ns) / 1e3,
+                (double)(end - span->start_ns) / 1e3,
+                span->status, span->output_bytes);
     }
+    fprintf(fp, "\n]}\n");
+    pthread_mutex_unlock(&trace_lock);
 
+    if (fclose(fp) != 0) {
+        LOG_WARN("Failed to write trace file %s", path);
+        return 0;
+    }
+    LOG_INFO("Wrote %zu trace spans to %s", trace_count, path);
     return 1;
 }
 
-int chroot_exec(const char *cmd) {
-    char full_cmd[MAX_CMD_SIZE];
-    snprintf(full_cmd, sizeof(full_cmd),
-        "arch-chroot %s /bin/bash -c '%s' >> /tmp/tonarchy-install.log 2>&1",
-        CHROOT_PATH, cmd);
-
-    LOG_INFO("Executing in chroot: %s", cmd);
-    LOG_DEBUG("Full command: %s", full_cmd);
+static int compare_span_duration(const void *a, const void *b) {
+    const Trace_Span *x = a;
+    const Trace_Span *y = b;
+    uint64_t dx = x->end_ns - x->start_ns;
+    uint64_t dy = y->end_ns - y->start_ns;
+    return dx < dy ? 1 : dx > dy ? -1 : 0;
+}
 
-    int result = system(full_cmd);
-    if (result != 0) {
-        LOG_ERROR("Chroot command failed (exit %d): %s", result, cmd);
-        return 0;
+size_t trace_slowest(Trace_Span *out, size_t max) {
+    pthread_mutex_lock(&trace_lock);
+    Trace_Span *sorted = malloc(trace_count * sizeof(*sorted) + 1);
+    size_t count = 0;
+    if (sorted) {
+        for (size_t i = 0; i < trace_count; i++) {
+            if (trace_spans[i].end_ns) sorted[count++] = trace_spans[i];
+        }
     }
+    pthread_mutex_unlock(&trace_lock);
+    if (!sorted) return 0;
 
-    LOG_DEBUG("Chroot command succeeded: %s", cmd);
-    return 1;
+    qsort(sorted, count, sizeof(*sorted), compare_span_duration);
+    if (count > max) count = max;
+    memcpy(out, sorted, count * sizeof(*sorted));
+    free(sorted);
+    return count;
 }
 
-int chroot_exec_fmt(const char *fmt, ...) {
-    char cmd[MAX_CMD_SIZE];
-    va_list args;
+static char *format_alloc_v(const char *fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (len < 0) return NULL;
+
+    char *buf = malloc((size_t)len + 1);
+    if (!buf) return NULL;
+    vsnprintf(buf, (size_t)len + 1, fmt, args);
+    return buf;
+}
 
+static char *format_alloc(const char *fmt, ...) {
+    va_list args;
     va_start(args, fmt);
-    vsnprintf(cmd, sizeof(cmd), fmt, args);
+    char *buf = format_alloc_v(fmt, args);
     va_end(args);
+    return buf;
+}
 
-    return chroot_exec(cmd);
+void cmd_init(Cmd *cmd, const char *program) {
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->pid = -1;
+    cmd->span = -1;
+    cmd->fds[0] = cmd->fds[1] = -1;
+    cmd_arg(cmd, program);
 }
 
-int chroot_exec_as_user(const char *username, const char *cmd) {
-    char full_cmd[MAX_CMD_SIZE * 2];
-    snprintf(full_cmd, sizeof(full_cmd), "sudo -u %s %s", username, cmd);
-    return chroot_exec(full_cmd);
+void cmd_arg(Cmd *cmd, const char *arg) {
+    if (cmd->failed) return;
+
+    if (cmd->argc + 2 > cmd->cap) {
+        size_t cap = cmd->cap ? cmd->cap * 2 : 8;
+        char **argv = realloc(cmd->argv, cap * sizeof(char *));
+        if (!argv) {
+            cmd->failed = true;
+            return;
+        }
+        cmd->argv = argv;
+        cmd->cap = cap;
+    }
+
+    cmd->argv[cmd->argc] = strdup(arg);
+    if (!cmd->argv[cmd->argc]) {
+        cmd->failed = true;
+        return;
+    }
+    cmd->argv[++cmd->argc] = NULL;
 }
 
-int chroot_exec_as_user_fmt(const char *username, const char *fmt, ...) {
-    char cmd[MAX_CMD_SIZE];
+void cmd_argf(Cmd *cmd, const char *fmt, ...) {
     va_list args;
-
     va_start(args, fmt);
-    vsnprintf(cmd, sizeof(cmd), fmt, args);
+    char *arg = format_alloc_v(fmt, args);
     va_end(args);
 
-    return chroot_exec_as_user(username, cmd);
+    if (!arg) {
+        cmd->failed = true;
+        return;
+    }
+    cmd_arg(cmd, arg);
+    free(arg);
 }
 
-int git_clone_as_user(const char *username, const char *repo_url, const char *dest_path) {
-    LOG_INFO("Cloning %s to %s as user %s", repo_url, dest_path, username);
-    return chroot_exec_as_user_fmt(username, "git clone %s %s", repo_url, dest_path);
+void cmd_args_split(Cmd *cmd, const char *list) {
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ') p++;
+        const char *end = p;
+        while (*end && *end != ' ') end++;
+        if (end > p) {
+            char *word = strndup(p, (size_t)(end - p));
+            if (!word) {
+                cmd->failed = true;
+                return;
+            }
+            cmd_arg(cmd, word);
+            free(word);
+        }
+        p = end;
+    }
 }
 
-int make_clean_install(const char *build_dir) {
-    LOG_INFO("Building and installing from %s", build_dir);
-    return chroot_exec_fmt("cd %s && make clean install", build_dir);
+void cmd_free(Cmd *cmd) {
+    for (size_t i = 0; i < cmd->argc; i++) {
+        free(cmd->argv[i]);
+    }
+    free(cmd->argv);
+    free(cmd->output);
+    cmd->argv = NULL;
+    cmd->output = NULL;
+    cmd->argc = cmd->cap = cmd->output_len = 0;
 }
 
-int create_user_dotfile(const char *username, const Dotfile *dotfile) {
-    char full_path[512];
-    snprintf(full_path, sizeof(full_path), "%s/home/%s/%s", CHROOT_PATH, username, dotfile->filename);
-
-    LOG_INFO("Creating dotfile %s for user %s", dotfile->filename, username);
-
-    if (!write_file(full_path, dotfile->content)) {
-        return 0;
+static void cmd_describe(const Cmd *cmd, char *out, size_t size) {
+    size_t used = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < cmd->argc && used < size; i++) {
+        int n = snprintf(out + used, size - used, "%s%s", i ? " " : "", cmd->argv[i]);
+        if (n < 0) break;
+        used += (size_t)n;
     }
+}
 
-    if (!set_file_perms(full_path, dotfile->permissions, username, username)) {
-        return 0;
+static int resolve_in_root(const char *root, const char *program, char *out, size_t size) {
+    if (strchr(program, '/')) {
+        snprintf(out, size, "%s", program);
+        return 1;
     }
 
-    return 1;
+    static const char *dirs[] = {"/usr/local/sbin", "/usr/local/bin", "/usr/bin", "/usr/sbin", "/bin", "/sbin"};
+    char host_path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        snprintf(host_path, sizeof(host_path), "%s%s/%s", root, dirs[i], program);
+        if (access(host_path, X_OK) == 0) {
+            snprintf(out, size, "%s/%s", dirs[i], program);
+            return 1;
+        }
+    }
+    return 0;
 }
 
-int setup_systemd_override(const Systemd_Override *override) {
-    char dir_path[1024];
-    char file_path[2048];
+static int spawn_in_root(Cmd *cmd, int in_fd, int out_fd, int err_fd) {
+    char path[PATH_MAX];
+    if (!resolve_in_root(cmd->root, cmd->argv[0], path, sizeof(path))) {
+        return ENOENT;
+    }
 
-    snprintf(dir_path, sizeof(dir_path), "%s/etc/systemd/system/%s", CHROOT_PATH, override->drop_in_dir);
-    snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, override->drop_in_file);
+    pid_t pid = fork();
+    if (pid < 0) return errno;
+
+    if (pid == 0) {
+        if (in_fd < 0) in_fd = open("/dev/null", O_RDONLY);
+        dup2(in_fd, STDIN_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        if (cmd->new_group) setpgid(0, 0);
+        if (chroot(cmd->root) != 0 || chdir("/") != 0) _exit(126);
+        execve(path, cmd->argv, environ);
+        _exit(127);
+    }
 
-    LOG_INFO("Setting up systemd override: %s/%s", override->drop_in_dir, override->drop_in_file);
+    cmd->pid = pid;
+    return 0;
+}
 
-    if (!create_directory(dir_path, 0755)) {
+int cmd_spawn(Cmd *cmd) {
+    if (cmd->failed || cmd->argc == 0) {
+        LOG_ERROR("Refusing to spawn incomplete command");
         return 0;
     }
 
-    FILE *fp = fopen(file_path, "w");
-    if (!fp) {
-        LOG_ERROR("Failed to create systemd override file: %s", file_path);
+    char desc[1024];
+    cmd_describe(cmd, desc, sizeof(desc));
+    if (!cmd->quiet) {
+        LOG_DEBUG("Running%s%s: %s", cmd->root ? " in " : "", cmd->root ? cmd->root : "", desc);
+    }
+    cmd->span = trace_begin(cmd->root ? "chroot" : "cmd", cmd->quiet ? cmd->argv[0] : desc);
+
+    int in_pipe[2] = {-1, -1};
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
+    if ((cmd->input && pipe2(in_pipe, O_CLOEXEC) != 0) ||
+        pipe2(out_pipe, O_CLOEXEC) != 0 ||
+        pipe2(err_pipe, O_CLOEXEC) != 0) {
+        LOG_ERROR("Failed to create pipes for %s", cmd->argv[0]);
+        int fds[] = {in_pipe[0], in_pipe[1], out_pipe[0], out_pipe[1], err_pipe[0], err_pipe[1]};
+        for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
         return 0;
     }
 
-    for (size_t i = 0; i < override->entry_count; i++) {
-        if (override->entries[i].value[0] == '\0') {
-            fprintf(fp, "%s\n", override->entries[i].key);
+    int rc;
+    if (cmd->root) {
+        rc = spawn_in_root(cmd, in_pipe[0], out_pipe[1], err_pipe[1]);
+    } else {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (cmd->input) {
+            posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
         } else {
-            fprintf(fp, "%s=%s\n", override->entries[i].key, override->entries[i].value);
+            posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        }
+        posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+        if (!cmd->terminal) {
+            posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
         }
-    }
 
-    fclose(fp);
-    LOG_INFO("Successfully created systemd override");
-    return 1;
-}
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        if (cmd->new_group) {
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+            posix_spawnattr_setpgroup(&attr, 0);
+        }
 
+        rc = posix_spawnp(&cmd->pid, cmd->argv[0], &actions, &attr, cmd->argv, environ);
 
-static void disable_raw_mode(void) {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
-}
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+    }
 
-static void enable_raw_mode(void) {
-    tcgetattr(STDIN_FILENO, &orig_termios);
-    atexit(disable_raw_mode);
+    if (in_pipe[0] >= 0) close(in_pipe[0]);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    if (rc != 0) {
+        LOG_ERROR("Failed to spawn %s: %s", cmd->argv[0], strerror(rc));
+        trace_end(cmd->span, -1, 0);
+        cmd->span = -1;
+        if (in_pipe[1] >= 0) close(in_pipe[1]);
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        cmd->pid = -1;
+        return 0;
+    }
 
-    struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ECHO | ICANON);
-    raw.c_cc[VMIN] = 1;
-    raw.c_cc[VTIME] = 0;
+    if (cmd->input) {
+        size_t len = strlen(cmd->input);
+        size_t off = 0;
+        while (off < len) {
+            ssize_t n = write(in_pipe[1], cmd->input + off, len - off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            off += (size_t)n;
+        }
+        close(in_pipe[1]);
+    }
 
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    cmd->fds[0] = out_pipe[0];
+    cmd->fds[1] = err_pipe[0];
+    return 1;
 }
 
-static void get_terminal_size(int *rows, int *cols) {
-    struct winsize ws;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
-    *rows = ws.ws_row;
-    *cols = ws.ws_col;
+static void cmd_log_output(Cmd *cmd, int stream, const char *data, size_t len) {
+    char *line = cmd->line[stream];
+    size_t *line_len = &cmd->line_len[stream];
+
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (c == '\n' || c == '\r' || *line_len == sizeof(cmd->line[stream]) - 1) {
+            if (*line_len > 0) {
+                line[*line_len] = '\0';
+                if (cmd->on_line) cmd->on_line(cmd->user, stream, line);
+                LOG_DEBUG("[%s] %s", cmd->argv[0], line);
+                *line_len = 0;
+            }
+            if (c == '\n' || c == '\r') continue;
+        }
+        line[(*line_len)++] = c;
+    }
 }
 
-static void clear_screen(void) {
-    printf("\033[2J\033[H");
-    fflush(stdout);
+static void cmd_capture(Cmd *cmd, const char *data, size_t len) {
+    char *output = realloc(cmd->output, cmd->output_len + len + 1);
+    if (!output) {
+        cmd->failed = true;
+        return;
+    }
+    memcpy(output + cmd->output_len, data, len);
+    cmd->output = output;
+    cmd->output_len += len;
+    cmd->output[cmd->output_len] = '\0';
 }
 
-static void draw_logo(int cols) {
-    const char *logo[] = {
-        "████████╗ ██████╗ ███╗   ██╗ █████╗ ██████╗  ██████╗██╗  ██╗██╗   ██╗",
-        "╚══██╔══╝██╔═══██╗████╗  ██║██╔══██╗██╔══██╗██╔════╝██║  ██║╚██╗ ██╔╝",
-        "   ██║   ██║   ██║██╔██╗ ██║███████║██████╔╝██║     ███████║ ╚████╔╝ ",
-        "   ██║   ██║   ██║██║╚██╗██║██╔══██║██╔══██╗██║     ██╔══██║  ╚██╔╝  ",
-        "   ██║   ╚██████╔╝██║ ╚████║██║  ██║██║  ██║╚██████╗██║  ██║   ██║   ",
-        "   ╚═╝    ╚═════╝ ╚═╝  ╚═══╝╚═╝  ╚═╝╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝   ╚═╝   "
-    };
+int cmd_wait(Cmd *cmd) {
+    if (cmd->pid < 0) return 0;
+
+    char buf[4096];
+    for (;;) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        int stream[2];
+        for (int i = 0; i < 2; i++) {
+            if (cmd->fds[i] < 0) continue;
+            fds[nfds].fd = cmd->fds[i];
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            stream[nfds++] = i;
+        }
+        if (nfds == 0) break;
 
-    int logo_height = 6;
-    int logo_start = (cols - 70) / 2;
+        if (poll(fds, (nfds_t)nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
 
-    printf("\033[1;32m");
-    for (int i = 0; i < logo_height; i++) {
-        printf("\033[%d;%dH%s", i + 2, logo_start, logo[i]);
+        for (int i = 0; i < nfds; i++) {
+            if (!fds[i].revents) continue;
+            int s = stream[i];
+            ssize_t n = read(cmd->fds[s], buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                close(cmd->fds[s]);
+                cmd->fds[s] = -1;
+                continue;
+            }
+
+            cmd->output_bytes += (size_t)n;
+            if (s == 0 && cmd->capture) {
+                cmd_capture(cmd, buf, (size_t)n);
+            } else {
+                cmd_log_output(cmd, s, buf, (size_t)n);
+            }
+        }
     }
-    printf("\033[0m");
-}
 
-static int draw_menu(const char **items, int count, int selected) {
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+    for (int s = 0; s < 2; s++) {
+        if (cmd->fds[s] >= 0) {
+            close(cmd->fds[s]);
+            cmd->fds[s] = -1;
+        }
+        cmd_log_output(cmd, s, "\n", 1);
+    }
 
-    clear_screen();
-    draw_logo(cols);
+    int status = 0;
+    while (waitpid(cmd->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    cmd->pid = -1;
 
-    int logo_start = (cols - 70) / 2;
-    int menu_start_row = 10;
+    if (status >= 0 && WIFEXITED(status)) {
+        cmd->status = WEXITSTATUS(status);
+    } else if (status >= 0 && WIFSIGNALED(status)) {
+        cmd->status = 128 + WTERMSIG(status);
+    } else {
+        cmd->status = -1;
+    }
+    trace_end(cmd->span, cmd->status, cmd->output_bytes);
+    cmd->span = -1;
 
-    for (int i = 0; i < count; i++) {
-        printf("\033[%d;%dH", menu_start_row + i, logo_start + 2);
-        if (i == selected) {
-            printf("\033[1;34m> %s\033[0m", items[i]);
+    if (cmd->status != 0) {
+        if (cmd->quiet) {
+            LOG_ERROR("Command failed (exit %d): %s", cmd->status, cmd->argv[0]);
         } else {
-            printf("\033[37m  %s\033[0m", items[i]);
+            char desc[1024];
+            cmd_describe(cmd, desc, sizeof(desc));
+            LOG_ERROR("Command failed (exit %d): %s", cmd->status, desc);
         }
+        return 0;
     }
+    return !cmd->failed;
+}
 
-    printf("\033[%d;%dH", menu_start_row + count + 2, logo_start);
-    printf("\033[33mj/k Navigate  Enter Select\033[0m");
+int cmd_run(Cmd *cmd) {
+    if (!cmd_spawn(cmd)) return 0;
+    return cmd_wait(cmd);
+}
 
-    fflush(stdout);
-    return 0;
+static void cmd_init_va(Cmd *cmd, const char *program, va_list args) {
+    cmd_init(cmd, program);
+    const char *arg;
+    while ((arg = va_arg(args, const char *)) != NULL) {
+        cmd_arg(cmd, arg);
+    }
 }
 
-static int select_from_menu(const char **items, int count) {
-    int selected = 0;
+int cmd_run_args(const char *program, ...) {
+    Cmd cmd;
+    va_list args;
+    va_start(args, program);
+    cmd_init_va(&cmd, program, args);
+    va_end(args);
 
-    enable_raw_mode();
-    draw_menu(items, count, selected);
-
-    char c;
-    while (read(STDIN_FILENO, &c, 1) == 1) {
-        if (c == 'q' || c == 27) {
-            disable_raw_mode();
-            return -1;
-        }
-
-        if (c == 'j' || c == 66) {
-            if (selected < count - 1) {
-                selected++;
-                draw_menu(items, count, selected);
-            }
-        }
+    int result = cmd_run(&cmd);
+    cmd_free(&cmd);
+    return result;
+}
 
-        if (c == 'k' || c == 65) {
-            if (selected > 0) {
-                selected--;
-                draw_menu(items, count, selected);
-            }
-        }
+static char target_root_path[PATH_MAX] = CHROOT_PATH;
 
-        if (c == '\r' || c == '\n') {
-            disable_raw_mode();
-            return selected;
-        }
-    }
+const char *target_root(void) {
+    return target_root_path;
+}
 
-    disable_raw_mode();
-    return -1;
+void target_set_root(const char *root) {
+    snprintf(target_root_path, sizeof(target_root_path), "%s", root);
 }
 
-void show_message(const char *message) {
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+char *target_path(char *out, size_t size, const char *fmt, ...) {
+    int len = snprintf(out, size, "%s", target_root_path);
+    if (len < 0 || (size_t)len >= size) return out;
 
-    clear_screen();
-    draw_logo(cols);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(out + len, size - (size_t)len, fmt, args);
+    va_end(args);
+    return out;
+}
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH", 10, logo_start);
-    printf("\033[37m%s\033[0m", message);
-    fflush(stdout);
+int write_file(const char *path, const char *content) {
+    LOG_INFO("Writing file: %s", path);
 
-    sleep(2);
-}
+    char *tmp_path = format_alloc("%s.tonarchy-tmp", path);
+    if (!tmp_path) return 0;
 
-static int check_internet_connection(void) {
-    int result = system("ping -c 1 -W 2 1.1.1.1 > /dev/null 2>&1");
-    return result == 0;
-}
+    mode_t mode = 0644;
+    struct stat st;
+    int existed = stat(path, &st) == 0;
+    if (existed) mode = st.st_mode & 07777;
 
-static int list_wifi_networks(char networks[][256], char ssids[][128], int max_networks) {
-    FILE *fp = popen("nmcli -t -f SSID,SIGNAL,SECURITY device wifi list | head -20", "r");
-    if (!fp) {
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open file for writing: %s", path);
+        free(tmp_path);
         return 0;
     }
 
-    int count = 0;
-    char line[512];
-    while (count < max_networks && fgets(line, sizeof(line), fp) != NULL) {
-        line[strcspn(line, "\n")] = '\0';
-
-        char ssid[128], signal[32], security[64];
-        char *token = strtok(line, ":");
-        if (token) strncpy(ssid, token, sizeof(ssid) - 1);
-        token = strtok(NULL, ":");
-        if (token) strncpy(signal, token, sizeof(signal) - 1);
-        token = strtok(NULL, ":");
-        if (token) strncpy(security, token, sizeof(security) - 1);
+    size_t len = strlen(content);
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, content + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += (size_t)n;
+    }
 
-        if (strlen(ssid) > 0 && strcmp(ssid, "--") != 0) {
-            snprintf(ssids[count], 128, "%s", ssid);
-            snprintf(networks[count], 255, "%s (%s%%) [%s]", ssid, signal,
-                     strlen(security) > 0 ? security : "Open");
-            count++;
-        }
+    int ok = off == len;
+    if (ok && existed && (fchown(fd, st.st_uid, st.st_gid) != 0 || fchmod(fd, mode) != 0)) {
+        LOG_WARN("Failed to carry ownership over to %s", path);
     }
-    pclose(fp);
-    return count;
-}
+    if (close(fd) != 0) ok = 0;
 
-static int connect_to_wifi(const char *ssid) {
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+    if (!ok || rename(tmp_path, path) != 0) {
+        LOG_ERROR("Failed to write to file: %s", path);
+        unlink(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
 
-    clear_screen();
-    draw_logo(cols);
+    free(tmp_path);
+    LOG_DEBUG("Successfully wrote file: %s", path);
+    return 1;
+}
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[37mConnecting to: %s\033[0m", 10, logo_start, ssid);
-    printf("\033[%d;%dH\033[37mEnter password (leave empty if open): \033[0m", 12, logo_start);
-    fflush(stdout);
+int write_file_fmt(const char *path, const char *fmt, ...) {
+    va_list args;
 
-    char password[256] = "";
-    struct termios old_term;
-    tcgetattr(STDIN_FILENO, &old_term);
-    struct termios new_term = old_term;
-    new_term.c_lflag &= ~ECHO;
-    new_term.c_lflag |= ICANON;
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_term);
+    va_start(args, fmt);
+    char *content = format_alloc_v(fmt, args);
+    va_end(args);
 
-    if (fgets(password, sizeof(password), stdin) != NULL) {
-        password[strcspn(password, "\n")] = '\0';
+    if (!content) {
+        LOG_ERROR("Failed to format contents for %s", path);
+        return 0;
     }
 
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
-
-    clear_screen();
-    draw_logo(cols);
-    printf("\033[%d;%dH\033[37mConnecting...\033[0m", 10, logo_start);
-    fflush(stdout);
+    int result = write_file(path, content);
+    free(content);
+    return result;
+}
 
-    char cmd[512];
-    if (strlen(password) > 0) {
-        snprintf(cmd, sizeof(cmd), "nmcli device wifi connect '%s' password '%s' > /dev/null 2>&1", ssid, password);
-    } else {
-        snprintf(cmd, sizeof(cmd), "nmcli device wifi connect '%s' > /dev/null 2>&1", ssid);
+char *read_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        LOG_ERROR("Failed to open file for reading: %s", path);
+        return NULL;
     }
 
-    int result = system(cmd);
-    sleep(2);
+    char *content = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&content, &len);
+    char buf[4096];
+    size_t n;
+    int ok = out != NULL;
+    while (ok && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        ok = fwrite(buf, 1, n, out) == n;
+    }
+    ok = ok && !ferror(fp);
+    fclose(fp);
+    if (out) ok = fclose(out) == 0 && ok;
 
-    if (result == 0 && check_internet_connection()) {
-        show_message("Connected successfully!");
-        return 1;
-    } else {
-        show_message("Connection failed. Please try again.");
-        return 0;
+    if (!ok) {
+        LOG_ERROR("Failed to read file: %s", path);
+        free(content);
+        return NULL;
     }
+    return content;
 }
 
-static int setup_wifi_if_needed(void) {
-    if (check_internet_connection()) {
-        return 1;
+int set_file_perms(const char *path, mode_t mode, const char *owner, const char *group) {
+    LOG_INFO("Setting permissions for %s: mode=%o owner=%s group=%s", path, mode, owner, group);
+
+    if (chmod(path, mode) != 0) {
+        LOG_ERROR("Failed to chmod %s", path);
+        return 0;
     }
 
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+    char *owner_group = format_alloc("%s:%s", owner, group);
+    if (!owner_group) return 0;
 
-    clear_screen();
-    draw_logo(cols);
+    int chowned;
+    size_t root_len = strlen(target_root());
+    if (strncmp(path, target_root(), root_len) == 0 && path[root_len] == '/') {
+        const char *chroot_path = path + root_len;
+        chowned = chroot_run_args("chown", owner_group, chroot_path, NULL);
+    } else {
+        chowned = cmd_run_args("chown", owner_group, path, NULL);
+    }
+    free(owner_group);
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[37mNo internet connection detected.\033[0m", 10, logo_start);
-    printf("\033[%d;%dH\033[37mScanning for WiFi networks...\033[0m", 11, logo_start);
-    fflush(stdout);
+    if (!chowned) {
+        LOG_ERROR("Failed to chown %s", path);
+        return 0;
+    }
 
-    system("nmcli radio wifi on > /dev/null 2>&1");
-    sleep(1);
+    return 1;
+}
 
-    char networks[32][256];
-    char ssids[32][128];
-    int network_count = list_wifi_networks(networks, ssids, 32);
+int create_directory(const char *path, mode_t mode) {
+    LOG_INFO("Creating directory: %s", path);
 
-    if (network_count == 0) {
-        show_message("No WiFi networks found. Please check your connection.");
+    char buf[PATH_MAX];
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(buf)) {
+        LOG_ERROR("Invalid directory path: %s", path);
         return 0;
     }
+    memcpy(buf, path, len + 1);
 
-    const char *network_ptrs[32];
-    for (int i = 0; i < network_count; i++) {
-        network_ptrs[i] = networks[i];
+    for (char *p = buf + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+            LOG_ERROR("Failed to create directory %s: %s", buf, strerror(errno));
+            return 0;
+        }
+        *p = '/';
     }
 
-    int selected = select_from_menu(network_ptrs, network_count);
-    if (selected < 0) {
-        show_message("WiFi setup cancelled. Installation requires internet.");
+    struct stat st;
+    if (mkdir(buf, mode) != 0 && (errno != EEXIST || stat(buf, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        LOG_ERROR("Failed to create directory: %s", path);
         return 0;
     }
 
-    return connect_to_wifi(ssids[selected]);
+    if (chmod(path, mode) != 0) {
+        LOG_WARN("Failed to set permissions on directory: %s", path);
+    }
+
+    return 1;
 }
 
-static void draw_form(
-        const char *username,
-        const char *password,
-        const char *confirmed_password,
-        const char *hostname,
-        const char *keyboard,
-        const char *timezone,
-        int current_field
-    ) {
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+int sync_target(void) {
+    const char *TARGET_MOUNTS[] = { target_root(), TARGET_PATH("/boot") };
+    dev_t synced[sizeof(TARGET_MOUNTS) / sizeof(TARGET_MOUNTS[0])];
+    size_t synced_count = 0;
+    int ok = 1;
 
-    clear_screen();
-    draw_logo(cols);
+    for (size_t i = 0; i < sizeof(TARGET_MOUNTS) / sizeof(TARGET_MOUNTS[0]); i++) {
+        int fd = open(TARGET_MOUNTS[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) continue;
 
-    int logo_start = (cols - 70) / 2;
-    int form_row = 10;
+        struct stat st;
+        int seen = fstat(fd, &st) != 0;
+        for (size_t j = 0; !seen && j < synced_count; j++) {
+            seen = synced[j] == st.st_dev;
+        }
 
-    printf(ANSI_CURSOR_POS ANSI_WHITE "Setup your system:" ANSI_RESET, form_row, logo_start);
-    form_row += 2;
+        if (!seen) {
+            synced[synced_count++] = st.st_dev;
+            if (syncfs(fd) != 0) {
+                LOG_WARN("syncfs failed on %s: %s", TARGET_MOUNTS[i], strerror(errno));
+                ok = 0;
+            }
+        }
+        close(fd);
+    }
 
-    Tui_Field fields[] = {
-        {"Username",         username,           NULL,       0},
-        {"Password",         password,           NULL,       1},
-        {"Confirm Password", confirmed_password, NULL,       1},
-        {"Hostname",         hostname,           "tonarchy", 0},
-        {"Keyboard",         keyboard,           "us",       0},
-        {"Timezone",         timezone,           NULL,       0},
-    };
-    int num_fields = (int)(sizeof(fields) / sizeof(fields[0]));
+    return ok;
+}
 
-    for (int i = 0; i < num_fields; i++) {
-        printf(ANSI_CURSOR_POS, form_row + i, logo_start);
+int lookup_target_user(const char *username, uid_t *uid, gid_t *gid) {
+    FILE *fp = fopen(TARGET_PATH("/etc/passwd"), "r");
+    if (!fp) {
+        LOG_ERROR("Failed to open %s/etc/passwd", target_root());
+        return 0;
+    }
 
-        if (current_field == i) {
-            printf(ANSI_BLUE_BOLD ">" ANSI_RESET " ");
-        } else {
-            printf("  ");
+    char line[1024];
+    size_t name_len = strlen(username);
+    int found = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, username, name_len) != 0 || line[name_len] != ':') continue;
+
+        char *fields = strchr(line + name_len + 1, ':');
+        unsigned long u, g;
+        if (fields && sscanf(fields + 1, "%lu:%lu", &u, &g) == 2) {
+            *uid = (uid_t)u;
+            *gid = (gid_t)g;
+            found = 1;
         }
+        break;
+    }
+    fclose(fp);
 
-        printf(ANSI_WHITE "%s: " ANSI_RESET, fields[i].label);
+    if (!found) {
+        LOG_ERROR("User %s not found in target passwd", username);
+    }
+    return found;
+}
 
-        if (strlen(fields[i].value) > 0) {
-            printf(ANSI_GREEN "%s" ANSI_RESET, fields[i].is_password ? "********" : fields[i].value);
-        } else if (current_field != i) {
-            if (fields[i].default_display) {
-                printf(ANSI_GRAY "%s" ANSI_RESET, fields[i].default_display);
-            } else {
-                printf(ANSI_GRAY "[not set]" ANSI_RESET);
-            }
-        }
+void copy_tree_init(Copy_Tree *tree, uid_t uid, gid_t gid) {
+    memset(tree, 0, sizeof(*tree));
+    pthread_mutex_init(&tree->lock, NULL);
+    pthread_cond_init(&tree->cond, NULL);
+    tree->uid = uid;
+    tree->gid = gid;
+}
+
+static void copy_tree_push(Copy_Tree *tree, const char *src, const char *dest) {
+    Copy_Job *job = malloc(sizeof(*job));
+    char *src_copy = strdup(src);
+    char *dest_copy = strdup(dest);
+
+    pthread_mutex_lock(&tree->lock);
+    if (!job || !src_copy || !dest_copy) {
+        tree->failed = true;
+        pthread_mutex_unlock(&tree->lock);
+        free(job);
+        free(src_copy);
+        free(dest_copy);
+        return;
     }
 
-    fflush(stdout);
+    job->src = src_copy;
+    job->dest = dest_copy;
+    job->next = tree->head;
+    tree->head = job;
+    tree->pending++;
+    pthread_cond_signal(&tree->cond);
+    pthread_mutex_unlock(&tree->lock);
 }
 
-static int validate_alphanumeric(const char *s) {
-    for (int i = 0; s[i]; i++) {
-        if (!isalnum(s[i]) && s[i] != '-' && s[i] != '_')
-            return 0;
+void copy_tree_add(Copy_Tree *tree, const char *src, const char *dest) {
+    if (tree->roots++ == 0) {
+        snprintf(tree->first_root, sizeof(tree->first_root), "%s", src);
     }
-    return 1;
+    copy_tree_push(tree, src, dest);
 }
 
-static int read_line(char *buf, int size, int echo) {
-    struct termios old_term;
-    tcgetattr(STDIN_FILENO, &old_term);
-    struct termios new_term = old_term;
-    if (echo)
-        new_term.c_lflag |= ECHO;
-    else
-        new_term.c_lflag &= ~ECHO;
-    new_term.c_lflag |= ICANON;
-    new_term.c_lflag &= ~ISIG;
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_term);
+static int copy_file_data(int in, int out, off_t size) {
+    if (ioctl(out, FICLONE, in) == 0) return 1;
 
-    int result = (fgets(buf, size, stdin) != NULL);
-    if (result)
-        buf[strcspn(buf, "\n")] = '\0';
+    off_t remaining = size;
+    while (remaining > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, (size_t)remaining, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        remaining -= n;
+    }
 
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
-    return result;
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return 0;
+        if (n == 0) return 1;
+
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buf + off, (size_t)(n - off));
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return 0;
+            off += w;
+        }
+    }
 }
 
-static int fzf_select(char *dest, const char *cmd, const char *default_val) {
-    clear_screen();
-    FILE *fp = popen(cmd, "r");
-    if (fp == NULL)
+static int copy_regular_file(Copy_Tree *tree, const char *src, const char *dest, const struct stat *st) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        LOG_ERROR("Failed to open %s: %s", src, strerror(errno));
         return 0;
+    }
 
-    char buf[256];
-    if (fgets(buf, sizeof(buf), fp) != NULL) {
-        buf[strcspn(buf, "\n")] = '\0';
-        if (strlen(buf) > 0)
-            strcpy(dest, buf);
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st->st_mode & 0777);
+    if (out < 0) {
+        LOG_ERROR("Failed to create %s: %s", dest, strerror(errno));
+        close(in);
+        return 0;
     }
-    pclose(fp);
 
-    if (strlen(dest) == 0 && default_val)
-        strcpy(dest, default_val);
+    int ok = copy_file_data(in, out, st->st_size);
+    if (!ok) {
+        LOG_ERROR("Failed to copy %s to %s: %s", src, dest, strerror(errno));
+    }
 
-    return 1;
+    if (ok && (fchown(out, tree->uid, tree->gid) != 0 || fchmod(out, st->st_mode & 07777) != 0)) {
+        LOG_ERROR("Failed to set ownership on %s: %s", dest, strerror(errno));
+        ok = 0;
+    }
+
+    close(in);
+    if (close(out) != 0) ok = 0;
+    return ok;
 }
 
-static int handle_password_entry(
-        char *password,
-        char *confirmed_password,
-        int form_row,
-        int logo_start,
-        char *username,
-        char *hostname,
-        char *keyboard,
-        char *timezone
-    ) {
-    char temp_input[256];
-    char password_confirm[256];
+static int copy_directory(Copy_Tree *tree, const char *src, const char *dest, const struct stat *st) {
+    if (mkdir(dest, st->st_mode & 07777) != 0 && errno != EEXIST) {
+        LOG_ERROR("Failed to create directory %s: %s", dest, strerror(errno));
+        return 0;
+    }
+    if (lchown(dest, tree->uid, tree->gid) != 0 || chmod(dest, st->st_mode & 07777) != 0) {
+        LOG_ERROR("Failed to set ownership on %s: %s", dest, strerror(errno));
+        return 0;
+    }
 
-    printf(ANSI_CURSOR_POS, form_row + 1, logo_start + 13);
-    fflush(stdout);
+    DIR *dir = opendir(src);
+    if (!dir) {
+        LOG_ERROR("Failed to open directory %s: %s", src, strerror(errno));
+        return 0;
+    }
 
-    if (!read_line(temp_input, sizeof(temp_input), 0))
-        return -1;
+    struct dirent *entry;
+    char child_src[PATH_MAX];
+    char child_dest[PATH_MAX];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(child_src, sizeof(child_src), "%s/%s", src, entry->d_name);
+        snprintf(child_dest, sizeof(child_dest), "%s/%s", dest, entry->d_name);
+        copy_tree_push(tree, child_src, child_dest);
+    }
 
-    if (strlen(temp_input) == 0) {
-        show_message("Password cannot be empty");
+    closedir(dir);
+    return 1;
+}
+
+static int copy_symlink(Copy_Tree *tree, const char *src, const char *dest) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(src, target, sizeof(target) - 1);
+    if (len < 0) {
+        LOG_ERROR("Failed to read link %s: %s", src, strerror(errno));
         return 0;
     }
+    target[len] = '\0';
 
-    strcpy(password, temp_input);
+    unlink(dest);
+    if (symlink(target, dest) != 0 || lchown(dest, tree->uid, tree->gid) != 0) {
+        LOG_ERROR("Failed to create link %s: %s", dest, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
 
-    draw_form(username, password, confirmed_password, hostname, keyboard, timezone, 2);
-    printf(ANSI_CURSOR_POS, form_row + 2, logo_start + 20);
-    fflush(stdout);
+static void copy_one(Copy_Tree *tree, const Copy_Job *job) {
+    struct stat st;
+    int ok;
+
+    if (lstat(job->src, &st) != 0) {
+        LOG_ERROR("Failed to stat %s: %s", job->src, strerror(errno));
+        ok = 0;
+    } else if (S_ISDIR(st.st_mode)) {
+        ok = copy_directory(tree, job->src, job->dest, &st);
+    } else if (S_ISREG(st.st_mode)) {
+        ok = copy_regular_file(tree, job->src, job->dest, &st);
+    } else if (S_ISLNK(st.st_mode)) {
+        ok = copy_symlink(tree, job->src, job->dest);
+    } else {
+        LOG_WARN("Skipping special file %s", job->src);
+        ok = 1;
+    }
 
-    if (!read_line(password_confirm, sizeof(password_confirm), 0))
-        return -1;
+    pthread_mutex_lock(&tree->lock);
+    if (!ok) tree->failed = true;
+    if (ok && S_ISREG(st.st_mode)) {
+        tree->files++;
+        tree->bytes += (unsigned long long)st.st_size;
+    }
+    pthread_mutex_unlock(&tree->lock);
+}
 
-    if (strcmp(password, password_confirm) == 0) {
-        strcpy(confirmed_password, password_confirm);
-        return 1;
+static void *copy_worker(void *arg) {
+    Copy_Tree *tree = arg;
+
+    pthread_mutex_lock(&tree->lock);
+    for (;;) {
+        while (!tree->head && tree->pending > 0) {
+            pthread_cond_wait(&tree->cond, &tree->lock);
+        }
+        if (!tree->head) break;
+
+        Copy_Job *job = tree->head;
+        tree->head = job->next;
+        pthread_mutex_unlock(&tree->lock);
+
+        copy_one(tree, job);
+        free(job->src);
+        free(job->dest);
+        free(job);
+
+        pthread_mutex_lock(&tree->lock);
+        if (--tree->pending == 0) {
+            pthread_cond_broadcast(&tree->cond);
+        }
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    return NULL;
+}
+
+int copy_tree_run(Copy_Tree *tree, int workers) {
+    double start = monotonic_seconds();
+    char name[PATH_MAX + 32];
+    if (tree->roots > 1) {
+        snprintf(name, sizeof(name), "copy %s (+%zu more)", tree->first_root, tree->roots - 1);
     } else {
-        show_message("Passwords do not match");
-        return 0;
+        snprintf(name, sizeof(name), "copy %s", tree->first_root);
     }
+    long span = trace_begin("copy", name);
+
+    pthread_t threads[workers];
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, copy_worker, tree) != 0) break;
+        started++;
+    }
+    if (started == 0) copy_worker(tree);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    LOG_INFO("Copied %lu files (%llu bytes) as %d:%d in %.2fs",
+             tree->files, tree->bytes, (int)tree->uid, (int)tree->gid, monotonic_seconds() - start);
+
+    int result = !tree->failed;
+    trace_end(span, result ? 0 : 1, (size_t)tree->bytes);
+    pthread_cond_destroy(&tree->cond);
+    pthread_mutex_destroy(&tree->lock);
+    return result;
 }
 
-static int get_form_input(
-        char *username,
-        char *password,
-        char *confirmed_password,
-        char *hostname,
-        char *keyboard,
-        char *timezone
-    ) {
-    char temp_input[256];
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
-    int logo_start = (cols - 70) / 2;
-    int form_row = 12;
+int copy_tree(const char *src, const char *dest, uid_t uid, gid_t gid) {
+    Copy_Tree tree;
+    copy_tree_init(&tree, uid, gid);
+    copy_tree_add(&tree, src, dest);
+    return copy_tree_run(&tree, COPY_WORKERS);
+}
 
-    Form_Field fields[] = {
-        {username, NULL,       INPUT_TEXT,         13, "Username must be alphanumeric"},
-        {password, NULL,       INPUT_PASSWORD,     13, NULL},
-        {confirmed_password, NULL, INPUT_PASSWORD, 20, NULL},
-        {hostname, "tonarchy", INPUT_TEXT,         13, "Hostname must be alphanumeric"},
-        {keyboard, "us",       INPUT_FZF_KEYMAP,   0,  NULL},
-        {timezone, NULL,       INPUT_FZF_TIMEZONE, 0,  "Timezone is required"},
-    };
-    int num_fields = (int)(sizeof(fields) / sizeof(fields[0]));
+static const Chroot_Mount CHROOT_MOUNTS[] = {
+    {"proc",     "/proc",                    "proc",     MS_NOSUID | MS_NOEXEC | MS_NODEV,             NULL,                        false},
+    {"sys",      "/sys",                     "sysfs",    MS_NOSUID | MS_NOEXEC | MS_NODEV | MS_RDONLY, NULL,                        false},
+    {"efivarfs", "/sys/firmware/efi/efivars", "efivarfs", MS_NOSUID | MS_NOEXEC | MS_NODEV,            NULL,                        true},
+    {"udev",     "/dev",                     "devtmpfs", MS_NOSUID,                                    "mode=0755",                 false},
+    {"devpts",   "/dev/pts",                 "devpts",   MS_NOSUID | MS_NOEXEC,                        "mode=0620,gid=5",           false},
+    {"shm",      "/dev/shm",                 "tmpfs",    MS_NOSUID | MS_NODEV,                         "mode=1777",                 false},
+    {"/run",     "/run",                     NULL,       MS_BIND,                                      NULL,                        false},
+    {"tmp",      "/tmp",                     "tmpfs",    MS_NOSUID | MS_NODEV | MS_STRICTATIME,        "mode=1777",                 false},
+    {"/etc/resolv.conf", "/etc/resolv.conf", NULL,       MS_BIND,                                      NULL,                        true},
+};
 
-    int current_field = 0;
-    while (current_field < num_fields) {
-        draw_form(username, password, confirmed_password, hostname, keyboard, timezone, current_field);
-        Form_Field *f = &fields[current_field];
+static Chroot_Session chroot_session = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
 
-        if (f->type == INPUT_FZF_KEYMAP) {
-            fzf_select(keyboard, "localectl list-keymaps | fzf --height=40% --reverse --prompt='Keyboard: ' --header='Start typing to filter, Enter to select' --query='us'", "us");
-            current_field++;
-        } else if (f->type == INPUT_FZF_TIMEZONE) {
-            fzf_select(timezone, "timedatectl list-timezones | fzf --height=40% --reverse --prompt='Timezone: ' --header='Type your city/timezone, Enter to select'", NULL);
-            if (strlen(timezone) == 0) {
-                show_message("Timezone is required");
+int chroot_session_begin(void) {
+    pthread_mutex_lock(&chroot_session.lock);
+    if (chroot_session.active) {
+        pthread_mutex_unlock(&chroot_session.lock);
+        return 1;
+    }
+
+    LOG_INFO("Setting up chroot session in %s", target_root());
+    for (size_t i = 0; i < sizeof(CHROOT_MOUNTS) / sizeof(CHROOT_MOUNTS[0]); i++) {
+        const Chroot_Mount *m = &CHROOT_MOUNTS[i];
+        char target[PATH_MAX];
+        target_path(target, sizeof(target), "%s", m->target);
+
+        if (m->flags & MS_BIND) {
+            struct stat st;
+            if (stat(m->source, &st) == 0 && !S_ISDIR(st.st_mode)) {
+                int fd = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+                if (fd >= 0) close(fd);
             } else {
-                current_field++;
+                mkdir(target, 0755);
             }
-        } else if (current_field == 1) {
-            int result = handle_password_entry(
-                password,
-                confirmed_password,
-                form_row,
-                logo_start,
-                username,
-                hostname,
-                keyboard,
-                timezone
-            );
-            if (result == -1) return 0;
-            if (result == 1) current_field = 3;
-        } else if (current_field == 2) {
-            current_field = 1;
         } else {
-            printf(ANSI_CURSOR_POS, form_row + current_field, logo_start + f->cursor_offset);
-            fflush(stdout);
+            mkdir(target, 0755);
+        }
 
-            if (!read_line(temp_input, sizeof(temp_input), 1))
-                return 0;
+        if (mount(m->source, target, m->fstype, m->flags, m->data) != 0) {
+            if (m->optional) {
+                LOG_DEBUG("Skipping optional chroot mount %s: %s", target, strerror(errno));
+                continue;
+            }
+            LOG_ERROR("Failed to mount %s on %s: %s", m->source, target, strerror(errno));
+            pthread_mutex_unlock(&chroot_session.lock);
+            chroot_session_end();
+            return 0;
+        }
+
+        if ((m->flags & MS_BIND) && mount(NULL, target, NULL, MS_PRIVATE, NULL) != 0) {
+            LOG_DEBUG("Failed to make %s private: %s", target, strerror(errno));
+        }
+
+        snprintf(chroot_session.mounts[chroot_session.mount_count++], PATH_MAX, "%s", target);
+    }
+
+    chroot_session.active = true;
+    pthread_mutex_unlock(&chroot_session.lock);
+    return 1;
+}
+
+void chroot_session_end(void) {
+    pthread_mutex_lock(&chroot_session.lock);
+    while (chroot_session.mount_count > 0) {
+        const char *target = chroot_session.mounts[--chroot_session.mount_count];
+        if (umount2(target, 0) != 0 && umount2(target, MNT_DETACH) != 0) {
+            LOG_WARN("Failed to unmount %s: %s", target, strerror(errno));
+        }
+    }
+    if (chroot_session.active) {
+        LOG_INFO("Chroot session in %s torn down", target_root());
+    }
+    chroot_session.active = false;
+    pthread_mutex_unlock(&chroot_session.lock);
+}
+
+int chroot_run(const Cmd *cmd) {
+    if (!chroot_session.active) {
+        LOG_ERROR("No chroot session for: %s", cmd->argv[0]);
+        return 0;
+    }
+
+    Cmd full;
+    cmd_init(&full, cmd->argv[0]);
+    for (size_t i = 1; i < cmd->argc; i++) {
+        cmd_arg(&full, cmd->argv[i]);
+    }
+    full.root = target_root();
+    full.input = cmd->input;
+    full.quiet = cmd->quiet;
+
+    int result = cmd_run(&full);
+    cmd_free(&full);
+    return result;
+}
+
+int chroot_run_args(const char *program, ...) {
+    Cmd cmd;
+    va_list args;
+    va_start(args, program);
+    cmd_init_va(&cmd, program, args);
+    va_end(args);
+
+    int result = chroot_run(&cmd);
+    cmd_free(&cmd);
+    return result;
+}
+
+int chroot_exec(const char *cmd) {
+    LOG_INFO("Executing in chroot: %s", cmd);
+
+    if (!chroot_run_args("/bin/bash", "-c", cmd, NULL)) {
+        LOG_ERROR("Chroot command failed: %s", cmd);
+        return 0;
+    }
+
+    LOG_DEBUG("Chroot command succeeded: %s", cmd);
+    return 1;
+}
+
+int chroot_exec_fmt(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    char *cmd = format_alloc_v(fmt, args);
+    va_end(args);
+
+    if (!cmd) return 0;
+    int result = chroot_exec(cmd);
+    free(cmd);
+    return result;
+}
+
+int chroot_exec_as_user(const char *username, const char *cmd) {
+    char *full_cmd = format_alloc("sudo -u %s %s", username, cmd);
+    if (!full_cmd) return 0;
+
+    int result = chroot_exec(full_cmd);
+    free(full_cmd);
+    return result;
+}
+
+int chroot_exec_as_user_fmt(const char *username, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    char *cmd = format_alloc_v(fmt, args);
+    va_end(args);
+
+    if (!cmd) return 0;
+    int result = chroot_exec_as_user(username, cmd);
+    free(cmd);
+    return result;
+}
+
+int git_clone_as_user(const char *username, const char *repo_url, const char *dest_path) {
+    LOG_INFO("Cloning %s to %s as user %s", repo_url, dest_path, username);
+    return chroot_exec_as_user_fmt(username, "git clone %s %s", repo_url, dest_path);
+}
+
+int make_clean_install(const char *build_dir) {
+    LOG_INFO("Building and installing from %s", build_dir);
+    return chroot_exec_fmt("cd %s && make clean install", build_dir);
+}
+
+int create_user_dotfile(const char *username, const Dotfile *dotfile) {
+    char full_path[512];
+    target_path(full_path, sizeof(full_path), "/home/%s/%s", username, dotfile->filename);
+
+    LOG_INFO("Creating dotfile %s for user %s", dotfile->filename, username);
+
+    if (!write_file(full_path, dotfile->content)) {
+        return 0;
+    }
+
+    if (!set_file_perms(full_path, dotfile->permissions, username, username)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+int setup_systemd_override(const Systemd_Override *override) {
+    char dir_path[1024];
+    char file_path[2048];
+
+    target_path(dir_path, sizeof(dir_path), "/etc/systemd/system/%s", override->drop_in_dir);
+    snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, override->drop_in_file);
+
+    LOG_INFO("Setting up systemd override: %s/%s", override->drop_in_dir, override->drop_in_file);
+
+    if (!create_directory(dir_path, 0755)) {
+        return 0;
+    }
+
+    char *content = NULL;
+    size_t content_len = 0;
+    FILE *fp = open_memstream(&content, &content_len);
+    if (!fp) {
+        LOG_ERROR("Failed to build systemd override file: %s", file_path);
+        return 0;
+    }
+
+    for (size_t i = 0; i < override->entry_count; i++) {
+        if (override->entries[i].value[0] == '\0') {
+            fprintf(fp, "%s\n", override->entries[i].key);
+        } else {
+            fprintf(fp, "%s=%s\n", override->entries[i].key, override->entries[i].value);
+        }
+    }
+
+    int built = !ferror(fp);
+    built = fclose(fp) == 0 && built;
+    int written = built && write_file(file_path, content);
+    free(content);
+    if (!written) {
+        LOG_ERROR("Failed to create systemd override file: %s", file_path);
+        return 0;
+    }
+    LOG_INFO("Successfully created systemd override");
+    return 1;
+}
+
+
+static void disable_raw_mode(void) {
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+static void enable_raw_mode(void) {
+    tcgetattr(STDIN_FILENO, &orig_termios);
+    atexit(disable_raw_mode);
+
+    struct termios raw = orig_termios;
+    raw.c_lflag &= ~(ECHO | ICANON);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+static void get_terminal_size(int *rows, int *cols) {
+    struct winsize ws;
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+}
+
+static void clear_screen(void) {
+    printf("\033[2J\033[H");
+    fflush(stdout);
+}
+
+static void draw_logo(int cols) {
+    const char *logo[] = {
+        "████████╗ ██████╗ ███╗   ██╗ █████╗ ██████╗  ██████╗██╗  ██╗██╗   ██╗",
+        "╚══██╔══╝██╔═══██╗████╗  ██║██╔══██╗██╔══██╗██╔════╝██║  ██║╚██╗ ██╔╝",
+        "   ██║   ██║   ██║██╔██╗ ██║███████║██████╔╝██║     ███████║ ╚████╔╝ ",
+        "   ██║   ██║   ██║██║╚██╗██║██╔══██║██╔══██╗██║     ██╔══██║  ╚██╔╝  ",
+        "   ██║   ╚██████╔╝██║ ╚████║██║  ██║██║  ██║╚██████╗██║  ██║   ██║   ",
+        "   ╚═╝    ╚═════╝ ╚═╝  ╚═══╝╚═╝  ╚═╝╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝   ╚═╝   "
+    };
+
+    int logo_height = 6;
+    int logo_start = (cols - 70) / 2;
+
+    printf("\033[1;32m");
+    for (int i = 0; i < logo_height; i++) {
+        printf("\033[%d;%dH%s", i + 2, logo_start, logo[i]);
+    }
+    printf("\033[0m");
+
+    static bool drawn;
+    if (!drawn) {
+        drawn = true;
+        fflush(stdout);
+        boot_mark("installer-first-frame");
+    }
+}
+
+static int draw_menu(const char **items, int count, int selected) {
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+
+    clear_screen();
+    draw_logo(cols);
+
+    int logo_start = (cols - 70) / 2;
+    int menu_start_row = 10;
+
+    for (int i = 0; i < count; i++) {
+        printf("\033[%d;%dH", menu_start_row + i, logo_start + 2);
+        if (i == selected) {
+            printf("\033[1;34m> %s\033[0m", items[i]);
+        } else {
+            printf("\033[37m  %s\033[0m", items[i]);
+        }
+    }
+
+    printf("\033[%d;%dH", menu_start_row + count + 2, logo_start);
+    printf("\033[33mj/k Navigate  Enter Select\033[0m");
+
+    fflush(stdout);
+    return 0;
+}
+
+static int select_from_menu(const char **items, int count) {
+    int selected = 0;
+
+    enable_raw_mode();
+    draw_menu(items, count, selected);
+
+    char c;
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+        if (c == 'q' || c == 27) {
+            disable_raw_mode();
+            return -1;
+        }
+
+        if (c == 'j' || c == 66) {
+            if (selected < count - 1) {
+                selected++;
+                draw_menu(items, count, selected);
+            }
+        }
+
+        if (c == 'k' || c == 65) {
+            if (selected > 0) {
+                selected--;
+                draw_menu(items, count, selected);
+            }
+        }
+
+        if (c == '\r' || c == '\n') {
+            disable_raw_mode();
+            return selected;
+        }
+    }
+
+    disable_raw_mode();
+    return -1;
+}
+
+void show_message(const char *message) {
+    if (target_status) {
+        LOG_INFO("%s", message);
+        snprintf(target_status->status, sizeof(target_status->status), "%s", message);
+        return;
+    }
+
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+
+    pthread_mutex_lock(&ui_lock);
+    clear_screen();
+    draw_logo(cols);
+
+    int logo_start = (cols - 70) / 2;
+    printf("\033[%d;%dH", 10, logo_start);
+    printf("\033[37m%s\033[0m", message);
+    fflush(stdout);
+    pthread_mutex_unlock(&ui_lock);
+
+    sleep(2);
+}
+
+static int check_internet_connection(void) {
+    return cmd_run_args("ping", "-c", "1", "-W", "2", "1.1.1.1", NULL);
+}
+
+static int list_wifi_networks(char networks[][256], char ssids[][128], int max_networks) {
+    Cmd cmd;
+    cmd_init(&cmd, "nmcli");
+    cmd_arg(&cmd, "-t");
+    cmd_arg(&cmd, "-f");
+    cmd_arg(&cmd, "SSID,SIGNAL,SECURITY");
+    cmd_arg(&cmd, "device");
+    cmd_arg(&cmd, "wifi");
+    cmd_arg(&cmd, "list");
+    cmd.capture = true;
+    if (!cmd_run(&cmd) || !cmd.output) {
+        cmd_free(&cmd);
+        return 0;
+    }
+
+    int count = 0;
+    int listed = 0;
+    char *next;
+    for (char *line = cmd.output; line && *line && count < max_networks && listed < 20; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        listed++;
+
+        char ssid[128] = "", signal[32] = "", security[64] = "";
+        char *token = strtok(line, ":");
+        if (token) strncpy(ssid, token, sizeof(ssid) - 1);
+        token = strtok(NULL, ":");
+        if (token) strncpy(signal, token, sizeof(signal) - 1);
+        token = strtok(NULL, ":");
+        if (token) strncpy(security, token, sizeof(security) - 1);
+
+        if (strlen(ssid) > 0 && strcmp(ssid, "--") != 0) {
+            snprintf(ssids[count], 128, "%s", ssid);
+            snprintf(networks[count], 255, "%s (%s%%) [%s]", ssid, signal,
+                     strlen(security) > 0 ? security : "Open");
+            count++;
+        }
+    }
+    cmd_free(&cmd);
+    return count;
+}
+
+static int connect_to_wifi(const char *ssid) {
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+
+    clear_screen();
+    draw_logo(cols);
+
+    int logo_start = (cols - 70) / 2;
+    printf("\033[%d;%dH\033[37mConnecting to: %s\033[0m", 10, logo_start, ssid);
+    printf("\033[%d;%dH\033[37mEnter password (leave empty if open): \033[0m", 12, logo_start);
+    fflush(stdout);
+
+    char password[256] = "";
+    struct termios old_term;
+    tcgetattr(STDIN_FILENO, &old_term);
+    struct termios new_term = old_term;
+    new_term.c_lflag &= ~ECHO;
+    new_term.c_lflag |= ICANON;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_term);
+
+    if (fgets(password, sizeof(password), stdin) != NULL) {
+        password[strcspn(password, "\n")] = '\0';
+    }
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
+
+    clear_screen();
+    draw_logo(cols);
+    printf("\033[%d;%dH\033[37mConnecting...\033[0m", 10, logo_start);
+    fflush(stdout);
+
+    Cmd cmd;
+    cmd_init(&cmd, "nmcli");
+    cmd_arg(&cmd, "device");
+    cmd_arg(&cmd, "wifi");
+    cmd_arg(&cmd, "connect");
+    cmd_arg(&cmd, ssid);
+    if (strlen(password) > 0) {
+        cmd_arg(&cmd, "password");
+        cmd_arg(&cmd, password);
+    }
+    cmd.quiet = true;
+
+    int result = cmd_run(&cmd);
+    cmd_free(&cmd);
+    sleep(2);
+
+    if (result && check_internet_connection()) {
+        show_message("Connected successfully!");
+        return 1;
+    } else {
+        show_message("Connection failed. Please try again.");
+        return 0;
+    }
+}
+
+static int setup_wifi_if_needed(void) {
+    if (check_internet_connection()) {
+        return 1;
+    }
+
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+
+    clear_screen();
+    draw_logo(cols);
+
+    int logo_start = (cols - 70) / 2;
+    printf("\033[%d;%dH\033[37mNo internet connection detected.\033[0m", 10, logo_start);
+    printf("\033[%d;%dH\033[37mScanning for WiFi networks...\033[0m", 11, logo_start);
+    fflush(stdout);
+
+    cmd_run_args("nmcli", "radio", "wifi", "on", NULL);
+    sleep(1);
+
+    char networks[32][256];
+    char ssids[32][128];
+    int network_count = list_wifi_networks(networks, ssids, 32);
+
+    if (network_count == 0) {
+        show_message("No WiFi networks found. Please check your connection.");
+        return 0;
+    }
+
+    const char *network_ptrs[32];
+    for (int i = 0; i < network_count; i++) {
+        network_ptrs[i] = networks[i];
+    }
+
+    int selected = select_from_menu(network_ptrs, network_count);
+    if (selected < 0) {
+        show_message("WiFi setup cancelled. Installation requires internet.");
+        return 0;
+    }
+
+    return connect_to_wifi(ssids[selected]);
+}
+
+static Mirror_Ranking ranking = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int parse_mirror_url(Mirror *m) {
+    const char *p = strstr(m->url, "://");
+    if (!p) return 0;
+    p += 3;
+
+    const char *slash = strchr(p, '/');
+    if (!slash) return 0;
+
+    size_t host_len = (size_t)(slash - p);
+    if (host_len == 0 || host_len >= sizeof(m->host)) return 0;
+    memcpy(m->host, p, host_len);
+    m->host[host_len] = '\0';
+
+    snprintf(m->port, sizeof(m->port), "80");
+    char *colon = strchr(m->host, ':');
+    if (colon) {
+        *colon = '\0';
+        snprintf(m->port, sizeof(m->port), "%s", colon + 1);
+    }
+
+    char path[512];
+    size_t used = 0;
+    for (const char *s = slash; *s && used < sizeof(path) - 1; s++) {
+        const char *sub = NULL;
+        size_t skip = 0;
+        if (strncmp(s, "$repo", 5) == 0) {
+            sub = "core";
+            skip = 4;
+        } else if (strncmp(s, "$arch", 5) == 0) {
+            sub = "x86_64";
+            skip = 4;
+        }
+
+        if (sub) {
+            used += (size_t)snprintf(path + used, sizeof(path) - used, "%s", sub);
+            s += skip;
+        } else {
+            path[used++] = *s;
+        }
+        if (used >= sizeof(path)) return 0;
+    }
+    path[used] = '\0';
+
+    snprintf(m->path, sizeof(m->path), "%s/core.db", path);
+    return 1;
+}
+
+static int load_mirrorlist(const char *path, Mirror *mirrors, int max_mirrors) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        LOG_WARN("Failed to open mirrorlist: %s", path);
+        return 0;
+    }
+
+    char region[64] = "Worldwide";
+    char line[1024];
+    int count = 0;
+    while (count < max_mirrors && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (strncmp(line, "## ", 3) == 0) {
+            snprintf(region, sizeof(region), "%s", line + 3);
+            region[strcspn(region, ":")] = '\0';
+            continue;
+        }
+
+        if (strncmp(line, "Server", 6) != 0) continue;
+        const char *url = strchr(line, '=');
+        if (!url) continue;
+        url++;
+        while (*url == ' ') url++;
+
+        Mirror *m = &mirrors[count];
+        memset(m, 0, sizeof(*m));
+        m->fd = -1;
+        snprintf(m->url, sizeof(m->url), "%s", url);
+        snprintf(m->region, sizeof(m->region), "%s", region);
+        if (!parse_mirror_url(m)) {
+            LOG_WARN("Skipping unparsable mirror: %s", url);
+            continue;
+        }
+        count++;
+    }
+
+    fclose(fp);
+    return count;
+}
+
+static void *resolve_mirror(void *arg) {
+    Mirror *m = arg;
+    struct addrinfo hints = {0};
+    struct addrinfo *res = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(m->host, m->port, &hints, &res) != 0 || !res) {
+        m->state = MIRROR_FAILED;
+        return NULL;
+    }
+
+    memcpy(&m->addr, res->ai_addr, res->ai_addrlen);
+    m->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return NULL;
+}
+
+static void resolve_mirrors(Mirror *mirrors, int count) {
+    pthread_t threads[count];
+    bool joinable[count];
+
+    for (int i = 0; i < count; i++) {
+        joinable[i] = pthread_create(&threads[i], NULL, resolve_mirror, &mirrors[i]) == 0;
+        if (!joinable[i]) resolve_mirror(&mirrors[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        if (joinable[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+static void close_mirror(Mirror *m, Mirror_State state) {
+    if (m->fd >= 0) {
+        close(m->fd);
+        m->fd = -1;
+    }
+    m->state = state;
+}
+
+static void start_mirror_probe(Mirror *m, double now) {
+    if (m->state == MIRROR_FAILED) return;
+
+    m->fd = socket(m->addr.ss_family, SOCK_STREAM, 0);
+    if (m->fd < 0) {
+        m->state = MIRROR_FAILED;
+        return;
+    }
+    fcntl(m->fd, F_SETFL, fcntl(m->fd, F_GETFL) | O_NONBLOCK);
+
+    m->started_at = now;
+    if (connect(m->fd, (struct sockaddr *)&m->addr, m->addr_len) != 0 && errno != EINPROGRESS) {
+        close_mirror(m, MIRROR_FAILED);
+        return;
+    }
+    m->state = MIRROR_CONNECTING;
+}
+
+static void mirror_connected(Mirror *m, double now) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(m->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        close_mirror(m, MIRROR_FAILED);
+        return;
+    }
+
+    m->connect_ms = (now - m->started_at) * 1000.0;
+
+    char request[1024];
+    int n = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Range: bytes=0-%d\r\n"
+        "User-Agent: tonarchy\r\n"
+        "Connection: close\r\n\r\n",
+        m->path, m->host, MIRROR_SAMPLE_BYTES - 1);
+
+    if (send(m->fd, request, (size_t)n, MSG_NOSIGNAL) != n) {
+        close_mirror(m, MIRROR_FAILED);
+        return;
+    }
+    m->state = MIRROR_READING;
+}
+
+static void mirror_readable(Mirror *m, double now) {
+    char buf[16384];
+    ssize_t n = recv(m->fd, buf, sizeof(buf), 0);
+
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) close_mirror(m, MIRROR_FAILED);
+        return;
+    }
+
+    if (n > 0 && !m->header_done) {
+        size_t keep = sizeof(m->header) - 1 - m->header_len;
+        size_t take = (size_t)n < keep ? (size_t)n : keep;
+        memcpy(m->header + m->header_len, buf, take);
+        m->header_len += take;
+        m->header[m->header_len] = '\0';
+
+        char *end = strstr(m->header, "\r\n\r\n");
+        if (!end) {
+            if (m->header_len == sizeof(m->header) - 1) close_mirror(m, MIRROR_FAILED);
+            return;
+        }
+
+        int status = 0;
+        if (sscanf(m->header, "HTTP/%*s %d", &status) != 1 || (status != 200 && status != 206)) {
+            m->http_status = status;
+            close_mirror(m, MIRROR_REACHABLE);
+            return;
+        }
+
+        m->http_status = status;
+        m->header_done = true;
+        m->first_byte_at = now;
+        size_t body_in_header = m->header_len - (size_t)(end + 4 - m->header);
+        m->body_bytes = (long)body_in_header + ((long)n - (long)take);
+    } else if (n > 0) {
+        m->body_bytes += n;
+    }
+
+    if (n == 0 || m->body_bytes >= MIRROR_SAMPLE_BYTES) {
+        double elapsed = now - m->first_byte_at;
+        if (m->header_done && m->body_bytes > 0 && elapsed > 0) {
+            m->bytes_per_sec = (double)m->body_bytes / elapsed;
+            close_mirror(m, MIRROR_MEASURED);
+        } else {
+            close_mirror(m, m->header_done ? MIRROR_REACHABLE : MIRROR_FAILED);
+        }
+    }
+}
+
+static void probe_mirrors(Mirror *mirrors, int count) {
+    resolve_mirrors(mirrors, count);
+
+    double start = monotonic_seconds();
+    for (int i = 0; i < count; i++) {
+        start_mirror_probe(&mirrors[i], start);
+    }
+
+    struct pollfd fds[count];
+    int owner[count];
+    double deadline = start + MIRROR_PROBE_TIMEOUT_MS / 1000.0;
+
+    for (;;) {
+        int nfds = 0;
+        for (int i = 0; i < count; i++) {
+            Mirror *m = &mirrors[i];
+            if (m->state != MIRROR_CONNECTING && m->state != MIRROR_READING) continue;
+            fds[nfds].fd = m->fd;
+            fds[nfds].events = m->state == MIRROR_CONNECTING ? POLLOUT : POLLIN;
+            fds[nfds].revents = 0;
+            owner[nfds++] = i;
+        }
+
+        double now = monotonic_seconds();
+        if (nfds == 0 || now >= deadline) break;
+
+        int ready = poll(fds, (nfds_t)nfds, (int)((deadline - now) * 1000.0) + 1);
+        if (ready < 0 && errno != EINTR) break;
+
+        now = monotonic_seconds();
+        for (int i = 0; i < nfds && ready > 0; i++) {
+            if (!fds[i].revents) continue;
+            Mirror *m = &mirrors[owner[i]];
+            if (m->state == MIRROR_CONNECTING) {
+                mirror_connected(m, now);
+            } else {
+                mirror_readable(m, now);
+            }
+        }
+    }
+
+    double now = monotonic_seconds();
+    for (int i = 0; i < count; i++) {
+        Mirror *m = &mirrors[i];
+        if (m->state == MIRROR_READING && m->header_done && m->body_bytes > 0 && now > m->first_byte_at) {
+            m->bytes_per_sec = (double)m->body_bytes / (now - m->first_byte_at);
+            close_mirror(m, MIRROR_MEASURED);
+        } else if (m->state == MIRROR_READING) {
+            close_mirror(m, MIRROR_REACHABLE);
+        } else if (m->state == MIRROR_CONNECTING || m->state == MIRROR_IDLE) {
+            close_mirror(m, MIRROR_FAILED);
+        }
+    }
+}
+
+static void score_mirrors(Mirror *mirrors, int count, const char *timezone) {
+    char region[64] = "";
+    if (timezone && timezone[0]) {
+        snprintf(region, sizeof(region), "%s", timezone);
+        region[strcspn(region, "/")] = '\0';
+    }
+
+    for (int i = 0; i < count; i++) {
+        Mirror *m = &mirrors[i];
+        switch (m->state) {
+        case MIRROR_MEASURED:
+            m->score = m->connect_ms + (double)MIRROR_SCORE_BYTES * 1000.0 / m->bytes_per_sec;
+            break;
+        case MIRROR_REACHABLE:
+            m->score = MIRROR_UNMEASURED_PENALTY_MS + m->connect_ms;
+            break;
+        default:
+            m->score = MIRROR_FAILED_PENALTY_MS + i;
+            break;
+        }
+
+        if (region[0] && strcmp(m->region, region) == 0) {
+            m->score *= MIRROR_REGION_PRIOR;
+        }
+    }
+}
+
+static int compare_mirrors(const void *a, const void *b) {
+    const Mirror *ma = a;
+    const Mirror *mb = b;
+    if (ma->score < mb->score) return -1;
+    if (ma->score > mb->score) return 1;
+    return 0;
+}
+
+static int write_mirrorlist(const char *path, const Mirror *mirrors, int count) {
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tonarchy", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        LOG_ERROR("Failed to open mirrorlist for writing: %s", tmp_path);
+        return 0;
+    }
+
+    fprintf(fp, "## Ranked by tonarchy (connect latency + throughput sample)\n");
+    for (int i = 0; i < count; i++) {
+        const Mirror *m = &mirrors[i];
+        if (m->state == MIRROR_MEASURED) {
+            fprintf(fp, "\n## %s: %.0f ms connect, %.0f KiB/s\n", m->region, m->connect_ms, m->bytes_per_sec / 1024.0);
+        } else if (m->state == MIRROR_REACHABLE) {
+            fprintf(fp, "\n## %s: %.0f ms connect, not measured\n", m->region, m->connect_ms);
+        } else {
+            fprintf(fp, "\n## %s: unreachable\n", m->region);
+        }
+        fprintf(fp, "Server = %s\n", m->url);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        LOG_ERROR("Failed to write mirrorlist: %s", path);
+        unlink(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+static int apply_mirror_ranking(void) {
+    score_mirrors(ranking.mirrors, ranking.count, ranking.timezone);
+    qsort(ranking.mirrors, (size_t)ranking.count, sizeof(Mirror), compare_mirrors);
+
+    for (int i = 0; i < ranking.count; i++) {
+        const Mirror *m = &ranking.mirrors[i];
+        LOG_INFO("Mirror %2d: %-55s score=%.0f connect=%.0fms rate=%.0fKiB/s",
+                 i + 1, m->url, m->score, m->connect_ms, m->bytes_per_sec / 1024.0);
+    }
+
+    return write_mirrorlist(ranking.path, ranking.mirrors, ranking.count);
+}
+
+static int probe_mirrorlist(const char *mirrorlist_path, Mirror *mirrors, int *measured) {
+    int count = load_mirrorlist(mirrorlist_path, mirrors, MAX_MIRRORS);
+    if (count == 0) {
+        LOG_WARN("No mirrors to rank in %s", mirrorlist_path);
+        return 0;
+    }
+
+    LOG_INFO("Probing %d mirrors", count);
+    double start = monotonic_seconds();
+    probe_mirrors(mirrors, count);
+
+    *measured = 0;
+    for (int i = 0; i < count; i++) {
+        if (mirrors[i].state == MIRROR_MEASURED) (*measured)++;
+    }
+    LOG_INFO("Mirror probe finished in %.2fs: %d of %d measured", monotonic_seconds() - start, *measured, count);
+    return count;
+}
+
+int print_mirror_ranking(const char *mirrorlist_path, const char *timezone) {
+    Mirror *mirrors = calloc(MAX_MIRRORS, sizeof(Mirror));
+    if (!mirrors) return 0;
+
+    int measured = 0;
+    int count = probe_mirrorlist(mirrorlist_path, mirrors, &measured);
+    score_mirrors(mirrors, count, timezone);
+    qsort(mirrors, (size_t)count, sizeof(Mirror), compare_mirrors);
+
+    printf("rank\tscore\tconnect_ms\tkib_per_sec\tstate\turl\n");
+    for (int i = 0; i < count; i++) {
+        const Mirror *m = &mirrors[i];
+        const char *state = m->state == MIRROR_MEASURED ? "measured"
+            : m->state == MIRROR_REACHABLE ? "reachable" : "failed";
+        printf("%d\t%.0f\t%.0f\t%.0f\t%s\t%s\n",
+               i + 1, m->score, m->connect_ms, m->bytes_per_sec / 1024.0, state, m->url);
+    }
+
+    free(mirrors);
+    return measured > 0;
+}
+
+int rank_mirrors(const char *mirrorlist_path) {
+    Mirror *mirrors = calloc(MAX_MIRRORS, sizeof(Mirror));
+    if (!mirrors) return 0;
+
+    int measured = 0;
+    int count = probe_mirrorlist(mirrorlist_path, mirrors, &measured);
+    if (count == 0) {
+        free(mirrors);
+        return 0;
+    }
+
+    if (measured == 0) {
+        LOG_WARN("No mirror could be measured, keeping %s as is", mirrorlist_path);
+        free(mirrors);
+        return 0;
+    }
+
+    pthread_mutex_lock(&ranking.lock);
+    memcpy(ranking.mirrors, mirrors, sizeof(Mirror) * (size_t)count);
+    ranking.count = count;
+    snprintf(ranking.path, sizeof(ranking.path), "%s", mirrorlist_path);
+    int result = apply_mirror_ranking();
+    pthread_mutex_unlock(&ranking.lock);
+
+    free(mirrors);
+    return result;
+}
+
+void mirrors_set_timezone(const char *timezone) {
+    pthread_mutex_lock(&ranking.lock);
+    snprintf(ranking.timezone, sizeof(ranking.timezone), "%s", timezone);
+    if (ranking.count > 0) {
+        LOG_INFO("Re-ranking mirrors with timezone prior: %s", timezone);
+        apply_mirror_ranking();
+    }
+    pthread_mutex_unlock(&ranking.lock);
+}
+
+static int install_ranked_mirrorlist(void) {
+    pthread_mutex_lock(&ranking.lock);
+    int result = 1;
+    if (ranking.count > 0) {
+        result = write_mirrorlist(TARGET_PATH("%s", MIRRORLIST_PATH), ranking.mirrors, ranking.count);
+    }
+    pthread_mutex_unlock(&ranking.lock);
+    return result;
+}
+
+static Keyring_Init keyring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static void *keyring_worker(void *arg) {
+    (void)arg;
+    double start = monotonic_seconds();
+    long span = trace_begin("keyring", "pacman-key init");
+
+    struct stat st;
+    int ready = stat(KEYRING_READY_MARKER, &st) == 0;
+    if (ready) {
+        LOG_INFO("Live pacman keyring already initialized this boot");
+    } else {
+        ready = cmd_run_args("pacman-key", "--init", NULL)
+            && cmd_run_args("pacman-key", "--populate", "archlinux", NULL);
+        if (ready) {
+            write_file_fmt(KEYRING_READY_MARKER, "%.2f\n", monotonic_seconds() - start);
+            boot_mark("keyring-ready");
+            LOG_INFO("Live pacman keyring initialized in %.2fs", monotonic_seconds() - start);
+        } else {
+            LOG_ERROR("Failed to initialize the live pacman keyring");
+        }
+    }
+    trace_end(span, ready ? 0 : 1, 0);
+
+    pthread_mutex_lock(&keyring.lock);
+    keyring.ready = ready;
+    keyring.finished = true;
+    pthread_cond_broadcast(&keyring.cond);
+    pthread_mutex_unlock(&keyring.lock);
+    return NULL;
+}
+
+static void keyring_start(void) {
+    if (pthread_create(&keyring.thread, NULL, keyring_worker, NULL) != 0) {
+        LOG_WARN("Failed to start keyring initialization, running it inline");
+        keyring_worker(NULL);
+        return;
+    }
+    pthread_detach(keyring.thread);
+    keyring.started = true;
+}
+
+static int keyring_wait(void) {
+    if (!keyring.started) return keyring.ready;
+
+    pthread_mutex_lock(&keyring.lock);
+    if (!keyring.finished) {
+        LOG_INFO("Waiting for the live pacman keyring");
+    }
+    while (!keyring.finished) {
+        pthread_cond_wait(&keyring.cond, &keyring.lock);
+    }
+    int ready = keyring.ready;
+    pthread_mutex_unlock(&keyring.lock);
+    return ready;
+}
+
+static int seed_target_keyring(void) {
+    if (!keyring_wait()) {
+        return 0;
+    }
+    if (!create_directory(TARGET_PATH("/etc/pacman.d"), 0755) ||
+        !copy_tree(KEYRING_DIR, TARGET_PATH("%s", KEYRING_DIR), 0, 0)) {
+        LOG_WARN("Failed to copy the live keyring into %s", target_root());
+        return 0;
+    }
+    return 1;
+}
+
+static Package_Prefetch prefetch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static long read_meminfo_kb(const char *key) {
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) return -1;
+
+    char line[256];
+    size_t key_len = strlen(key);
+    long value = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            value = strtol(line + key_len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+static int package_in_list(const char *list, const char *pkg) {
+    size_t len = strlen(pkg);
+    for (const char *p = list; (p = strstr(p, pkg)) != NULL; p += len) {
+        if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void common_packages(const char *a, const char *b, char *out, size_t size) {
+    char list[MAX_CMD_SIZE];
+    snprintf(list, sizeof(list), "%s", a);
+    out[0] = '\0';
+
+    size_t used = 0;
+    char *save = NULL;
+    for (char *pkg = strtok_r(list, " ", &save); pkg; pkg = strtok_r(NULL, " ", &save)) {
+        if (!package_in_list(b, pkg)) continue;
+        int n = snprintf(out + used, size - used, "%s%s", used ? " " : "", pkg);
+        if (n < 0 || (size_t)n >= size - used) break;
+        used += (size_t)n;
+    }
+}
+
+static int prefetch_has_room(void) {
+    struct statvfs vfs;
+    if (statvfs(PACMAN_CACHE_DIR, &vfs) != 0) {
+        LOG_WARN("Cannot stat package cache %s", PACMAN_CACHE_DIR);
+        return 0;
+    }
+
+    unsigned long long free_mb = (unsigned long long)vfs.f_bavail * vfs.f_frsize / (1024 * 1024);
+    long mem_available_mb = read_meminfo_kb("MemAvailable") / 1024;
+
+    LOG_INFO("Prefetch budget: %llu MiB free in cache, %ld MiB memory available", free_mb, mem_available_mb);
+    return free_mb >= PREFETCH_MIN_FREE_MB && mem_available_mb >= PREFETCH_MIN_FREE_MB;
+}
+
+static int prefetch_run(Cmd *cmd) {
+    cmd->new_group = true;
+
+    pthread_mutex_lock(&prefetch.lock);
+    if (prefetch.cancelled || !cmd_spawn(cmd)) {
+        pthread_mutex_unlock(&prefetch.lock);
+        return 0;
+    }
+    prefetch.pid = cmd->pid;
+    pthread_mutex_unlock(&prefetch.lock);
+
+    int result = cmd_wait(cmd);
+
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.pid = 0;
+    pthread_mutex_unlock(&prefetch.lock);
+
+    return result;
+}
+
+static int prefetch_download(const char *packages) {
+    Cmd cmd;
+    cmd_init(&cmd, "pacman");
+    cmd_arg(&cmd, "-Sw");
+    cmd_arg(&cmd, "--noconfirm");
+    cmd_arg(&cmd, "--dbpath");
+    cmd_arg(&cmd, PREFETCH_DB_DIR);
+    cmd_args_split(&cmd, packages);
+
+    int result = prefetch_run(&cmd);
+    cmd_free(&cmd);
+    return result;
+}
+
+static void *prefetch_worker(void *arg) {
+    (void)arg;
+    char common[MAX_CMD_SIZE];
+    int cached = 0;
+
+    rank_mirrors(MIRRORLIST_PATH);
+
+    if (!prefetch_has_room()) {
+        LOG_INFO("Not enough room in the live environment to prefetch packages");
+        goto done;
+    }
+
+    if (!create_directory(PREFETCH_DB_DIR, 0755)) {
+        LOG_WARN("Prefetch: cannot create %s, pacstrap will download everything", PREFETCH_DB_DIR);
+        goto done;
+    }
+
+    Cmd sync_cmd;
+    cmd_init(&sync_cmd, "pacman");
+    cmd_arg(&sync_cmd, "-Sy");
+    cmd_arg(&sync_cmd, "--noconfirm");
+    cmd_arg(&sync_cmd, "--dbpath");
+    cmd_arg(&sync_cmd, PREFETCH_DB_DIR);
+    int synced = prefetch_run(&sync_cmd);
+    cmd_free(&sync_cmd);
+
+    if (!synced) {
+        LOG_WARN("Prefetch: database sync failed, pacstrap will download everything");
+        goto done;
+    }
+
+    if (!keyring_wait()) {
+        LOG_WARN("Prefetch: no usable keyring, pacstrap will download everything");
+        goto done;
+    }
+
+    common_packages(XFCE_PACKAGES, OXWM_PACKAGES, common, sizeof(common));
+    if (prefetch_download(common)) {
+        cached = 1;
+        LOG_INFO("Prefetch: shared packages cached");
+    } else {
+        LOG_WARN("Prefetch: failed to download shared packages");
+    }
+
+    pthread_mutex_lock(&prefetch.lock);
+    while (!prefetch.selected && !prefetch.closing && !prefetch.cancelled) {
+        pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+    }
+    const char *selected = prefetch.cancelled ? NULL : prefetch.selected;
+    pthread_mutex_unlock(&prefetch.lock);
+
+    if (selected) {
+        if (prefetch_download(selected)) {
+            cached = 1;
+            LOG_INFO("Prefetch: selected package set cached");
+        } else {
+            LOG_WARN("Prefetch: failed to download selected packages");
+        }
+    }
+
+done:
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.cached = cached;
+    prefetch.finished = true;
+    pthread_cond_broadcast(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.lock);
+    return NULL;
+}
+
+static void prefetch_start(void) {
+    if (pthread_create(&prefetch.thread, NULL, prefetch_worker, NULL) != 0) {
+        LOG_WARN("Failed to start package prefetch");
+        return;
+    }
+    prefetch.started = true;
+    LOG_INFO("Package prefetch started");
+}
+
+static void prefetch_select(const char *packages) {
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.selected = packages;
+    pthread_cond_broadcast(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.lock);
+}
+
+static int prefetch_wait(void) {
+    if (!prefetch.started) return prefetch.cached;
+
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.closing = true;
+    pthread_cond_broadcast(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.lock);
+
+    pthread_join(prefetch.thread, NULL);
+    prefetch.started = false;
+
+    LOG_INFO("Package prefetch %s", prefetch.cached ? "completed" : "produced no usable cache");
+    return prefetch.cached;
+}
+
+static void prefetch_cancel(void) {
+    if (!prefetch.started) return;
+
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.cancelled = true;
+    if (prefetch.pid > 0) {
+        kill(-prefetch.pid, SIGTERM);
+    }
+    pthread_cond_broadcast(&prefetch.cond);
+    pthread_mutex_unlock(&prefetch.lock);
+
+    pthread_join(prefetch.thread, NULL);
+    prefetch.started = false;
+    LOG_INFO("Package prefetch cancelled");
+}
+
+static const char *offline_pacman_conf = NULL;
+
+static int offline_repo_available(void) {
+    struct stat st;
+    return stat(OFFLINE_REPO_DIR "/" OFFLINE_REPO_NAME ".db", &st) == 0;
+}
+
+static int offline_repo_enable(bool online) {
+    int written = write_file_fmt(OFFLINE_PACMAN_CONF,
+        "[options]\n"
+        "HoldPkg = pacman glibc\n"
+        "Architecture = auto\n"
+        "CacheDir = %s\n"
+        "CheckSpace\n"
+        "ParallelDownloads = 5\n"
+        "SigLevel = Required DatabaseOptional\n"
+        "LocalFileSigLevel = Optional\n"
+        "\n"
+        "[%s]\n"
+        "SigLevel = Optional TrustAll\n"
+        "Server = file://%s\n"
+        "%s",
+        OFFLINE_REPO_DIR, OFFLINE_REPO_NAME, OFFLINE_REPO_DIR,
+        online ? "\n[core]\nInclude = " MIRRORLIST_PATH "\n\n[extra]\nInclude = " MIRRORLIST_PATH "\n" : "");
+    if (!written) {
+        LOG_WARN("Failed to write %s, installing from the network", OFFLINE_PACMAN_CONF);
+        return 0;
+    }
+
+    offline_pacman_conf = OFFLINE_PACMAN_CONF;
+    LOG_INFO("Installing from local repository %s%s", OFFLINE_REPO_DIR,
+             online ? " (network used for packages it lacks)" : " without network");
+    return 1;
+}
+
+static void draw_form(
+        const char *username,
+        const char *password,
+        const char *confirmed_password,
+        const char *hostname,
+        const char *keyboard,
+        const char *timezone,
+        int current_field
+    ) {
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+
+    clear_screen();
+    draw_logo(cols);
+
+    int logo_start = (cols - 70) / 2;
+    int form_row = 10;
+
+    printf(ANSI_CURSOR_POS ANSI_WHITE "Setup your system:" ANSI_RESET, form_row, logo_start);
+    form_row += 2;
+
+    Tui_Field fields[] = {
+        {"Username",         username,           NULL,       0},
+        {"Password",         password,           NULL,       1},
+        {"Confirm Password", confirmed_password, NULL,       1},
+        {"Hostname",         hostname,           "tonarchy", 0},
+        {"Keyboard",         keyboard,           "us",       0},
+        {"Timezone",         timezone,           NULL,       0},
+    };
+    int num_fields = (int)(sizeof(fields) / sizeof(fields[0]));
+
+    for (int i = 0; i < num_fields; i++) {
+        printf(ANSI_CURSOR_POS, form_row + i, logo_start);
+
+        if (current_field == i) {
+            printf(ANSI_BLUE_BOLD ">" ANSI_RESET " ");
+        } else {
+            printf("  ");
+        }
+
+        printf(ANSI_WHITE "%s: " ANSI_RESET, fields[i].label);
+
+        if (strlen(fields[i].value) > 0) {
+            printf(ANSI_GREEN "%s" ANSI_RESET, fields[i].is_password ? "********" : fields[i].value);
+        } else if (current_field != i) {
+            if (fields[i].default_display) {
+                printf(ANSI_GRAY "%s" ANSI_RESET, fields[i].default_display);
+            } else {
+                printf(ANSI_GRAY "[not set]" ANSI_RESET);
+            }
+        }
+    }
+
+    fflush(stdout);
+}
+
+static int validate_alphanumeric(const char *s) {
+    for (int i = 0; s[i]; i++) {
+        if (!isalnum(s[i]) && s[i] != '-' && s[i] != '_')
+            return 0;
+    }
+    return 1;
+}
+
+static int read_line(char *buf, int size, int echo) {
+    struct termios old_term;
+    tcgetattr(STDIN_FILENO, &old_term);
+    struct termios new_term = old_term;
+    if (echo)
+        new_term.c_lflag |= ECHO;
+    else
+        new_term.c_lflag &= ~ECHO;
+    new_term.c_lflag |= ICANON;
+    new_term.c_lflag &= ~ISIG;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_term);
+
+    int result = (fgets(buf, size, stdin) != NULL);
+    if (result)
+        buf[strcspn(buf, "\n")] = '\0';
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
+    return result;
+}
+
+static int fzf_select(char *dest, size_t size, const char *list_program, const char *list_arg,
+                      const char *prompt, const char *header, const char *default_val) {
+    clear_screen();
+
+    Cmd list;
+    cmd_init(&list, list_program);
+    cmd_arg(&list, list_arg);
+    list.capture = true;
+    if (!cmd_run(&list) || !list.output) {
+        cmd_free(&list);
+        return 0;
+    }
+
+    Cmd fzf;
+    cmd_init(&fzf, "fzf");
+    cmd_arg(&fzf, "--height=40%");
+    cmd_arg(&fzf, "--reverse");
+    cmd_argf(&fzf, "--prompt=%s", prompt);
+    cmd_argf(&fzf, "--header=%s", header);
+    if (default_val) {
+        cmd_argf(&fzf, "--query=%s", default_val);
+    }
+    fzf.input = list.output;
+    fzf.capture = true;
+    fzf.terminal = true;
+    cmd_run(&fzf);
+
+    if (fzf.output) {
+        fzf.output[strcspn(fzf.output, "\n")] = '\0';
+        if (fzf.output[0])
+            snprintf(dest, size, "%s", fzf.output);
+    }
+    cmd_free(&fzf);
+    cmd_free(&list);
+
+    if (strlen(dest) == 0 && default_val)
+        snprintf(dest, size, "%s", default_val);
+
+    return 1;
+}
+
+static int fzf_select_keymap(char *dest, size_t size) {
+    return fzf_select(dest, size, "localectl", "list-keymaps", "Keyboard: ",
+                      "Start typing to filter, Enter to select", "us");
+}
+
+static int fzf_select_timezone(char *dest, size_t size) {
+    return fzf_select(dest, size, "timedatectl", "list-timezones", "Timezone: ",
+                      "Type your city/timezone, Enter to select", NULL);
+}
+
+static int handle_password_entry(
+        char *password,
+        char *confirmed_password,
+        int form_row,
+        int logo_start,
+        char *username,
+        char *hostname,
+        char *keyboard,
+        char *timezone
+    ) {
+    char temp_input[256];
+    char password_confirm[256];
+
+    printf(ANSI_CURSOR_POS, form_row + 1, logo_start + 13);
+    fflush(stdout);
+
+    if (!read_line(temp_input, sizeof(temp_input), 0))
+        return -1;
+
+    if (strlen(temp_input) == 0) {
+        show_message("Password cannot be empty");
+        return 0;
+    }
+
+    strcpy(password, temp_input);
+
+    draw_form(username, password, confirmed_password, hostname, keyboard, timezone, 2);
+    printf(ANSI_CURSOR_POS, form_row + 2, logo_start + 20);
+    fflush(stdout);
+
+    if (!read_line(password_confirm, sizeof(password_confirm), 0))
+        return -1;
+
+    if (strcmp(password, password_confirm) == 0) {
+        strcpy(confirmed_password, password_confirm);
+        return 1;
+    } else {
+        show_message("Passwords do not match");
+        return 0;
+    }
+}
+
+static int get_form_input(
+        char *username,
+        char *password,
+        char *confirmed_password,
+        char *hostname,
+        char *keyboard,
+        char *timezone
+    ) {
+    char temp_input[256];
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+    int logo_start = (cols - 70) / 2;
+    int form_row = 12;
+
+    Form_Field fields[] = {
+        {username, NULL,       INPUT_TEXT,         13, "Username must be alphanumeric"},
+        {password, NULL,       INPUT_PASSWORD,     13, NULL},
+        {confirmed_password, NULL, INPUT_PASSWORD, 20, NULL},
+        {hostname, "tonarchy", INPUT_TEXT,         13, "Hostname must be alphanumeric"},
+        {keyboard, "us",       INPUT_FZF_KEYMAP,   0,  NULL},
+        {timezone, NULL,       INPUT_FZF_TIMEZONE, 0,  "Timezone is required"},
+    };
+    int num_fields = (int)(sizeof(fields) / sizeof(fields[0]));
+
+    int current_field = 0;
+    while (current_field < num_fields) {
+        draw_form(username, password, confirmed_password, hostname, keyboard, timezone, current_field);
+        Form_Field *f = &fields[current_field];
+
+        if (f->type == INPUT_FZF_KEYMAP) {
+            fzf_select_keymap(keyboard, FORM_FIELD_SIZE);
+            current_field++;
+        } else if (f->type == INPUT_FZF_TIMEZONE) {
+            fzf_select_timezone(timezone, FORM_FIELD_SIZE);
+            if (strlen(timezone) == 0) {
+                show_message("Timezone is required");
+            } else {
+                current_field++;
+            }
+        } else if (current_field == 1) {
+            int result = handle_password_entry(
+                password,
+                confirmed_password,
+                form_row,
+                logo_start,
+                username,
+                hostname,
+                keyboard,
+                timezone
+            );
+            if (result == -1) return 0;
+            if (result == 1) current_field = 3;
+        } else if (current_field == 2) {
+            current_field = 1;
+        } else {
+            printf(ANSI_CURSOR_POS, form_row + current_field, logo_start + f->cursor_offset);
+            fflush(stdout);
+
+            if (!read_line(temp_input, sizeof(temp_input), 1))
+                return 0;
+
+            if (strlen(temp_input) == 0) {
+                if (f->default_val) {
+                    strcpy(f->dest, f->default_val);
+                    current_field++;
+                }
+            } else if (validate_alphanumeric(temp_input)) {
+                strcpy(f->dest, temp_input);
+                current_field++;
+            } else {
+                show_message(f->error_msg);
+            }
+        }
+    }
+
+    while (1) {
+        draw_form(username, password, confirmed_password, hostname, keyboard, timezone, 6);
+
+        get_terminal_size(&rows, &cols);
+        logo_start = (cols - 70) / 2;
+
+        printf(ANSI_CURSOR_POS ANSI_YELLOW "Press Enter to continue, or field number to edit (0-5)" ANSI_RESET, 20, logo_start);
+        fflush(stdout);
+
+        enable_raw_mode();
+        char c;
+        if (read(STDIN_FILENO, &c, 1) == 1) {
+            if (c == '\r' || c == '\n') {
+                disable_raw_mode();
+                return 1;
+            }
+            if (c == 'q' || c == 27) {
+                disable_raw_mode();
+                return 0;
+            }
+            if (c >= '0' && c <= '5') {
+                disable_raw_mode();
+                int edit_field = c - '0';
+                Form_Field *f = &fields[edit_field];
+
+                if (f->type == INPUT_FZF_KEYMAP) {
+                    fzf_select_keymap(keyboard, FORM_FIELD_SIZE);
+                } else if (f->type == INPUT_FZF_TIMEZONE) {
+                    fzf_select_timezone(timezone, FORM_FIELD_SIZE);
+                    if (strlen(timezone) == 0)
+                        show_message("Timezone is required");
+                } else if (edit_field == 1 || edit_field == 2) {
+                    draw_form(username, password, confirmed_password, hostname, keyboard, timezone, 1);
+                    handle_password_entry(password, confirmed_password,
+                                          form_row, logo_start,
+                                          username, hostname, keyboard, timezone);
+                } else {
+                    draw_form(username, password, confirmed_password, hostname, keyboard, timezone, edit_field);
+                    printf(ANSI_CURSOR_POS, form_row + edit_field, logo_start + f->cursor_offset);
+                    fflush(stdout);
+
+                    if (read_line(temp_input, sizeof(temp_input), 1)) {
+                        if (strlen(temp_input) == 0 && f->default_val) {
+                            strcpy(f->dest, f->default_val);
+                        } else if (strlen(temp_input) > 0) {
+                            if (validate_alphanumeric(temp_input))
+                                strcpy(f->dest, temp_input);
+                            else
+                                show_message(f->error_msg);
+                        }
+                    }
+                }
+                continue;
+            }
+        }
+        disable_raw_mode();
+    }
+
+    return 1;
+}
+
+static void unescape_lsblk(char *s) {
+    char *out = s;
+    for (char *in = s; *in; ) {
+        unsigned int c;
+        if (in[0] == '\\' && in[1] == 'x' && sscanf(in + 2, "%2x", &c) == 1) {
+            *out++ = (char)c;
+            in += 4;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+static int select_disk(char *disk_name) {
+    clear_screen();
+
+    Cmd cmd;
+    cmd_init(&cmd, "lsblk");
+    cmd_arg(&cmd, "-d");
+    cmd_arg(&cmd, "-n");
+    cmd_arg(&cmd, "-r");
+    cmd_arg(&cmd, "-o");
+    cmd_arg(&cmd, "NAME,TYPE,SIZE,MODEL");
+    cmd.capture = true;
+    if (!cmd_run(&cmd) || !cmd.output) {
+        cmd_free(&cmd);
+        show_message("Failed to list disks");
+        return 0;
+    }
+
+    char disks[32][256];
+    char names[32][64];
+    int disk_count = 0;
+
+    char *next;
+    for (char *line = cmd.output; line && *line && disk_count < 32; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        char name[64], type[16], size[32], model[128] = "";
+        if (sscanf(line, "%63s %15s %31s %127[^\n]", name, type, size, model) < 3) continue;
+        if (strcmp(type, "disk") != 0 || strstr(name, "loop") || strstr(name, "rom") || strstr(name, "airoot")) continue;
+
+        unescape_lsblk(model);
+        snprintf(names[disk_count], sizeof(names[0]), "%s", name);
+        snprintf(disks[disk_count], sizeof(disks[0]), "%s (%s) %s", name, size, model);
+        disk_count++;
+    }
+    cmd_free(&cmd);
+
+    if (disk_count == 0) {
+        show_message("No disks found");
+        return 0;
+    }
+
+    const char *disk_ptrs[32];
+    for (int i = 0; i < disk_count; i++) {
+        disk_ptrs[i] = disks[i];
+    }
+
+    int selected = select_from_menu(disk_ptrs, disk_count);
+    if (selected < 0) {
+        return 0;
+    }
+
+    strcpy(disk_name, names[selected]);
+
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+    clear_screen();
+    draw_logo(cols);
+
+    int logo_start = (cols - 70) / 2;
+    printf("\033[%d;%dH\033[37mWARNING: All data on \033[31m/dev/%s\033[37m will be destroyed!\033[0m", 10, logo_start, disk_name);
+    printf("\033[%d;%dH\033[37mType 'yes' to confirm: \033[0m", 12, logo_start);
+    fflush(stdout);
+
+    char confirm[256];
+    struct termios old_term;
+    tcgetattr(STDIN_FILENO, &old_term);
+    struct termios new_term = old_term;
+    new_term.c_lflag |= (ECHO | ICANON);
+    new_term.c_lflag &= ~ISIG;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_term);
+
+    if (fgets(confirm, sizeof(confirm), stdin) == NULL) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
+        return 0;
+    }
+    confirm[strcspn(confirm, "\n")] = '\0';
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
+
+    if (strcmp(confirm, "yes") != 0) {
+        show_message("Installation cancelled");
+        return 0;
+    }
+
+    return 1;
+}
+
+static const char *GPT_TYPE_EFI = "C12A7328-F81F-11D2-BA4B-00A0C93EC93B";
+static const char *GPT_TYPE_SWAP = "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F";
+static const char *GPT_TYPE_LINUX = "0FC63DAF-8483-4772-8E79-3D69D8477DE4";
+
+static int read_sysfs_u64(const char *path, uint64_t *value) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    unsigned long long v;
+    int ok = fscanf(fp, "%llu", &v) == 1;
+    fclose(fp);
+    if (ok) *value = v;
+    return ok;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static int random_bytes(uint8_t *out, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = getrandom(out + off, len - off, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        off += (size_t)n;
+    }
+    return 1;
+}
+
+static int generate_uuid(uint8_t uuid[16]) {
+    if (!random_bytes(uuid, 16)) return 0;
+    uuid[6] = (uint8_t)((uuid[6] & 0x0F) | 0x40);
+    uuid[8] = (uint8_t)((uuid[8] & 0x3F) | 0x80);
+    return 1;
+}
+
+static void format_uuid(const uint8_t uuid[16], char out[37]) {
+    snprintf(out, 37, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+             uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+}
+
+static void parse_uuid(const char *str, uint8_t out[16]) {
+    size_t n = 0;
+    for (const char *p = str; *p && n < 16; p++) {
+        if (*p == '-') continue;
+        unsigned int byte;
+        sscanf(p, "%2x", &byte);
+        out[n++] = (uint8_t)byte;
+        p++;
+    }
+}
+
+static void guid_to_disk(const uint8_t uuid[16], uint8_t out[16]) {
+    out[0] = uuid[3]; out[1] = uuid[2]; out[2] = uuid[1]; out[3] = uuid[0];
+    out[4] = uuid[5]; out[5] = uuid[4];
+    out[6] = uuid[7]; out[7] = uuid[6];
+    memcpy(out + 8, uuid + 8, 8);
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 1;
+}
+
+static int zero_range(int fd, uint64_t offset, uint64_t len) {
+    static const uint8_t zeros[65536];
+    while (len > 0) {
+        size_t chunk = len < sizeof(zeros) ? (size_t)len : sizeof(zeros);
+        if (!pwrite_all(fd, zeros, chunk, offset)) return 0;
+        offset += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+static const char *DEVICE_CLASS_NAMES[] = {"hdd", "ssd", "nvme", "flash"};
+
+static const Root_Fs ROOT_FILESYSTEMS[] = {
+    {"ext4",  "ext4 (default, most tested)",              NULL,          NULL},
+    {"btrfs", "btrfs (zstd compression, subvolumes)",     "btrfs-progs", "btrfs"},
+    {"xfs",   "xfs (large files, parallel I/O)",          "xfsprogs",    "xfs"},
+    {"f2fs",  "f2fs (fast on SD cards and USB sticks)",   "f2fs-tools",  "f2fs"},
+};
+
+static const Root_Fs *root_fs_find(const char *name) {
+    for (size_t i = 0; i < sizeof(ROOT_FILESYSTEMS) / sizeof(ROOT_FILESYSTEMS[0]); i++) {
+        if (strcmp(ROOT_FILESYSTEMS[i].name, name) == 0) {
+            return &ROOT_FILESYSTEMS[i];
+        }
+    }
+    return NULL;
+}
+
+static int package_set_add(char *set, size_t size, const char *packages) {
+    char copy[MAX_CMD_SIZE];
+    snprintf(copy, sizeof(copy), "%s", packages);
+
+    size_t used = strlen(set);
+    char *save = NULL;
+    for (char *pkg = strtok_r(copy, " ", &save); pkg; pkg = strtok_r(NULL, " ", &save)) {
+        if (package_in_list(set, pkg)) continue;
+        int n = snprintf(set + used, size - used, "%s%s", used ? " " : "", pkg);
+        if (n < 0 || (size_t)n >= size - used) return 0;
+        used += (size_t)n;
+    }
+    return 1;
+}
+
+static int print_package_set(void) {
+    char set[MAX_CMD_SIZE * 2] = "";
+    int ok = package_set_add(set, sizeof(set), XFCE_PACKAGES)
+        && package_set_add(set, sizeof(set), OXWM_PACKAGES)
+        && package_set_add(set, sizeof(set), "zram-generator grub");
+    for (size_t i = 0; ok && i < sizeof(ROOT_FILESYSTEMS) / sizeof(ROOT_FILESYSTEMS[0]); i++) {
+        if (ROOT_FILESYSTEMS[i].package) {
+            ok = package_set_add(set, sizeof(set), ROOT_FILESYSTEMS[i].package);
+        }
+    }
+    if (!ok) return 0;
+
+    char *save = NULL;
+    for (char *pkg = strtok_r(set, " ", &save); pkg; pkg = strtok_r(NULL, " ", &save)) {
+        printf("%s\n", pkg);
+    }
+    return 1;
+}
+
+static const Btrfs_Subvolume BTRFS_SUBVOLUMES[] = {
+    {"@",      "/"},
+    {"@home",  "/home"},
+    {"@cache", "/var/cache"},
+    {"@log",   "/var/log"},
+};
+
+static int root_is_btrfs(const Disk_Layout *layout) {
+    return layout->root_fs && strcmp(layout->root_fs->name, "btrfs") == 0;
+}
+
+static int root_uses_async_discard(const Disk_Layout *layout) {
+    return root_is_btrfs(layout) && layout->profile.discard_granularity > 0 && !layout->profile.rotational;
+}
+
+static void root_mount_options(const Disk_Layout *layout, char *out, size_t size) {
+    if (root_is_btrfs(layout)) {
+        snprintf(out, size, "%s,compress=zstd:1,space_cache=v2%s",
+                 layout->profile.mount_options, root_uses_async_discard(layout) ? ",discard=async" : "");
+    } else {
+        snprintf(out, size, "%s", layout->profile.mount_options);
+    }
+}
+
+void device_profile_probe(Device_Profile *profile, const char *dev) {
+    memset(profile, 0, sizeof(*profile));
+    const char *name = strrchr(dev, '/') ? strrchr(dev, '/') + 1 : dev;
+    char path[PATH_MAX];
+    char real[PATH_MAX];
+    uint64_t value = 0;
+
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/rotational", name);
+    profile->rotational = read_sysfs_u64(path, &value) && value == 1;
+    snprintf(path, sizeof(path), "/sys/block/%s/removable", name);
+    profile->removable = read_sysfs_u64(path, &value) && value == 1;
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/discard_granularity", name);
+    if (read_sysfs_u64(path, &value)) profile->discard_granularity = value;
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/nr_requests", name);
+    if (read_sysfs_u64(path, &value)) profile->nr_requests = value;
+
+    snprintf(path, sizeof(path), "/sys/block/%s", name);
+    if (realpath(path, real) == NULL) real[0] = '\0';
+
+    if (strncmp(name, "nvme", 4) == 0) {
+        snprintf(profile->transport, sizeof(profile->transport), "nvme");
+    } else if (strstr(real, "/usb")) {
+        snprintf(profile->transport, sizeof(profile->transport), "usb");
+    } else if (strncmp(name, "mmcblk", 6) == 0) {
+        snprintf(profile->transport, sizeof(profile->transport), "mmc");
+    } else if (strncmp(name, "vd", 2) == 0 || strstr(real, "/virtio")) {
+        snprintf(profile->transport, sizeof(profile->transport), "virtio");
+    } else if (strstr(real, "/ata")) {
+        snprintf(profile->transport, sizeof(profile->transport), "sata");
+    } else {
+        snprintf(profile->transport, sizeof(profile->transport), "%s", real[0] ? "scsi" : "file");
+    }
+
+    if (strcmp(profile->transport, "nvme") == 0) {
+        profile->device_class = DEVICE_NVME;
+    } else if (strcmp(profile->transport, "usb") == 0 || strcmp(profile->transport, "mmc") == 0 || profile->removable) {
+        profile->device_class = DEVICE_FLASH;
+    } else if (profile->rotational) {
+        profile->device_class = DEVICE_HDD;
+    } else {
+        profile->device_class = DEVICE_SSD;
+    }
+
+    switch (profile->device_class) {
+    case DEVICE_HDD:
+        profile->scheduler = "bfq";
+        profile->mount_options = "relatime";
+        break;
+    case DEVICE_SSD:
+        profile->scheduler = "mq-deadline";
+        profile->mount_options = "noatime";
+        break;
+    case DEVICE_NVME:
+        profile->scheduler = "none";
+        profile->mount_options = "noatime";
+        break;
+    case DEVICE_FLASH:
+        profile->scheduler = "mq-deadline";
+        profile->mount_options = "noatime,commit=60";
+        break;
+    }
+    profile->fstrim_timer = profile->discard_granularity > 0 && profile->device_class != DEVICE_HDD;
+
+    LOG_INFO("Device profile for %s: class %s, transport %s, rotational %d, removable %d, "
+             "discard granularity %llu, nr_requests %llu -> scheduler %s, mount options %s, fstrim timer %s",
+             dev, DEVICE_CLASS_NAMES[profile->device_class], profile->transport,
+             profile->rotational, profile->removable,
+             (unsigned long long)profile->discard_granularity, (unsigned long long)profile->nr_requests,
+             profile->scheduler, profile->mount_options, profile->fstrim_timer ? "yes" : "no");
+}
+
+static const char *SWAP_KIND_NAMES[] = {"zram", "swapfile", "partition"};
+
+void plan_swap(Swap_Plan *plan, const Device_Profile *profile, const Root_Fs *root_fs, bool hibernate) {
+    const uint64_t GiB = 1024ull * 1024 * 1024;
+    long mem_kb = read_meminfo_kb("MemTotal");
+    uint64_t ram = mem_kb > 0 ? (uint64_t)mem_kb * 1024 : 4 * GiB;
+    uint64_t ram_rounded = (ram + GiB - 1) / GiB * GiB;
+    const char *fs = root_fs ? root_fs->name : "ext4";
+    bool swapfile_ok = strcmp(fs, "ext4") == 0 || strcmp(fs, "xfs") == 0;
+    bool solid = profile->device_class == DEVICE_SSD || profile->device_class == DEVICE_NVME;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->hibernate = hibernate;
+
+    if (hibernate && swapfile_ok) {
+        plan->kind = SWAP_FILE;
+        plan->size_bytes = ram_rounded;
+        snprintf(plan->reason, sizeof(plan->reason), "hibernation needs disk swap of at least RAM size and %s supports swap files", fs);
+    } else if (hibernate) {
+        plan->kind = SWAP_PARTITION;
+        plan->size_bytes = ram_rounded;
+        snprintf(plan->reason, sizeof(plan->reason), "hibernation needs disk swap of at least RAM size and %s gets a partition", fs);
+    } else if (ram > ZRAM_MAX_RAM && solid && swapfile_ok) {
+        plan->kind = SWAP_FILE;
+        plan->size_bytes = ram_rounded < SWAPFILE_MAX_SIZE ? ram_rounded : SWAPFILE_MAX_SIZE;
+        snprintf(plan->reason, sizeof(plan->reason), "large RAM on %s storage only needs overflow swap",
+                 DEVICE_CLASS_NAMES[profile->device_class]);
+    } else {
+        plan->kind = SWAP_ZRAM;
+        plan->size_bytes = ram < ZRAM_MAX_SIZE ? ram : ZRAM_MAX_SIZE;
+        if (ram <= ZRAM_MAX_RAM) {
+            snprintf(plan->reason, sizeof(plan->reason), "RAM is small enough that compressed RAM swap beats disk swap");
+        } else {
+            snprintf(plan->reason, sizeof(plan->reason), "no disk swap on %s with %s", DEVICE_CLASS_NAMES[profile->device_class], fs);
+        }
+    }
+
+    LOG_INFO("Swap plan: %s of %.1f GiB for %.1f GiB RAM on %s/%s%s (%s)",
+             SWAP_KIND_NAMES[plan->kind], (double)plan->size_bytes / GiB, (double)ram / GiB,
+             DEVICE_CLASS_NAMES[profile->device_class], fs, hibernate ? ", hibernation" : "", plan->reason);
+}
+
+int disk_probe(Disk_Layout *layout, const char *dev) {
+    memset(layout, 0, sizeof(*layout));
+    snprintf(layout->dev, sizeof(layout->dev), "%s", dev);
+    layout->logical_sector = 512;
+    layout->physical_sector = 512;
+
+    int fd = open(dev, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open %s: %s", dev, strerror(errno));
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        const char *name = strrchr(dev, '/') ? strrchr(dev, '/') + 1 : dev;
+        char path[PATH_MAX];
+        uint64_t value;
+
+        snprintf(path, sizeof(path), "/sys/class/block/%s/queue/logical_block_size", name);
+        if (read_sysfs_u64(path, &value) && value >= 512) layout->logical_sector = (uint32_t)value;
+        snprintf(path, sizeof(path), "/sys/class/block/%s/queue/physical_block_size", name);
+        if (read_sysfs_u64(path, &value) && value >= layout->logical_sector) layout->physical_sector = (uint32_t)value;
+        snprintf(path, sizeof(path), "/sys/class/block/%s/queue/optimal_io_size", name);
+        if (read_sysfs_u64(path, &value)) layout->optimal_io = (uint32_t)value;
+
+        uint64_t size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &size) == 0) layout->size_bytes = size;
+    } else {
+        layout->size_bytes = (uint64_t)st.st_size;
+    }
+    device_profile_probe(&layout->profile, dev);
+    close(fd);
+
+    uint64_t unit = layout->physical_sector;
+    if (layout->optimal_io > unit && layout->optimal_io <= MAX_OPTIMAL_IO &&
+        layout->optimal_io % layout->logical_sector == 0) {
+        unit = layout->optimal_io;
+    }
+    layout->alignment = ((PART_ALIGN_BYTES + unit - 1) / unit) * unit;
+
+    LOG_INFO("Disk %s: %llu bytes, logical %u, physical %u, optimal io %u, alignment %llu",
+             dev, (unsigned long long)layout->size_bytes, layout->logical_sector,
+             layout->physical_sector, layout->optimal_io, (unsigned long long)layout->alignment);
+
+    if (layout->size_bytes < 8ull * 1024 * 1024 * 1024) {
+        LOG_ERROR("Disk %s is too small (%llu bytes)", dev, (unsigned long long)layout->size_bytes);
+        return 0;
+    }
+    return 1;
+}
+
+static Partition *disk_add_partition(Disk_Layout *layout, Part_Role role, const char *name,
+                                     const char *fs_type, uint64_t start, uint64_t size) {
+    Partition *part = &layout->parts[layout->part_count++];
+    memset(part, 0, sizeof(*part));
+    part->role = role;
+    part->number = (int)layout->part_count;
+    part->name = name;
+    part->fs_type = fs_type;
+    part->start_lba = start / layout->logical_sector;
+    part->size_lba = size / layout->logical_sector;
+    if (layout->disk[0]) {
+        char path[sizeof(part->path)];
+        part_path(path, sizeof(path), layout->disk, part->number);
+        memcpy(part->path, path, sizeof(path));
+    }
+
+    generate_uuid(part->uuid);
+    format_uuid(part->uuid, part->uuid_str);
+
+    if (strcmp(fs_type, "vfat") == 0) {
+        uint8_t id[4];
+        random_bytes(id, sizeof(id));
+        snprintf(part->fs_uuid, sizeof(part->fs_uuid), "%02X%02X-%02X%02X", id[0], id[1], id[2], id[3]);
+    } else {
+        uint8_t fs_uuid[16];
+        generate_uuid(fs_uuid);
+        format_uuid(fs_uuid, part->fs_uuid);
+    }
+    return part;
+}
+
+int disk_plan(Disk_Layout *layout, bool gpt) {
+    layout->gpt = gpt;
+    layout->part_count = 0;
+    generate_uuid(layout->disk_uuid);
+    random_bytes((uint8_t *)&layout->mbr_signature, sizeof(layout->mbr_signature));
+
+    uint64_t align = layout->alignment;
+    uint64_t sector = layout->logical_sector;
+    uint64_t entry_bytes = (uint64_t)GPT_ENTRY_COUNT * GPT_ENTRY_SIZE;
+    uint64_t tail = gpt ? entry_bytes + sector : 0;
+    uint64_t end = ((layout->size_bytes - tail) / align) * align;
+    const uint64_t GiB = 1024ull * 1024 * 1024;
+
+    uint64_t pos = align;
+    if (gpt) {
+        disk_add_partition(layout, PART_EFI, "EFI", "vfat", pos, EFI_PART_SIZE);
+        pos += EFI_PART_SIZE;
+    }
+    if (layout->swap.kind == SWAP_PARTITION) {
+        uint64_t swap_size = (layout->swap.size_bytes + align - 1) / align * align;
+        disk_add_partition(layout, PART_SWAP, "swap", "swap", pos, swap_size);
+        pos += swap_size;
+    }
+
+    if (end <= pos + GiB) {
+        LOG_ERROR("Not enough space left for the root partition on %s", layout->dev);
+        return 0;
+    }
+    disk_add_partition(layout, PART_ROOT, "root", layout->root_fs ? layout->root_fs->name : "ext4", pos, end - pos);
+
+    for (size_t i = 0; i < layout->part_count; i++) {
+        const Partition *part = &layout->parts[i];
+        LOG_INFO("Partition %d (%s): start %llu, %llu sectors of %u bytes, PARTUUID %s, UUID %s",
+                 part->number, part->name,
+                 (unsigned long long)part->start_lba, (unsigned long long)part->size_lba,
+                 layout->logical_sector, part->uuid_str, part->fs_uuid);
+    }
+    return 1;
+}
+
+const Partition *disk_find_partition(const Disk_Layout *layout, Part_Role role) {
+    for (size_t i = 0; i < layout->part_count; i++) {
+        if (layout->parts[i].role == role) return &layout->parts[i];
+    }
+    return NULL;
+}
+
+static void fill_mbr_entry(uint8_t *entry, uint8_t status, uint8_t type, uint64_t start, uint64_t count) {
+    entry[0] = status;
+    entry[1] = 0xFE; entry[2] = 0xFF; entry[3] = 0xFF;
+    entry[4] = type;
+    entry[5] = 0xFE; entry[6] = 0xFF; entry[7] = 0xFF;
+    put_le32(entry + 8, start > UINT32_MAX ? UINT32_MAX : (uint32_t)start);
+    put_le32(entry + 12, count > UINT32_MAX ? UINT32_MAX : (uint32_t)count);
+}
+
+static int write_gpt(int fd, const Disk_Layout *layout, uint8_t *sector_buf) {
+    uint32_t sector = layout->logical_sector;
+    uint64_t last_lba = layout->size_bytes / sector - 1;
+    uint64_t entry_sectors = ((uint64_t)GPT_ENTRY_COUNT * GPT_ENTRY_SIZE + sector - 1) / sector;
+    size_t entry_bytes = (size_t)GPT_ENTRY_COUNT * GPT_ENTRY_SIZE;
+
+    uint8_t *entries = calloc(1, entry_bytes);
+    if (!entries) return 0;
+
+    for (size_t i = 0; i < layout->part_count; i++) {
+        const Partition *part = &layout->parts[i];
+        uint8_t *e = entries + i * GPT_ENTRY_SIZE;
+        uint8_t type[16];
+        const char *type_str = part->role == PART_EFI ? GPT_TYPE_EFI
+                             : part->role == PART_SWAP ? GPT_TYPE_SWAP : GPT_TYPE_LINUX;
+        parse_uuid(type_str, type);
+        guid_to_disk(type, e);
+        guid_to_disk(part->uuid, e + 16);
+        put_le64(e + 32, part->start_lba);
+        put_le64(e + 40, part->start_lba + part->size_lba - 1);
+        for (size_t c = 0; part->name[c] && c < 36; c++) {
+            put_le16(e + 56 + 2 * c, (uint16_t)(unsigned char)part->name[c]);
+        }
+    }
+    uint32_t entries_crc = crc32_update(0, entries, entry_bytes);
+
+    memset(sector_buf, 0, sector);
+    fill_mbr_entry(sector_buf + 446, 0x00, 0xEE, 1, last_lba);
+    sector_buf[510] = 0x55;
+    sector_buf[511] = 0xAA;
+    int ok = pwrite_all(fd, sector_buf, sector, 0);
+
+    for (int backup = 0; ok && backup < 2; backup++) {
+        uint64_t header_lba = backup ? last_lba : 1;
+        uint64_t other_lba = backup ? 1 : last_lba;
+        uint64_t entries_lba = backup ? last_lba - entry_sectors : 2;
+
+        memset(sector_buf, 0, sector);
+        memcpy(sector_buf, "EFI PART", 8);
+        put_le32(sector_buf + 8, 0x00010000);
+        put_le32(sector_buf + 12, 92);
+        put_le64(sector_buf + 24, header_lba);
+        put_le64(sector_buf + 32, other_lba);
+        put_le64(sector_buf + 40, 2 + entry_sectors);
+        put_le64(sector_buf + 48, last_lba - entry_sectors - 1);
+        guid_to_disk(layout->disk_uuid, sector_buf + 56);
+        put_le64(sector_buf + 72, entries_lba);
+        put_le32(sector_buf + 80, GPT_ENTRY_COUNT);
+        put_le32(sector_buf + 84, GPT_ENTRY_SIZE);
+        put_le32(sector_buf + 88, entries_crc);
+        put_le32(sector_buf + 16, crc32_update(0, sector_buf, 92));
+
+        ok = pwrite_all(fd, entries, entry_bytes, entries_lba * sector) &&
+             pwrite_all(fd, sector_buf, sector, header_lba * sector);
+    }
+
+    free(entries);
+    return ok;
+}
+
+static int write_mbr(int fd, const Disk_Layout *layout, uint8_t *sector_buf) {
+    memset(sector_buf, 0, layout->logical_sector);
+    put_le32(sector_buf + 440, layout->mbr_signature);
+    for (size_t i = 0; i < layout->part_count && i < 4; i++) {
+        const Partition *part = &layout->parts[i];
+        fill_mbr_entry(sector_buf + 446 + 16 * i,
+                       part->role == PART_ROOT ? 0x80 : 0x00,
+                       part->role == PART_SWAP ? 0x82 : 0x83,
+                       part->start_lba, part->size_lba);
+    }
+    sector_buf[510] = 0x55;
+    sector_buf[511] = 0xAA;
+    return pwrite_all(fd, sector_buf, layout->logical_sector, 0);
+}
+
+static int wait_for_partitions(const Disk_Layout *layout) {
+    for (int attempt = 0; attempt < PARTITION_WAIT_ATTEMPTS; attempt++) {
+        size_t present = 0;
+        struct stat st;
+        for (size_t i = 0; i < layout->part_count; i++) {
+            if (stat(layout->parts[i].path, &st) == 0 && S_ISBLK(st.st_mode)) present++;
+        }
+        if (present == layout->part_count) return 1;
+
+        struct timespec wait = { 0, 50 * 1000000L };
+        nanosleep(&wait, NULL);
+    }
+    return 0;
+}
+
+int disk_write_table(const Disk_Layout *layout) {
+    int fd = open(layout->dev, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open %s for writing: %s", layout->dev, strerror(errno));
+        return 0;
+    }
+
+    uint64_t wipe = layout->alignment;
+    int ok = zero_range(fd, 0, wipe) &&
+             zero_range(fd, layout->size_bytes - wipe, wipe);
+    for (size_t i = 0; ok && i < layout->part_count; i++) {
+        ok = zero_range(fd, layout->parts[i].start_lba * layout->logical_sector, PART_WIPE_BYTES);
+    }
+
+    uint8_t *sector_buf = malloc(layout->logical_sector);
+    if (ok && sector_buf) {
+        ok = layout->gpt ? write_gpt(fd, layout, sector_buf) : write_mbr(fd, layout, sector_buf);
+    } else {
+        ok = 0;
+    }
+    free(sector_buf);
+
+    if (ok && fsync(fd) != 0) ok = 0;
+    if (!ok) {
+        LOG_ERROR("Failed to write partition table to %s: %s", layout->dev, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    struct stat st;
+    int is_block = fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+    if (is_block && ioctl(fd, BLKRRPART) != 0) {
+        LOG_WARN("BLKRRPART on %s failed: %s", layout->dev, strerror(errno));
+    }
+    close(fd);
+
+    LOG_INFO("Wrote %s partition table to %s", layout->gpt ? "GPT" : "MBR", layout->dev);
+
+    if (is_block && !wait_for_partitions(layout)) {
+        LOG_ERROR("Partition devices for %s did not appear", layout->dev);
+        return 0;
+    }
+    return 1;
+}
+
+int disk_discard(const Disk_Layout *layout, bool secure) {
+    int fd = open(layout->dev, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_WARN("Failed to open %s for discard: %s", layout->dev, strerror(errno));
+        return 0;
+    }
+
+    double start = monotonic_seconds();
+    long span = trace_begin("disk", secure ? "secure discard" : "discard");
+    struct stat st;
+    int ok = 0;
+    const char *method = "none";
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        ok = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, (off_t)layout->size_bytes) == 0;
+        method = "punch hole";
+    } else {
+        const char *name = strrchr(layout->dev, '/') ? strrchr(layout->dev, '/') + 1 : layout->dev;
+        char path[PATH_MAX];
+        uint64_t max_bytes = 0;
+        snprintf(path, sizeof(path), "/sys/class/block/%s/queue/discard_max_bytes", name);
+
+        if (!read_sysfs_u64(path, &max_bytes) || max_bytes == 0) {
+            LOG_INFO("%s does not support discard, skipping", layout->dev);
+        } else {
+            uint64_t range[2] = { 0, layout->size_bytes };
+            if (secure) {
+                ok = ioctl(fd, BLKSECDISCARD, range) == 0;
+                method = "BLKSECDISCARD";
+                if (!ok) LOG_WARN("BLKSECDISCARD on %s failed: %s", layout->dev, strerror(errno));
+            }
+            if (!ok) {
+                ok = ioctl(fd, BLKDISCARD, range) == 0;
+                method = "BLKDISCARD";
+            }
+        }
+    }
+
+    if (!ok && strcmp(method, "none") != 0) {
+        LOG_WARN("%s on %s failed: %s", method, layout->dev, strerror(errno));
+    }
+    trace_end(span, ok ? 0 : 1, 0);
+    close(fd);
+
+    if (ok) {
+        LOG_INFO("Discarded %s (%llu bytes) with %s in %.2fs", layout->dev,
+                 (unsigned long long)layout->size_bytes, method, monotonic_seconds() - start);
+    }
+    return ok;
+}
+
+static void mkfs_command(Cmd *cmd, const Disk_Layout *layout, const Partition *part) {
+    if (strcmp(part->fs_type, "vfat") == 0) {
+        cmd_init(cmd, "mkfs.fat");
+        cmd_arg(cmd, "-F32");
+        cmd_arg(cmd, "-i");
+        cmd_argf(cmd, "%.4s%.4s", part->fs_uuid, part->fs_uuid + 5);
+    } else if (strcmp(part->fs_type, "swap") == 0) {
+        cmd_init(cmd, "mkswap");
+        cmd_arg(cmd, "-U");
+        cmd_arg(cmd, part->fs_uuid);
+    } else if (strcmp(part->fs_type, "btrfs") == 0) {
+        cmd_init(cmd, "mkfs.btrfs");
+        cmd_arg(cmd, "-f");
+        cmd_arg(cmd, "-U");
+        cmd_arg(cmd, part->fs_uuid);
+        if (layout->discarded) cmd_arg(cmd, "-K");
+    } else if (strcmp(part->fs_type, "xfs") == 0) {
+        cmd_init(cmd, "mkfs.xfs");
+        cmd_arg(cmd, "-f");
+        cmd_arg(cmd, "-m");
+        cmd_argf(cmd, "uuid=%s", part->fs_uuid);
+        if (layout->discarded) cmd_arg(cmd, "-K");
+    } else if (strcmp(part->fs_type, "f2fs") == 0) {
+        cmd_init(cmd, "mkfs.f2fs");
+        cmd_arg(cmd, "-f");
+        cmd_arg(cmd, "-U");
+        cmd_arg(cmd, part->fs_uuid);
+        cmd_arg(cmd, "-O");
+        cmd_arg(cmd, "extra_attr,inode_checksum,sb_checksum");
+        if (layout->discarded) {
+            cmd_arg(cmd, "-t");
+            cmd_arg(cmd, "0");
+        }
+    } else {
+        cmd_init(cmd, "mkfs.ext4");
+        cmd_arg(cmd, "-F");
+        cmd_arg(cmd, "-U");
+        cmd_arg(cmd, part->fs_uuid);
+        char extended[128] = "";
+        if (layout->discarded) {
+            snprintf(extended, sizeof(extended), "nodiscard");
+        }
+        uint32_t stride = layout->optimal_io / EXT4_BLOCK_SIZE;
+        if (stride > 1) {
+            size_t len = strlen(extended);
+            snprintf(extended + len, sizeof(extended) - len, "%sstride=%u,stripe_width=%u",
+                     len ? "," : "", stride, stride);
+        }
+        if (extended[0]) {
+            cmd_arg(cmd, "-E");
+            cmd_arg(cmd, extended);
+        }
+        if (layout->profile.device_class == DEVICE_FLASH) {
+            cmd_arg(cmd, "-m");
+            cmd_arg(cmd, "1");
+        }
+    }
+    cmd_arg(cmd, part->path);
+}
+
+static void *format_worker(void *arg) {
+    Format_Job *job = arg;
+    double start = monotonic_seconds();
+
+    Cmd cmd;
+    mkfs_command(&cmd, job->layout, job->part);
+    job->ok = cmd_run(&cmd);
+    cmd_free(&cmd);
+
+    job->elapsed = monotonic_seconds() - start;
+    return NULL;
+}
+
+int format_partitions(const Disk_Layout *layout) {
+    Format_Job jobs[MAX_PARTITIONS];
+    pthread_t threads[MAX_PARTITIONS];
+    bool started[MAX_PARTITIONS];
+    double start = monotonic_seconds();
+
+    for (size_t i = 0; i < layout->part_count; i++) {
+        jobs[i].layout = layout;
+        jobs[i].part = &layout->parts[i];
+        jobs[i].ok = 0;
+        jobs[i].elapsed = 0;
+        started[i] = pthread_create(&threads[i], NULL, format_worker, &jobs[i]) == 0;
+        if (!started[i]) format_worker(&jobs[i]);
+    }
+
+    int ok = 1;
+    for (size_t i = 0; i < layout->part_count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (jobs[i].ok) {
+            LOG_INFO("Formatted %s partition %s as %s in %.2fs",
+                     jobs[i].part->name, jobs[i].part->path, jobs[i].part->fs_type, jobs[i].elapsed);
+        } else {
+            LOG_ERROR("Failed to format %s partition: %s", jobs[i].part->name, jobs[i].part->path);
+            ok = 0;
+        }
+    }
+
+    LOG_INFO("Formatted %zu partitions in %.2fs", layout->part_count, monotonic_seconds() - start);
+    return ok;
+}
+
+static int mount_root(const Disk_Layout *layout, const Partition *root_part, bool fresh) {
+    char options[256];
+    root_mount_options(layout, options, sizeof(options));
+
+    if (!root_is_btrfs(layout)) {
+        return cmd_run_args("mount", "-o", options, root_part->path, target_root(), NULL);
+    }
+
+    if (fresh) {
+        if (!cmd_run_args("mount", root_part->path, target_root(), NULL)) return 0;
+        int created = 1;
+        for (size_t i = 0; created && i < sizeof(BTRFS_SUBVOLUMES) / sizeof(BTRFS_SUBVOLUMES[0]); i++) {
+            char path[PATH_MAX];
+            target_path(path, sizeof(path), "/%s", BTRFS_SUBVOLUMES[i].name);
+            created = cmd_run_args("btrfs", "subvolume", "create", path, NULL);
+        }
+        if (!cmd_run_args("umount", target_root(), NULL) || !created) return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(BTRFS_SUBVOLUMES) / sizeof(BTRFS_SUBVOLUMES[0]); i++) {
+        char target[PATH_MAX];
+        char subvol_options[320];
+        target_path(target, sizeof(target), "%s", BTRFS_SUBVOLUMES[i].mount_point);
+        snprintf(subvol_options, sizeof(subvol_options), "%s,subvol=%s", options, BTRFS_SUBVOLUMES[i].name);
+        if (i > 0 && !create_directory(target, 0755)) return 0;
+        if (!cmd_run_args("mount", "-o", subvol_options, root_part->path, target, NULL)) return 0;
+    }
+    return 1;
+}
+
+static int partition_disk(const char *disk, Disk_Layout *layout, const Root_Fs *root_fs,
+                          const Swap_Plan *swap, bool secure_discard) {
+    int uefi = is_uefi_system();
+
+    char dev[64];
+    snprintf(dev, sizeof(dev), "/dev/%s", disk);
+
+    LOG_INFO("Starting disk partitioning: %s (mode: %s)", dev, uefi ? "UEFI" : "BIOS");
+
+    if (!disk_probe(layout, dev)) {
+        show_message("Failed to read disk geometry");
+        return 0;
+    }
+    snprintf(layout->disk, sizeof(layout->disk), "%s", disk);
+    layout->root_fs = root_fs;
+    layout->swap = *swap;
+
+    if (!disk_plan(layout, uefi)) {
+        show_message("Disk is too small");
+        return 0;
+    }
+
+    layout->discarded = disk_discard(layout, secure_discard);
+
+    if (!disk_write_table(layout)) {
+        show_message("Failed to create partitions");
+        return 0;
+    }
+    LOG_INFO("Created %zu partitions", layout->part_count);
+
+    const Partition *efi_part = disk_find_partition(layout, PART_EFI);
+    const Partition *swap_part = disk_find_partition(layout, PART_SWAP);
+    const Partition *root_part = disk_find_partition(layout, PART_ROOT);
+
+    if (!format_partitions(layout)) {
+        show_message("Failed to format partitions");
+        return 0;
+    }
+
+    if (!mount_root(layout, root_part, true)) {
+        LOG_ERROR("Failed to mount root: %s", root_part->path);
+        show_message("Failed to mount root partition");
+        return 0;
+    }
+    LOG_INFO("Mounted %s root partition", root_part->fs_type);
+
+    if (efi_part) {
+        mkdir(TARGET_PATH("/boot"), 0755);
+
+        if (!cmd_run_args("mount", efi_part->path, TARGET_PATH("/boot"), NULL)) {
+            LOG_ERROR("Failed to mount EFI: %s", efi_part->path);
+            show_message("Failed to mount EFI partition");
+            return 0;
+        }
+        LOG_INFO("Mounted EFI partition");
+    }
+
+    if (swap_part) {
+        if (!cmd_run_args("swapon", swap_part->path, NULL)) {
+            LOG_ERROR("Failed to enable swap: %s", swap_part->path);
+            show_message("Failed to enable swap");
+            return 0;
+        }
+        LOG_INFO("Enabled swap");
+    }
+    LOG_INFO("Disk partitioning completed successfully");
+    return 1;
+}
+
+static char install_status[160];
+static int install_status_row = 0;
+static int install_status_col = 0;
+
+static void set_install_status(const char *fmt, ...) {
+    pthread_mutex_lock(&ui_lock);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(install_status, sizeof(install_status), fmt, args);
+    va_end(args);
+
+    if (target_status) {
+        memcpy(target_status->status, install_status, sizeof(target_status->status));
+    }
+
+    if (install_status_row > 0) {
+        printf(ANSI_CURSOR_POS ANSI_CLEAR_LINE ANSI_WHITE "%s" ANSI_RESET,
+               install_status_row, install_status_col, install_status);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&ui_lock);
+}
+
+static pid_t zstd_spawn(const char *path, bool compress, int *pipe_fd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return -1;
+
+    char *compress_argv[] = {"zstd", "-q", "-f", "-T0", "--long=27", "-o", (char *)path, NULL};
+    char *decompress_argv[] = {"zstd", "-q", "-d", "-c", "--long=27", "--", (char *)path, NULL};
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, compress ? fds[0] : fds[1], compress ? STDIN_FILENO : STDOUT_FILENO);
+
+    pid_t pid;
+    int rc = posix_spawnp(&pid, "zstd", &actions, NULL, compress ? compress_argv : decompress_argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(compress ? fds[0] : fds[1]);
+    if (rc != 0) {
+        LOG_ERROR("Failed to start zstd: %s", strerror(rc));
+        close(compress ? fds[1] : fds[0]);
+        return -1;
+    }
+    *pipe_fd = compress ? fds[1] : fds[0];
+    return pid;
+}
+
+static int zstd_finish(pid_t pid, int pipe_fd, bool abort) {
+    close(pipe_fd);
+    if (abort) kill(pid, SIGTERM);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return 0;
+    }
+    return !abort && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int chunk_is_zero(const uint8_t *buf, size_t len) {
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+static int image_write_extent(int fd, uint32_t part, bool zero, uint64_t offset, uint64_t length, const uint8_t *data) {
+    Image_Extent extent = { .part = part, .zero = zero, .offset = offset, .length = length };
+    return write_full(fd, &extent, sizeof(extent)) && (zero || write_full(fd, data, (size_t)length));
+}
+
+static ssize_t read_chunk(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+static int image_capture_partition(int out, uint32_t index, const Partition *part, uint64_t size,
+                                   uint8_t *buf, uint64_t *data_bytes) {
+    Cmd e2image;
+    bool ext4 = strcmp(part->fs_type, "ext4") == 0;
+    int fd;
+    if (ext4) {
+        cmd_init(&e2image, "e2image");
+        cmd_arg(&e2image, "-ra");
+        cmd_arg(&e2image, part->path);
+        cmd_arg(&e2image, "-");
+        if (!cmd_spawn(&e2image)) {
+            cmd_free(&e2image);
+            return 0;
+        }
+        fd = e2image.fds[0];
+    } else {
+        fd = open(part->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LOG_ERROR("Failed to open %s: %s", part->path, strerror(errno));
+            return 0;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    uint64_t zero_start = 0;
+    uint64_t zero_len = 0;
+    int ok = 1;
+    for (uint64_t offset = 0; ok && offset < size; offset += IMAGE_CHUNK_BYTES) {
+        size_t len = size - offset < IMAGE_CHUNK_BYTES ? (size_t)(size - offset) : IMAGE_CHUNK_BYTES;
+        ssize_t n = ext4 ? read_chunk(fd, buf, len) : pread(fd, buf, len, (off_t)offset);
+        if (ext4 && n >= 0 && (size_t)n < len) {
+            memset(buf + n, 0, len - (size_t)n);
+            n = (ssize_t)len;
+        }
+        if (n != (ssize_t)len) {
+            LOG_ERROR("Short read from %s at %llu", part->path, (unsigned long long)offset);
+            ok = 0;
+            break;
+        }
+
+        if (chunk_is_zero(buf, len)) {
+            if (zero_len == 0) zero_start = offset;
+            zero_len += len;
+            continue;
+        }
+        if (zero_len > 0) {
+            ok = image_write_extent(out, index, true, zero_start, zero_len, NULL);
+            zero_len = 0;
+        }
+        ok = ok && image_write_extent(out, index, false, offset, len, buf);
+        *data_bytes += len;
+    }
+    if (ok && zero_len > 0) {
+        ok = image_write_extent(out, index, true, zero_start, zero_len, NULL);
+    }
+    close(fd);
+    if (ext4) {
+        e2image.fds[0] = -1;
+        ok = cmd_wait(&e2image) && ok;
+        cmd_free(&e2image);
+    }
+    return ok;
+}
+
+int image_capture(const Disk_Layout *layout, const char *path, const char *username, int level) {
+    Image_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.gpt = layout->gpt;
+    header.level = (uint32_t)level;
+    snprintf(header.root_fs, sizeof(header.root_fs), "%s", layout->root_fs ? layout->root_fs->name : "ext4");
+    snprintf(header.username, sizeof(header.username), "%s", username);
+    header.swap_kind = layout->swap.kind;
+    header.hibernate = layout->swap.hibernate;
+    header.swap_size = layout->swap.size_bytes;
+    header.resume_offset = layout->swap.resume_offset;
+
+    const Partition *sources[MAX_PARTITIONS];
+    for (size_t i = 0; i < layout->part_count; i++) {
+        const Partition *part = &layout->parts[i];
+        if (part->role == PART_SWAP) continue;
+        Image_Partition *entry = &header.parts[header.part_count];
+        entry->role = part->role;
+        entry->size_bytes = part->size_lba * layout->logical_sector;
+        snprintf(entry->fs_type, sizeof(entry->fs_type), "%s", part->fs_type);
+        sources[header.part_count++] = part;
+    }
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tonarchy-tmp", path);
+
+    uint8_t *buf = malloc(IMAGE_CHUNK_BYTES);
+    int out = -1;
+    pid_t zstd = buf ? zstd_spawn(tmp_path, true, &out) : -1;
+    if (zstd < 0) {
+        free(buf);
+        return 0;
+    }
+
+    LOG_INFO("Capturing golden image to %s", path);
+    double start = monotonic_seconds();
+    long span = trace_begin("image", "capture");
+    uint64_t data_bytes = 0;
+    uint64_t total_bytes = 0;
+    int ok = write_full(out, &header, sizeof(header));
+    for (uint32_t i = 0; ok && i < header.part_count; i++) {
+        ok = image_capture_partition(out, i, sources[i], header.parts[i].size_bytes, buf, &data_bytes);
+        total_bytes += header.parts[i].size_bytes;
+    }
+    ok = ok && image_write_extent(out, IMAGE_PART_END, true, 0, 0, NULL);
+    ok = zstd_finish(zstd, out, !ok) && ok;
+    free(buf);
+    trace_end(span, ok ? 0 : 1, (size_t)data_bytes);
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        LOG_ERROR("Failed to capture image to %s", path);
+        unlink(tmp_path);
+        return 0;
+    }
+
+    struct stat st;
+    LOG_INFO("Captured %llu MiB (%llu MiB in use) into %llu MiB in %.1fs",
+             (unsigned long long)(total_bytes >> 20), (unsigned long long)(data_bytes >> 20),
+             stat(path, &st) == 0 ? (unsigned long long)(st.st_size >> 20) : 0ull,
+             monotonic_seconds() - start);
+    return 1;
+}
+
+static int image_header_valid(const Image_Header *header) {
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->version != IMAGE_VERSION) {
+        LOG_ERROR("Not a tonarchy image or unsupported version");
+        return 0;
+    }
+    if (header->part_count == 0 || header->part_count > MAX_PARTITIONS ||
+        header->swap_kind > SWAP_PARTITION || !root_fs_find(header->root_fs)) {
+        LOG_ERROR("Corrupt image header");
+        return 0;
+    }
+    return 1;
+}
+
+int image_read_header(const char *path, Image_Header *header) {
+    int in = -1;
+    pid_t zstd = zstd_spawn(path, false, &in);
+    if (zstd < 0) return 0;
+
+    int ok = read_full(in, header, sizeof(*header));
+    zstd_finish(zstd, in, true);
+    if (!ok) {
+        LOG_ERROR("Failed to read image header from %s", path);
+        return 0;
+    }
+    return image_header_valid(header);
+}
+
+static int zero_partition_range(int fd, bool regular, uint64_t offset, uint64_t len) {
+    if (regular) {
+        return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len) == 0;
+    }
+    uint64_t range[2] = { offset, len };
+    return ioctl(fd, BLKZEROOUT, range) == 0 || zero_range(fd, offset, len);
+}
+
+static int image_stream(const Golden_Image *image, Disk_Layout *layout) {
+    const Image_Header *header = &image->header;
+    int fds[MAX_PARTITIONS];
+    bool regular[MAX_PARTITIONS];
+    int ok = 1;
+
+    for (uint32_t i = 0; i < header->part_count; i++) fds[i] = -1;
+    for (uint32_t i = 0; ok && i < header->part_count; i++) {
+        const Partition *part = disk_find_partition(layout, (Part_Role)header->parts[i].role);
+        if (!part || part->size_lba * layout->logical_sector < header->parts[i].size_bytes) {
+            LOG_ERROR("Target partition for image partition %u is missing or too small", i);
+            ok = 0;
+            break;
+        }
+        fds[i] = open(part->path, O_WRONLY | O_CLOEXEC);
+        struct stat st;
+        ok = fds[i] >= 0 && fstat(fds[i], &st) == 0;
+        regular[i] = ok && S_ISREG(st.st_mode);
+        if (!ok) LOG_ERROR("Failed to open %s: %s", part->path, strerror(errno));
+    }
+
+    int in = -1;
+    pid_t zstd = ok ? zstd_spawn(image->path, false, &in) : -1;
+    uint8_t *buf = malloc(IMAGE_CHUNK_BYTES);
+    Image_Header check;
+    ok = ok && zstd >= 0 && buf && read_full(in, &check, sizeof(check)) &&
+         memcmp(&check, header, sizeof(check)) == 0;
+
+    double start = monotonic_seconds();
+    double last_report = start;
+    uint64_t written = 0;
+    bool finished = false;
+    while (ok && !finished) {
+        Image_Extent extent;
+        if (!read_full(in, &extent, sizeof(extent))) {
+            LOG_ERROR("Image %s is truncated", image->path);
+            ok = 0;
+            break;
+        }
+        if (extent.part == IMAGE_PART_END) {
+            finished = true;
+            break;
+        }
+        if (extent.part >= header->part_count ||
+            extent.offset + extent.length > header->parts[extent.part].size_bytes ||
+            (!extent.zero && extent.length > IMAGE_CHUNK_BYTES)) {
+            LOG_ERROR("Corrupt extent in image %s", image->path);
+            ok = 0;
+            break;
+        }
+
+        if (extent.zero) {
+            ok = zero_partition_range(fds[extent.part], regular[extent.part], extent.offset, extent.length);
+        } else {
+            ok = read_full(in, buf, (size_t)extent.length) &&
+                 pwrite_all(fds[extent.part], buf, (size_t)extent.length, extent.offset);
+            written += extent.length;
+        }
+
+        double now = monotonic_seconds();
+        if (now - last_report >= IMAGE_PROGRESS_INTERVAL_MS / 1000.0) {
+            set_install_status("Writing image: %llu MiB (%.0f MiB/s)", (unsigned long long)(written >> 20),
+                               (double)written / (1024 * 1024) / (now - start));
+            last_report = now;
+        }
+    }
+    set_install_status("");
+
+    if (zstd >= 0) ok = zstd_finish(zstd, in, !ok) && ok;
+    for (uint32_t i = 0; i < header->part_count; i++) {
+        if (fds[i] < 0) continue;
+        if (fsync(fds[i]) != 0 && !regular[i]) ok = 0;
+        close(fds[i]);
+    }
+    free(buf);
+
+    if (ok) {
+        LOG_INFO("Wrote %llu MiB of image data in %.1fs", (unsigned long long)(written >> 20),
+                 monotonic_seconds() - start);
+    }
+    return ok;
+}
+
+static int set_fat_volume_id(const Partition *part) {
+    unsigned int hi, lo;
+    if (sscanf(part->fs_uuid, "%4x-%4x", &hi, &lo) != 2) return 0;
+
+    int fd = open(part->path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    uint8_t sector[512];
+    int ok = pread(fd, sector, sizeof(sector), 0) == (ssize_t)sizeof(sector) &&
+             memcmp(sector + 82, "FAT32   ", 8) == 0;
+    if (ok) {
+        uint8_t id[4];
+        put_le32(id, (hi << 16) | lo);
+        uint32_t bytes_per_sector = sector[11] | (sector[12] << 8);
+        uint32_t backup = sector[50] | (sector[51] << 8);
+        ok = pwrite_all(fd, id, sizeof(id), 67);
+        if (ok && backup != 0 && backup != 0xFFFF) {
+            ok = pwrite_all(fd, id, sizeof(id), (uint64_t)backup * bytes_per_sector + 67);
+        }
+    }
+    ok = fsync(fd) == 0 && ok;
+    close(fd);
+    return ok;
+}
+
+static int read_fs_uuid(Partition *part) {
+    Cmd cmd;
+    cmd_init(&cmd, "blkid");
+    cmd_arg(&cmd, "-s");
+    cmd_arg(&cmd, "UUID");
+    cmd_arg(&cmd, "-o");
+    cmd_arg(&cmd, "value");
+    cmd_arg(&cmd, part->path);
+    cmd.capture = true;
+    int ok = cmd_run(&cmd) && cmd.output;
+    if (ok) {
+        cmd.output[strcspn(cmd.output, "\n")] = '\0';
+        snprintf(part->fs_uuid, sizeof(part->fs_uuid), "%s", cmd.output);
+    }
+    cmd_free(&cmd);
+    return ok && part->fs_uuid[0];
+}
+
+static int prepare_root_fs(Partition *part, bool grow) {
+    if (strcmp(part->fs_type, "ext4") == 0) {
+        Cmd fsck;
+        cmd_init(&fsck, "e2fsck");
+        cmd_arg(&fsck, "-fp");
+        cmd_arg(&fsck, part->path);
+        cmd_run(&fsck);
+        int checked = fsck.status == 0 || fsck.status == 1;
+        cmd_free(&fsck);
+        return checked &&
+               cmd_run_args("tune2fs", "-U", part->fs_uuid, part->path, NULL) &&
+               (!grow || cmd_run_args("resize2fs", part->path, NULL));
+    }
+    if (strcmp(part->fs_type, "xfs") == 0) {
+        return cmd_run_args("xfs_admin", "-U", part->fs_uuid, part->path, NULL);
+    }
+    if (strcmp(part->fs_type, "btrfs") == 0) {
+        return cmd_run_args("btrfstune", "-f", "-M", part->fs_uuid, part->path, NULL);
+    }
+    if (grow && !cmd_run_args("resize.f2fs", part->path, NULL)) return 0;
+    LOG_WARN("f2fs UUID cannot be changed, keeping the captured one");
+    return read_fs_uuid(part);
+}
+
+static int grow_mounted_root(const Partition *part) {
+    if (strcmp(part->fs_type, "xfs") == 0) {
+        return cmd_run_args("xfs_growfs", target_root(), NULL);
+    }
+    if (strcmp(part->fs_type, "btrfs") == 0) {
+        return cmd_run_args("btrfs", "filesystem", "resize", "max", target_root(), NULL);
+    }
+    return 1;
+}
+
+int image_deploy(const Golden_Image *image, Disk_Layout *layout) {
+    const Image_Header *header = &image->header;
+    Partition *root_part = (Partition *)disk_find_partition(layout, PART_ROOT);
+    const Partition *efi_part = disk_find_partition(layout, PART_EFI);
+    const Partition *swap_part = disk_find_partition(layout, PART_SWAP);
+
+    long span = trace_begin("image", "deploy");
+    int ok = image_stream(image, layout);
+    trace_end(span, ok ? 0 : 1, 0);
+    if (!ok) return 0;
+
+    uint64_t captured_root = 0;
+    for (uint32_t i = 0; i < header->part_count; i++) {
+        if (header->parts[i].role == PART_ROOT) captured_root = header->parts[i].size_bytes;
+    }
+    bool grow = root_part->size_lba * layout->logical_sector > captured_root;
+
+    if (efi_part && !set_fat_volume_id(efi_part)) {
+        LOG_ERROR("Failed to set EFI volume ID on %s", efi_part->path);
+        return 0;
+    }
+    if (!prepare_root_fs(root_part, grow)) {
+        LOG_ERROR("Failed to personalise root filesystem on %s", root_part->path);
+        return 0;
+    }
+    if (swap_part) {
+        Cmd cmd;
+        mkfs_command(&cmd, layout, swap_part);
+        int formatted = cmd_run(&cmd);
+        cmd_free(&cmd);
+        if (!formatted) return 0;
+    }
+
+    if (!mount_root(layout, root_part, false)) {
+        LOG_ERROR("Failed to mount deployed root: %s", root_part->path);
+        return 0;
+    }
+    if (grow && !grow_mounted_root(root_part)) {
+        LOG_WARN("Failed to grow %s root filesystem", root_part->fs_type);
+    }
+    if (efi_part) {
+        mkdir(TARGET_PATH("/boot"), 0755);
+        if (!cmd_run_args("mount", efi_part->path, TARGET_PATH("/boot"), NULL)) {
+            LOG_ERROR("Failed to mount EFI: %s", efi_part->path);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint64_t directory_bytes(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+
+    uint64_t total = 0;
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL) {
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+            total += (uint64_t)st.st_size;
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+static uint64_t filesystem_used_bytes(const char *path) {
+    struct statvfs vfs;
+    if (statvfs(path, &vfs) != 0) return 0;
+    return (uint64_t)(vfs.f_blocks - vfs.f_bfree) * vfs.f_frsize;
+}
+
+static double parse_size_mib(const char *text) {
+    double value;
+    char unit[8] = "";
+    if (sscanf(text, "%lf %7s", &value, unit) < 1) return 0;
+    if (strcmp(unit, "KiB") == 0) return value / 1024.0;
+    if (strcmp(unit, "GiB") == 0) return value * 1024.0;
+    if (strcmp(unit, "B") == 0) return value / (1024.0 * 1024.0);
+    return value;
+}
+
+static void pacstrap_progress_line(void *user, int stream, const char *line) {
+    Pacstrap_Progress *progress = user;
+    (void)stream;
+
+    while (*line == ' ') line++;
+    if (line[0] == '(') {
+        const char *rest = strchr(line, ')');
+        if (rest) line = rest + 1;
+        while (*line == ' ') line++;
+    }
+
+    double now = monotonic_seconds();
+    int count;
+    const char *colon = strchr(line, ':');
+
+    pthread_mutex_lock(&progress->lock);
+    if (sscanf(line, "Packages (%d)", &count) == 1) {
+        progress->total = count;
+    } else if (strncmp(line, "Total Download Size:", 20) == 0 && colon) {
+        progress->download_total_mib = parse_size_mib(colon + 1);
+    } else if (strncmp(line, "Total Installed Size:", 21) == 0 && colon) {
+        progress->install_total_mib = parse_size_mib(colon + 1);
+    } else if (strstr(line, "downloading")) {
+        if (progress->download_start == 0) progress->download_start = now;
+        progress->downloaded++;
+    } else if (strncmp(line, "installing ", 11) == 0) {
+        if (progress->install_start == 0) {
+            progress->install_start = now;
+            progress->download_end = progress->download_start ? now : 0;
+            progress->phase_base = filesystem_used_bytes(target_root());
+            progress->phase_bytes = 0;
+            progress->rate = 0;
+        }
+        progress->installed++;
+    }
+    pthread_mutex_unlock(&progress->lock);
+}
+
+static void format_eta(char *out, size_t size, double seconds) {
+    if (seconds <= 0 || seconds > 359999) {
+        snprintf(out, size, "--:--");
+    } else {
+        int s = (int)seconds;
+        snprintf(out, size, "%d:%02d", s / 60, s % 60);
+    }
+}
+
+static void *pacstrap_progress_main(void *arg) {
+    Pacstrap_Progress *progress = arg;
+    double last = monotonic_seconds();
+
+    pthread_mutex_lock(&progress->lock);
+    while (!progress->done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PACSTRAP_PROGRESS_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&progress->cond, &progress->lock, &deadline);
+        if (progress->done) break;
+
+        bool installing = progress->install_start != 0;
+        pthread_mutex_unlock(&progress->lock);
+
+        uint64_t bytes = installing
+            ? filesystem_used_bytes(target_root())
+            : directory_bytes(progress->cache_dir);
+        double now = monotonic_seconds();
+
+        pthread_mutex_lock(&progress->lock);
+        if (installing != (progress->install_start != 0)) continue;
+
+        uint64_t phase_bytes = bytes > progress->phase_base ? bytes - progress->phase_base : 0;
+        double dt = now - last;
+        if (dt > 0 && phase_bytes >= progress->phase_bytes) {
+            double sample = (double)(phase_bytes - progress->phase_bytes) / (1024.0 * 1024.0) / dt;
+            progress->rate = progress->rate == 0 ? sample : progress->rate * 0.7 + sample * 0.3;
+        }
+        progress->phase_bytes = phase_bytes;
+        last = now;
+
+        double done_mib = (double)phase_bytes / (1024.0 * 1024.0);
+        double total_mib = installing ? progress->install_total_mib : progress->download_total_mib;
+        double remaining = 0;
+        if (progress->rate > 0.01 && total_mib > done_mib) {
+            remaining = (total_mib - done_mib) / progress->rate;
+        } else if (installing && progress->installed > 0) {
+            remaining = (now - progress->install_start) * (progress->total - progress->installed) / progress->installed;
+        }
+        char eta[16];
+        format_eta(eta, sizeof(eta), remaining);
+
+        if (installing) {
+            set_install_status("Installing %d/%d packages  %.1f MB/s  ETA %s",
+                               progress->installed, progress->total, progress->rate, eta);
+        } else {
+            set_install_status("Downloading %d/%d packages  %.1f/%.1f MiB  %.1f MB/s  ETA %s",
+                               progress->downloaded, progress->total, done_mib, total_mib, progress->rate, eta);
+        }
+    }
+    pthread_mutex_unlock(&progress->lock);
+
+    return NULL;
+}
+
+static void log_pacstrap_throughput(const Pacstrap_Progress *progress, double end) {
+    if (progress->download_start != 0) {
+        double download_end = progress->download_end ? progress->download_end : end;
+        double seconds = download_end - progress->download_start;
+        LOG_INFO("Download: %d packages, %.1f MiB in %.1fs (%.2f MiB/s)",
+                 progress->downloaded, progress->download_total_mib, seconds,
+                 seconds > 0 ? progress->download_total_mib / seconds : 0);
+    }
+    if (progress->install_start != 0) {
+        double seconds = end - progress->install_start;
+        LOG_INFO("Extraction: %d packages, %.1f MiB in %.1fs (%.2f MiB/s)",
+                 progress->installed, progress->install_total_mib, seconds,
+                 seconds > 0 ? progress->install_total_mib / seconds : 0);
+    }
+}
+
+static int install_packages_impl(const char *package_list, int use_host_cache) {
+    LOG_INFO("Starting package installation");
+    LOG_INFO("Packages: %s", package_list);
+
+    Cmd cmd;
+    cmd_init(&cmd, "pacstrap");
+    if (offline_pacman_conf) {
+        cmd_arg(&cmd, "-C");
+        cmd_arg(&cmd, offline_pacman_conf);
+        use_host_cache = 1;
+    }
+    if (use_host_cache) {
+        cmd_arg(&cmd, "-c");
+    }
+    if (!seed_target_keyring()) {
+        LOG_WARN("Falling back to a fresh keyring in %s", target_root());
+        cmd_arg(&cmd, "-K");
+    }
+    cmd_arg(&cmd, target_root());
+    cmd_args_split(&cmd, package_list);
+
+    Pacstrap_Progress progress;
+    memset(&progress, 0, sizeof(progress));
+    pthread_mutex_init(&progress.lock, NULL);
+    pthread_cond_init(&progress.cond, NULL);
+    progress.cache_dir = offline_pacman_conf ? OFFLINE_REPO_DIR
+        : use_host_cache ? PACMAN_CACHE_DIR : TARGET_PATH("%s", PACMAN_CACHE_DIR);
+    progress.phase_base = directory_bytes(progress.cache_dir);
+    cmd.on_line = pacstrap_progress_line;
+    cmd.user = &progress;
+
+    pthread_t sampler;
+    int sampling = pthread_create(&sampler, NULL, pacstrap_progress_main, &progress) == 0;
+
+    int result = cmd_run(&cmd);
+    int status = cmd.status;
+    cmd_free(&cmd);
+
+    pthread_mutex_lock(&progress.lock);
+    progress.done = true;
+    pthread_cond_signal(&progress.cond);
+    pthread_mutex_unlock(&progress.lock);
+    if (sampling) pthread_join(sampler, NULL);
+
+    log_pacstrap_throughput(&progress, monotonic_seconds());
+    set_install_status("");
+    pthread_cond_destroy(&progress.cond);
+    pthread_mutex_destroy(&progress.lock);
+
+    if (!result) {
+        LOG_ERROR("pacstrap failed with exit code %d", status);
+        show_message("Failed to install packages");
+        return 0;
+    }
+
+    if (offline_pacman_conf) {
+        unlink(TARGET_PATH("/var/lib/pacman/sync/%s.db", OFFLINE_REPO_NAME));
+    }
+
+    if (!install_ranked_mirrorlist()) {
+        LOG_WARN("Failed to carry ranked mirrorlist into %s", target_root());
+    }
+
+    LOG_INFO("Package installation completed successfully");
+    return 1;
+}
+
+static int configure_fstab(const Disk_Layout *layout) {
+    LOG_INFO("Generating fstab");
+
+    char options[256];
+    root_mount_options(layout, options, sizeof(options));
+
+    char *fstab = NULL;
+    size_t fstab_len = 0;
+    FILE *fp = open_memstream(&fstab, &fstab_len);
+    CHECK_OR_FAIL(fp, "Failed to generate fstab - out of memory");
+
+    fprintf(fp, "# Static information about the filesystems.\n"
+                "# See fstab(5) for details.\n\n"
+                "# <file system> <dir> <type> <options> <dump> <pass>\n");
+    for (size_t i = 0; i < layout->part_count; i++) {
+        const Partition *part = &layout->parts[i];
+        switch (part->role) {
+        case PART_ROOT:
+            if (root_is_btrfs(layout)) {
+                for (size_t v = 0; v < sizeof(BTRFS_SUBVOLUMES) / sizeof(BTRFS_SUBVOLUMES[0]); v++) {
+                    fprintf(fp, "# %s\nUUID=%s\t%s\tbtrfs\trw,%s,subvol=/%s\t0 0\n\n",
+                            part->path, part->fs_uuid, BTRFS_SUBVOLUMES[v].mount_point,
+                            options, BTRFS_SUBVOLUMES[v].name);
+                }
+            } else {
+                fprintf(fp, "# %s\nUUID=%s\t/\t%s\trw,%s\t0 %d\n\n",
+                        part->path, part->fs_uuid, part->fs_type, options,
+                        strcmp(part->fs_type, "ext4") == 0 ? 1 : 0);
+            }
+            break;
+        case PART_EFI:
+            fprintf(fp, "# %s\nUUID=%s\t/boot\tvfat\trw,relatime,fmask=0022,dmask=0022,codepage=437,"
+                        "iocharset=ascii,shortname=mixed,utf8,errors=remount-ro\t0 2\n\n",
+                    part->path, part->fs_uuid);
+            break;
+        case PART_SWAP:
+            fprintf(fp, "# %s\nUUID=%s\tnone\tswap\tdefaults\t0 0\n\n", part->path, part->fs_uuid);
+            break;
+        }
+    }
+    if (layout->swap.kind == SWAP_FILE) {
+        fprintf(fp, "%s\tnone\tswap\tdefaults\t0 0\n\n", SWAPFILE_PATH);
+    }
+    int generated = !ferror(fp);
+    generated = fclose(fp) == 0 && generated && write_file(TARGET_PATH("/etc/fstab"), fstab);
+    free(fstab);
+
+    CHECK_OR_FAIL(
+        generated,
+        "Failed to generate fstab - check /tmp/tonarchy-install.log"
+    );
+
+    return 1;
+}
+
+static int configure_locale(const char *keyboard, const char *timezone) {
+    LOG_INFO("Configuring locale - Timezone: %s, Keyboard: %s", timezone, keyboard);
+
+    CHECK_OR_FAIL(
+        chroot_exec_fmt("ln -sf /usr/share/zoneinfo/%s /etc/localtime", timezone),
+        "Failed to configure timezone"
+    );
+
+    if (!chroot_exec("hwclock --systohc")) {
+        LOG_WARN("Failed to set hardware clock");
+    }
+
+    CHECK_OR_FAIL(
+        write_file(TARGET_PATH("/etc/locale.gen"), "en_US.UTF-8 UTF-8\n"),
+        "Failed to write locale.gen"
+    );
+
+    CHECK_OR_FAIL(
+        chroot_exec("locale-gen"),
+        "Failed to generate locales"
+    );
+
+    CHECK_OR_FAIL(
+        write_file(TARGET_PATH("/etc/locale.conf"), "LANG=en_US.UTF-8\n"),
+        "Failed to write locale.conf"
+    );
+
+    CHECK_OR_FAIL(
+        write_file_fmt(TARGET_PATH("/etc/vconsole.conf"), "KEYMAP=%s\n", keyboard),
+        "Failed to write vconsole.conf"
+    );
+
+    return 1;
+}
+
+static int configure_hostname(const char *hostname) {
+    LOG_INFO("Configuring hostname: %s", hostname);
+
+    CHECK_OR_FAIL(
+        write_file_fmt(TARGET_PATH("/etc/hostname"), "%s\n", hostname),
+        "Failed to write hostname"
+    );
+
+    char hosts_content[512];
+    snprintf(hosts_content, sizeof(hosts_content),
+             "127.0.0.1   localhost\n"
+             "::1         localhost\n"
+             "127.0.1.1   %s.localdomain %s\n",
+             hostname, hostname);
+
+    CHECK_OR_FAIL(
+        write_file(TARGET_PATH("/etc/hosts"), hosts_content),
+        "Failed to write hosts file"
+    );
+
+    return 1;
+}
+
+static int set_passwords(const char *username, const char *password, bool hashed) {
+    char *credentials = format_alloc("%s:%s\nroot:%s\n", username, password, password);
+    CHECK_OR_FAIL(credentials != NULL, "Failed to set passwords");
+
+    Cmd chpasswd;
+    cmd_init(&chpasswd, "chpasswd");
+    if (hashed) {
+        cmd_arg(&chpasswd, "-e");
+    }
+    chpasswd.input = credentials;
+    int chpasswd_ok = chroot_run(&chpasswd);
+    cmd_free(&chpasswd);
+    free(credentials);
+    CHECK_OR_FAIL(
+        chpasswd_ok,
+        "Failed to set passwords"
+    );
+
+    return 1;
+}
+
+static int configure_users(const char *username, const char *password, bool hashed) {
+    LOG_INFO("Creating user: %s", username);
+
+    CHECK_OR_FAIL(
+        chroot_exec_fmt("useradd -m -G wheel -s /bin/bash %s", username),
+        "Failed to create user"
+    );
+
+    if (!set_passwords(username, password, hashed)) {
+        return 0;
+    }
+
+    create_directory(TARGET_PATH("/etc/sudoers.d"), 0750);
+    CHECK_OR_FAIL(
+        write_file(TARGET_PATH("/etc/sudoers.d/wheel"), "%wheel ALL=(ALL:ALL) ALL\n"),
+        "Failed to configure sudo"
+    );
+    chmod(TARGET_PATH("/etc/sudoers.d/wheel"), 0440);
+
+    return 1;
+}
+
+static int configure_services(int use_dm) {
+    CHECK_OR_FAIL(
+        chroot_exec("systemctl enable NetworkManager"),
+        "Failed to enable NetworkManager"
+    );
+
+    CHECK_OR_FAIL(
+        chroot_exec("systemctl enable dbus"),
+        "Failed to enable dbus"
+    );
+
+    if (use_dm) {
+        CHECK_OR_FAIL(
+            chroot_exec("systemctl enable lightdm"),
+            "Failed to enable display manager"
+        );
+    }
+
+    return 1;
+}
+
+static const char *IO_SCHEDULER_RULES =
+    "ACTION==\"add|change\", KERNEL==\"sd[a-z]*|mmcblk[0-9]*\", ATTR{queue/rotational}==\"1\", ATTR{queue/scheduler}=\"bfq\"\n"
+    "ACTION==\"add|change\", KERNEL==\"sd[a-z]*|mmcblk[0-9]*\", ATTR{queue/rotational}==\"0\", ATTR{queue/scheduler}=\"mq-deadline\"\n"
+    "ACTION==\"add|change\", KERNEL==\"nvme[0-9]*n[0-9]*\", ATTR{queue/scheduler}=\"none\"\n";
+
+static const char *ZRAM_SYSCTL =
+    "vm.swappiness = 180\n"
+    "vm.watermark_boost_factor = 0\n"
+    "vm.watermark_scale_factor = 125\n"
+    "vm.page-cluster = 0\n";
+
+static const char *RESUME_HOOK_CONF =
+    "tonarchy_resume_re=' (resume|systemd) '\n"
+    "for i in \"${!HOOKS[@]}\"; do\n"
+    "    if [[ ${HOOKS[i]} == filesystems && ! \" ${HOOKS[*]} \" =~ $tonarchy_resume_re ]]; then\n"
+    "        HOOKS=(\"${HOOKS[@]:0:i+1}\" resume \"${HOOKS[@]:i+1}\")\n"
+    "        break\n"
+    "    fi\n"
+    "done\n"
+    "unset tonarchy_resume_re\n";
+
+static int swapfile_resume_offset(const char *path, uint64_t *offset) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_flags = FIEMAP_FLAG_SYNC;
+    request.map.fm_extent_count = 1;
+
+    int ok = ioctl(fd, FS_IOC_FIEMAP, &request) == 0 && request.map.fm_mapped_extents == 1;
+    close(fd);
+    if (ok) *offset = request.extent.fe_physical / (uint64_t)sysconf(_SC_PAGESIZE);
+    return ok;
+}
+
+static int configure_swap(Disk_Layout *layout) {
+    Swap_Plan *swap = &layout->swap;
+
+    switch (swap->kind) {
+    case SWAP_ZRAM:
+        CHECK_OR_FAIL(
+            create_directory(TARGET_PATH("/etc/systemd"), 0755) &&
+            write_file_fmt(TARGET_PATH("/etc/systemd/zram-generator.conf"),
+                           "[zram0]\nzram-size = min(ram, %llu)\ncompression-algorithm = zstd\n",
+                           (unsigned long long)(ZRAM_MAX_SIZE / (1024 * 1024))),
+            "Failed to configure zram"
+        );
+        CHECK_OR_FAIL(
+            create_directory(TARGET_PATH("/etc/sysctl.d"), 0755) &&
+            write_file(TARGET_PATH("/etc/sysctl.d/99-vm-zram-parameters.conf"), ZRAM_SYSCTL),
+            "Failed to configure zram"
+        );
+        break;
+
+    case SWAP_FILE: {
+        CHECK_OR_FAIL(
+            create_directory(TARGET_PATH("/swap"), 0700),
+            "Failed to create swap directory"
+        );
+
+        Cmd cmd;
+        cmd_init(&cmd, "mkswap");
+        cmd_arg(&cmd, "--size");
+        cmd_argf(&cmd, "%lluM", (unsigned long long)(swap->size_bytes / (1024 * 1024)));
+        cmd_arg(&cmd, "--file");
+        cmd_arg(&cmd, TARGET_PATH("%s", SWAPFILE_PATH));
+        int created = cmd_run(&cmd);
+        cmd_free(&cmd);
+        CHECK_OR_FAIL(created, "Failed to create swap file");
+
+        if (swap->hibernate) {
+            CHECK_OR_FAIL(
+                swapfile_resume_offset(TARGET_PATH("%s", SWAPFILE_PATH), &swap->resume_offset),
+                "Failed to locate swap file for hibernation"
+            );
+            LOG_INFO("Swap file resume offset: %llu", (unsigned long long)swap->resume_offset);
+        }
+        break;
+    }
+
+    case SWAP_PARTITION:
+        break;
+    }
+
+    if (swap->hibernate) {
+        CHECK_OR_FAIL(
+            create_directory(TARGET_PATH("/etc/mkinitcpio.conf.d"), 0755) &&
+            write_file(TARGET_PATH("/etc/mkinitcpio.conf.d/tonarchy-resume.conf"), RESUME_HOOK_CONF),
+            "Failed to configure resume hook"
+        );
+    }
+
+    LOG_INFO("Configured %s swap (%s)", SWAP_KIND_NAMES[swap->kind], swap->reason);
+    return 1;
+}
+
+static void kernel_resume_cmdline(const Disk_Layout *layout, char *out, size_t size) {
+    const Partition *root_part = disk_find_partition(layout, PART_ROOT);
+    const Partition *swap_part = disk_find_partition(layout, PART_SWAP);
+
+    out[0] = '\0';
+    if (layout->swap.hibernate && layout->swap.kind == SWAP_PARTITION && swap_part) {
+        snprintf(out, size, " resume=UUID=%s", swap_part->fs_uuid);
+    } else if (layout->swap.hibernate && layout->swap.kind == SWAP_FILE && root_part) {
+        snprintf(out, size, " resume=UUID=%s resume_offset=%llu",
+                 root_part->fs_uuid, (unsigned long long)layout->swap.resume_offset);
+    }
+}
+
+static void kernel_cmdline_extra(const Disk_Layout *layout, char *out, size_t size) {
+    char resume[160];
+    kernel_resume_cmdline(layout, resume, sizeof(resume));
+    snprintf(out, size, "%s%s", root_is_btrfs(layout) ? " rootflags=subvol=@" : "", resume);
+}
+
+static int grub_add_cmdline(const char *extra) {
+    const char *path = TARGET_PATH("/etc/default/grub");
+    const char *key = "GRUB_CMDLINE_LINUX=";
+    char *grub = read_file(path);
+    if (!grub) return 0;
+
+    char *content = NULL;
+    size_t content_len = 0;
+    FILE *fp = open_memstream(&content, &content_len);
+    if (!fp) {
+        free(grub);
+        return 0;
+    }
+
+    bool replaced = false;
+    for (char *line = grub, *next; line && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        if (strncmp(line, key, strlen(key)) != 0) {
+            fprintf(fp, "%s\n", line);
+            continue;
+        }
+        if (replaced) continue;
+        replaced = true;
+
+        char value[1024];
+        snprintf(value, sizeof(value), "%s", line + strlen(key) + (line[strlen(key)] == '"'));
+        char *quote = strrchr(value, '"');
+        if (quote) *quote = '\0';
+        if (strstr(value, extra + strspn(extra, " "))) {
+            fprintf(fp, "%s\n", line);
+        } else {
+            fprintf(fp, "%s\"%s%s\"\n", key, value, value[0] ? extra : extra + strspn(extra, " "));
+        }
+    }
+    if (!replaced) {
+        fprintf(fp, "%s\"%s\"\n", key, extra + strspn(extra, " "));
+    }
+
+    int built = !ferror(fp);
+    built = fclose(fp) == 0 && built;
+    int written = built && write_file(path, content);
+    free(content);
+    free(grub);
+    return written;
+}
+
+static int configure_storage(Disk_Layout *layout) {
+    const Device_Profile *profile = &layout->profile;
+
+    if (!configure_swap(layout)) {
+        return 0;
+    }
+
+    LOG_INFO("Applying %s storage profile to target", DEVICE_CLASS_NAMES[profile->device_class]);
+
+    CHECK_OR_FAIL(
+        create_directory(TARGET_PATH("/etc/udev/rules.d"), 0755),
+        "Failed to create udev rules directory"
+    );
+
+    CHECK_OR_FAIL(
+        write_file_fmt(TARGET_PATH("/etc/udev/rules.d/60-ioschedulers.rules"),
+            "# Installed by tonarchy for %s (%s over %s)\n%s",
+            layout->dev, DEVICE_CLASS_NAMES[profile->device_class], profile->transport,
+            IO_SCHEDULER_RULES),
+        "Failed to write I/O scheduler rule"
+    );
+
+    if (layout->root_fs && layout->root_fs->module) {
+        CHECK_OR_FAIL(
+            create_directory(TARGET_PATH("/etc/mkinitcpio.conf.d"), 0755),
+            "Failed to create mkinitcpio.conf.d"
+        );
+
+        CHECK_OR_FAIL(
+            write_file_fmt(TARGET_PATH("/etc/mkinitcpio.conf.d/tonarchy-rootfs.conf"),
+                           "MODULES+=(%s)\n", layout->root_fs->module),
+            "Failed to configure initramfs"
+        );
+    }
+
+    if ((layout->root_fs && layout->root_fs->module) || layout->swap.hibernate) {
+        CHECK_OR_FAIL(
+            chroot_run_args("mkinitcpio", "-P", NULL),
+            "Failed to rebuild initramfs"
+        );
+    }
+
+    if (profile->fstrim_timer && !root_uses_async_discard(layout)) {
+        CHECK_OR_FAIL(
+            chroot_run_args("systemctl", "enable", "fstrim.timer", NULL),
+            "Failed to enable fstrim.timer"
+        );
+    }
+
+    return 1;
+}
+
+static int install_bootloader(const char *disk, const Disk_Layout *layout, bool portable) {
+    int uefi = is_uefi_system();
+
+    if (uefi) {
+        LOG_INFO("Installing systemd-boot");
+
+        int installed = portable
+            ? chroot_run_args("bootctl", "install", "--no-variables", NULL)
+            : chroot_run_args("bootctl", "install", NULL);
+        if (!installed) {
+            LOG_ERROR("bootctl install failed");
+            show_message("Failed to install bootloader");
+            return 0;
+        }
+
+        const Partition *root_part = disk_find_partition(layout, PART_ROOT);
+        if (!root_part) {
+            show_message("Failed to get root partition UUID");
+            return 0;
+        }
+        LOG_INFO("Root partition UUID: %s", root_part->fs_uuid);
+
+        char extra[256];
+        kernel_cmdline_extra(layout, extra, sizeof(extra));
+
+        LOG_INFO("Creating loader.conf");
+        if (!write_file(TARGET_PATH("/boot/loader/loader.conf"),
+            "default arch.conf\n"
+            "timeout 3\n"
+            "console-mode max\n"
+            "editor no\n")) {
+            LOG_ERROR("Failed to write loader.conf");
+            show_message("Failed to create loader config");
+            return 0;
+        }
+
+        if (!create_directory(TARGET_PATH("/boot/loader/entries"), 0755)) {
+            LOG_ERROR("Failed to create boot entries directory");
+            return 0;
+        }
+
+        char boot_entry[512];
+        snprintf(boot_entry, sizeof(boot_entry),
+            "title   Tonarchy\n"
+            "linux   /vmlinuz-linux\n"
+            "initrd  /initramfs-linux.img\n"
+            "options root=UUID=%s rw%s\n",
+            root_part->fs_uuid, extra);
+
+        LOG_INFO("Creating boot entry");
+        if (!write_file(TARGET_PATH("/boot/loader/entries/arch.conf"), boot_entry)) {
+            LOG_ERROR("Failed to write boot entry");
+            show_message("Failed to create boot entry");
+            return 0;
+        }
+
+        struct stat st;
+        if (stat(TARGET_PATH("/boot/loader/entries/arch.conf"), &st) != 0) {
+            LOG_ERROR("Boot entry file missing after creation");
+            show_message("Boot entry verification failed");
+            return 0;
+        }
+
+        LOG_INFO("systemd-boot installation completed");
+    } else {
+        LOG_INFO("Installing GRUB");
+
+        if (!chroot_run_args("pacman", "-S", "--needed", "--noconfirm", "grub", NULL)) {
+            show_message("Failed to install GRUB package");
+            return 0;
+        }
+
+        char dev[64];
+        snprintf(dev, sizeof(dev), "/dev/%s", disk);
+        if (!chroot_run_args("grub-install", "--target=i386-pc", dev, NULL)) {
+            show_message("Failed to install GRUB");
+            return 0;
+        }
+
+        char resume[160];
+        kernel_resume_cmdline(layout, resume, sizeof(resume));
+        if (resume[0]) {
+            CHECK_OR_FAIL(
+                grub_add_cmdline(resume),
+                "Failed to configure GRUB for hibernation"
+            );
+        }
 
-            if (strlen(temp_input) == 0) {
-                if (f->default_val) {
-                    strcpy(f->dest, f->default_val);
-                    current_field++;
-                }
-            } else if (validate_alphanumeric(temp_input)) {
-                strcpy(f->dest, temp_input);
-                current_field++;
-            } else {
-                show_message(f->error_msg);
-            }
+        if (!chroot_run_args("grub-mkconfig", "-o", "/boot/grub/grub.cfg", NULL)) {
+            show_message("Failed to generate GRUB config");
+            return 0;
         }
     }
 
-    while (1) {
-        draw_form(username, password, confirmed_password, hostname, keyboard, timezone, 6);
+    return 1;
+}
 
-        get_terminal_size(&rows, &cols);
-        logo_start = (cols - 70) / 2;
+static int setup_common_configs(const char *username) {
+    char src[PATH_MAX];
+    char dest[PATH_MAX];
+    uid_t uid;
+    gid_t gid;
 
-        printf(ANSI_CURSOR_POS ANSI_YELLOW "Press Enter to continue, or field number to edit (0-5)" ANSI_RESET, 20, logo_start);
-        fflush(stdout);
+    if (!lookup_target_user(username, &uid, &gid)) {
+        return 0;
+    }
 
-        enable_raw_mode();
-        char c;
-        if (read(STDIN_FILENO, &c, 1) == 1) {
-            if (c == '\r' || c == '\n') {
-                disable_raw_mode();
-                return 1;
-            }
-            if (c == 'q' || c == 27) {
-                disable_raw_mode();
-                return 0;
-            }
-            if (c >= '0' && c <= '5') {
-                disable_raw_mode();
-                int edit_field = c - '0';
-                Form_Field *f = &fields[edit_field];
+    create_directory(TARGET_PATH("/usr/share/wallpapers"), 0755);
+    create_directory(TARGET_PATH("/usr/share/tonarchy"), 0755);
+    create_directory(TARGET_PATH("/usr/share/themes"), 0755);
+    create_directory(TARGET_PATH("/usr/lib/firefox/distribution"), 0755);
+
+    Copy_Tree system_assets;
+    copy_tree_init(&system_assets, 0, 0);
+    copy_tree_add(&system_assets, "/usr/share/wallpapers/wall1.jpg", TARGET_PATH("/usr/share/wallpapers/wall1.jpg"));
+    copy_tree_add(&system_assets, "/usr/share/tonarchy/favicon.png", TARGET_PATH("/usr/share/tonarchy/favicon.png"));
+    copy_tree_add(&system_assets, "/usr/share/tonarchy/Tokyonight-Dark", TARGET_PATH("/usr/share/themes/Tokyonight-Dark"));
+    copy_tree_add(&system_assets, "/usr/share/tonarchy/firefox-policies/policies.json", TARGET_PATH("/usr/lib/firefox/distribution/policies.json"));
+    if (!copy_tree_run(&system_assets, COPY_WORKERS)) {
+        LOG_WARN("Some system assets failed to copy");
+    }
 
-                if (f->type == INPUT_FZF_KEYMAP) {
-                    fzf_select(keyboard, "localectl list-keymaps | fzf --height=40% --reverse --prompt='Keyboard: ' --header='Start typing to filter, Enter to select' --query='us'", "us");
-                } else if (f->type == INPUT_FZF_TIMEZONE) {
-                    fzf_select(timezone, "timedatectl list-timezones | fzf --height=40% --reverse --prompt='Timezone: ' --header='Type your city/timezone, Enter to select'", NULL);
-                    if (strlen(timezone) == 0)
-                        show_message("Timezone is required");
-                } else if (edit_field == 1 || edit_field == 2) {
-                    draw_form(username, password, confirmed_password, hostname, keyboard, timezone, 1);
-                    handle_password_entry(password, confirmed_password,
-                                          form_row, logo_start,
-                                          username, hostname, keyboard, timezone);
-                } else {
-                    draw_form(username, password, confirmed_password, hostname, keyboard, timezone, edit_field);
-                    printf(ANSI_CURSOR_POS, form_row + edit_field, logo_start + f->cursor_offset);
-                    fflush(stdout);
+    create_directory(TARGET_PATH("/usr/share/applications"), 0755);
+    write_file(TARGET_PATH("/usr/share/applications/firefox.desktop"),
+        "[Desktop Entry]\n"
+        "Name=Firefox\n"
+        "GenericName=Web Browser\n"
+        "Exec=sh -c 'firefox --profile $HOME/.config/firefox'\n"
+        "Type=Application\n"
+        "Icon=firefox\n"
+        "Categories=Network;WebBrowser;\n"
+        "MimeType=text/html;text/xml;application/xhtml+xml;application/vnd.mozilla.xul+xml;\n"
+    );
 
-                    if (read_line(temp_input, sizeof(temp_input), 1)) {
-                        if (strlen(temp_input) == 0 && f->default_val) {
-                            strcpy(f->dest, f->default_val);
-                        } else if (strlen(temp_input) > 0) {
-                            if (validate_alphanumeric(temp_input))
-                                strcpy(f->dest, temp_input);
-                            else
-                                show_message(f->error_msg);
-                        }
-                    }
-                }
-                continue;
-            }
-        }
-        disable_raw_mode();
+    target_path(dest, sizeof(dest), "/home/%s/.config", username);
+    create_directory(dest, 0755);
+    if (lchown(dest, uid, gid) != 0) {
+        LOG_ERROR("Failed to chown %s: %s", dest, strerror(errno));
+        return 0;
     }
 
+    LOG_INFO("Setting up Firefox profile and user configs");
+    static const char *USER_CONFIGS[] = { "alacritty", "rofi", "fastfetch", "picom" };
+
+    Copy_Tree user_assets;
+    copy_tree_init(&user_assets, uid, gid);
+    target_path(dest, sizeof(dest), "/home/%s/.config/firefox", username);
+    copy_tree_add(&user_assets, "/usr/share/tonarchy/firefox/default-release", dest);
+    for (size_t i = 0; i < sizeof(USER_CONFIGS) / sizeof(USER_CONFIGS[0]); i++) {
+        snprintf(src, sizeof(src), "/usr/share/tonarchy/%s", USER_CONFIGS[i]);
+        target_path(dest, sizeof(dest), "/home/%s/.config/%s", username, USER_CONFIGS[i]);
+        copy_tree_add(&user_assets, src, dest);
+    }
+    if (!copy_tree_run(&user_assets, COPY_WORKERS)) {
+        LOG_WARN("Some user configs failed to copy");
+    }
+
+    char nvim_path[256];
+    snprintf(nvim_path, sizeof(nvim_path), "/home/%s/.config/nvim", username);
+    git_clone_as_user(username, "https://github.com/tonybanters/nvim", nvim_path);
+
     return 1;
 }
 
-static int select_disk(char *disk_name) {
-    clear_screen();
+static int setup_autologin(const char *username) {
+    char autologin_exec[512];
+    snprintf(autologin_exec, sizeof(autologin_exec),
+             "ExecStart=-/sbin/agetty -o \"-p -f -- \\\\u\" --noclear --autologin %s %%I $TERM",
+             username);
 
-    FILE *fp = popen("lsblk -d -n -o NAME,SIZE,MODEL,TYPE | grep -E '(disk|nvme)' | grep -v -E '(loop|rom|airoot)' | awk '{printf \"%s (%s) %s\\n\", $1, $2, substr($0, index($0,$3))}'", "r");
-    if (fp == NULL) {
-        show_message("Failed to list disks");
+    Config_Entry autologin_entries[] = {
+        {"[Service]", ""},
+        {"ExecStart=", ""},
+        {autologin_exec, ""}
+    };
+
+    Systemd_Override autologin = {
+        "getty@tty1.service",
+        "getty@tty1.service.d",
+        "autologin.conf",
+        autologin_entries,
+        3
+    };
+
+    if (!setup_systemd_override(&autologin)) {
+        LOG_ERROR("Failed to setup autologin");
         return 0;
     }
 
-    char disks[32][256];
-    char names[32][64];
-    int disk_count = 0;
+    return 1;
+}
 
-    while (disk_count < 32 && fgets(disks[disk_count], sizeof(disks[0]), fp) != NULL) {
-        disks[disk_count][strcspn(disks[disk_count], "\n")] = '\0';
-        sscanf(disks[disk_count], "%s", names[disk_count]);
-        disk_count++;
-    }
-    pclose(fp);
+static const char *BASHRC_CONTENT =
+    "export PATH=\"$HOME/.local/bin:$PATH\"\n"
+    "export EDITOR=\"nvim\"\n"
+    "\n"
+    "alias ls='ls --color=auto'\n"
+    "alias la='ls -a'\n"
+    "alias ll='ls -la'\n"
+    "alias ..='cd ..'\n"
+    "alias ...='cd ../..'\n"
+    "alias grep='grep --color=auto'\n"
+    "\n"
+    "export PS1=\"\\[\\e[38;5;75m\\]\\u@\\h \\[\\e[38;5;113m\\]\\w \\[\\e[38;5;189m\\]\\$ \\[\\e[0m\\]\"\n"
+    "\n"
+    "fastfetch\n";
 
-    if (disk_count == 0) {
-        show_message("No disks found");
+static const char *BASH_PROFILE_CONTENT =
+    "if [ -z $DISPLAY ] && [ $XDG_VTNR = 1 ]; then\n"
+    "  exec startx\n"
+    "fi\n";
+
+static int configure_xfce(const char *username) {
+    char dest[PATH_MAX];
+    uid_t uid;
+    gid_t gid;
+
+    LOG_INFO("Configuring XFCE for user: %s", username);
+
+    if (!lookup_target_user(username, &uid, &gid)) {
         return 0;
     }
 
-    const char *disk_ptrs[32];
-    for (int i = 0; i < disk_count; i++) {
-        disk_ptrs[i] = disks[i];
+    target_path(dest, sizeof(dest), "/home/%s/.config/xfce4", username);
+    if (!copy_tree("/usr/share/tonarchy/xfce4", dest, uid, gid)) {
+        LOG_WARN("Some XFCE configs failed to copy");
     }
 
-    int selected = select_from_menu(disk_ptrs, disk_count);
-    if (selected < 0) {
+    Dotfile dotfiles[] = {
+        { ".xinitrc", "exec startxfce4\n", 0755 },
+        { ".bash_profile", BASH_PROFILE_CONTENT, 0644 },
+        { ".bashrc", BASHRC_CONTENT, 0644 }
+    };
+
+    for (size_t i = 0; i < sizeof(dotfiles) / sizeof(dotfiles[0]); i++) {
+        if (!create_user_dotfile(username, &dotfiles[i])) {
+            LOG_ERROR("Failed to create dotfile: %s", dotfiles[i].filename);
+            return 0;
+        }
+    }
+
+    if (!setup_autologin(username)) {
         return 0;
     }
 
-    strcpy(disk_name, names[selected]);
+    return 1;
+}
 
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
-    clear_screen();
-    draw_logo(cols);
+static int build_oxwm(const char *username) {
+    LOG_INFO("Starting OXWM installation for user: %s", username);
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[37mWARNING: All data on \033[31m/dev/%s\033[37m will be destroyed!\033[0m", 10, logo_start, disk_name);
-    printf("\033[%d;%dH\033[37mType 'yes' to confirm: \033[0m", 12, logo_start);
-    fflush(stdout);
+    char oxwm_path[256];
+    snprintf(oxwm_path, sizeof(oxwm_path), "/home/%s/oxwm", username);
 
-    char confirm[256];
-    struct termios old_term;
-    tcgetattr(STDIN_FILENO, &old_term);
-    struct termios new_term = old_term;
-    new_term.c_lflag |= (ECHO | ICANON);
-    new_term.c_lflag &= ~ISIG;
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_term);
+    if (!git_clone_as_user(username, "https://github.com/tonybanters/oxwm", oxwm_path)) {
+        LOG_ERROR("Failed to clone oxwm");
+        show_message("Failed to clone OXWM");
+        return 0;
+    }
 
-    if (fgets(confirm, sizeof(confirm), stdin) == NULL) {
-        tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
+    if (!chroot_exec_fmt("cd %s && cargo build --release", oxwm_path)) {
+        LOG_ERROR("Failed to build oxwm");
+        show_message("Failed to build OXWM");
         return 0;
     }
-    confirm[strcspn(confirm, "\n")] = '\0';
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_term);
 
-    if (strcmp(confirm, "yes") != 0) {
-        show_message("Installation cancelled");
+    if (!chroot_exec_fmt("cp %s/target/release/oxwm /usr/bin/oxwm", oxwm_path)) {
+        LOG_ERROR("Failed to install oxwm binary");
+        show_message("Failed to install OXWM");
         return 0;
     }
 
+    chroot_exec("chmod 755 /usr/bin/oxwm");
+
     return 1;
 }
 
-static int partition_disk(const char *disk) {
-    char cmd[1024];
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+static int configure_oxwm(const char *username) {
+    char src[PATH_MAX];
+    char dest[PATH_MAX];
+    uid_t uid;
+    gid_t gid;
 
-    clear_screen();
-    draw_logo(cols);
+    LOG_INFO("Configuring OXWM for user: %s", username);
 
-    int logo_start = (cols - 70) / 2;
-    int uefi = is_uefi_system();
+    if (!lookup_target_user(username, &uid, &gid)) {
+        return 0;
+    }
 
-    char part1[64], part2[64], part3[64];
-    part_path(part1, sizeof(part1), disk, 1);
-    part_path(part2, sizeof(part2), disk, 2);
-    part_path(part3, sizeof(part3), disk, 3);
+    Copy_Tree tree;
+    copy_tree_init(&tree, uid, gid);
+    target_path(dest, sizeof(dest), "/home/%s/.config/gtk-3.0", username);
+    copy_tree_add(&tree, "/usr/share/tonarchy/gtk-3.0", dest);
+    target_path(dest, sizeof(dest), "/home/%s/.config/gtk-4.0", username);
+    copy_tree_add(&tree, "/usr/share/tonarchy/gtk-4.0", dest);
+    target_path(dest, sizeof(dest), "/home/%s/.gtkrc-2.0", username);
+    copy_tree_add(&tree, "/usr/share/tonarchy/gtkrc-2.0", dest);
+    target_path(src, sizeof(src), "/home/%s/oxwm/templates/tonarchy-config.lua", username);
+    target_path(dest, sizeof(dest), "/home/%s/.config/oxwm", username);
+    if (mkdir(dest, 0755) != 0 && errno != EEXIST) {
+        LOG_WARN("Failed to create %s: %s", dest, strerror(errno));
+    } else if (lchown(dest, uid, gid) != 0) {
+        LOG_WARN("Failed to chown %s: %s", dest, strerror(errno));
+    }
+    target_path(dest, sizeof(dest), "/home/%s/.config/oxwm/config.lua", username);
+    copy_tree_add(&tree, src, dest);
+    if (!copy_tree_run(&tree, COPY_WORKERS)) {
+        LOG_WARN("Some OXWM configs failed to copy");
+    }
 
-    printf("\033[%d;%dH\033[37mPartitioning /dev/%s (%s mode)...\033[0m", 10, logo_start, disk, uefi ? "UEFI" : "BIOS");
-    fflush(stdout);
+    Dotfile dotfiles[] = {
+        { ".xinitrc", "export GTK_THEME=Adwaita-dark\nxset r rate 200 35 &\npicom --config ~/.config/picom/picom.conf &\nxwallpaper --zoom /usr/share/wallpapers/wall1.jpg &\nexec oxwm\n", 0755 },
+        { ".bash_profile", BASH_PROFILE_CONTENT, 0644 },
+        { ".bashrc", BASHRC_CONTENT, 0644 }
+    };
 
-    LOG_INFO("Starting disk partitioning: /dev/%s (mode: %s)", disk, uefi ? "UEFI" : "BIOS");
+    for (size_t i = 0; i < sizeof(dotfiles) / sizeof(dotfiles[0]); i++) {
+        if (!create_user_dotfile(username, &dotfiles[i])) {
+            LOG_ERROR("Failed to create dotfile: %s", dotfiles[i].filename);
+            return 0;
+        }
+    }
 
-    snprintf(cmd, sizeof(cmd), "wipefs -af /dev/%s 2>> /tmp/tonarchy-install.log", disk);
-    if (system(cmd) != 0) {
-        LOG_ERROR("Failed to wipe disk: /dev/%s", disk);
-        show_message("Failed to wipe disk");
+    if (!setup_autologin(username)) {
         return 0;
     }
-    LOG_INFO("Wiped disk");
 
-    if (uefi) {
-        snprintf(cmd, sizeof(cmd), "sgdisk --zap-all /dev/%s 2>> /tmp/tonarchy-install.log", disk);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to zap disk: /dev/%s", disk);
-            show_message("Failed to zap disk");
-            return 0;
-        }
-        LOG_INFO("Zapped disk (GPT)");
-
-        snprintf(cmd, sizeof(cmd),
-            "sgdisk --clear "
-            "--new=1:0:+1G --typecode=1:ef00 --change-name=1:EFI "
-            "--new=2:0:+4G --typecode=2:8200 --change-name=2:swap "
-            "--new=3:0:0 --typecode=3:8300 --change-name=3:root "
-            "/dev/%s 2>> /tmp/tonarchy-install.log", disk);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to create partitions on /dev/%s", disk);
-            show_message("Failed to create partitions");
-            return 0;
-        }
-        LOG_INFO("Created partitions (EFI, swap, root)");
-    } else {
-        snprintf(cmd, sizeof(cmd),
-            "parted -s /dev/%s mklabel msdos "
-            "mkpart primary linux-swap 1MiB 4GiB "
-            "mkpart primary ext4 4GiB 100%% "
-            "set 2 boot on 2>> /tmp/tonarchy-install.log", disk);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to create MBR partitions on /dev/%s", disk);
-            show_message("Failed to create partitions");
-            return 0;
+    LOG_INFO("OXWM installation completed successfully");
+    return 1;
+}
+
+typedef struct {
+    const Install_Step *steps;
+    size_t count;
+    const Install_Context *ctx;
+    Step_State *state;
+    double *elapsed;
+    size_t (*deps)[MAX_STEP_DEPS];
+    size_t *dep_count;
+    size_t running;
+    size_t finished;
+    long failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Step_Graph;
+
+static void publish_step_board(const Step_Graph *graph) {
+    size_t done = 0;
+    const char *current = "";
+    for (size_t i = 0; i < graph->count; i++) {
+        if (graph->state[i] == STEP_DONE) {
+            done++;
+        } else if (graph->state[i] != STEP_PENDING && !*current) {
+            current = graph->steps[i].label;
         }
-        LOG_INFO("Created MBR partitions (swap, root)");
     }
+    target_status->steps_total = graph->count;
+    target_status->steps_done = done;
+    snprintf(target_status->step, sizeof(target_status->step), "%s", current);
+}
 
-    printf("\033[%d;%dH\033[37mFormatting partitions...\033[0m", 11, logo_start);
-    fflush(stdout);
+static void draw_step_board(const Step_Graph *graph) {
+    if (target_status) {
+        publish_step_board(graph);
+        return;
+    }
 
-    if (uefi) {
-        snprintf(cmd, sizeof(cmd), "mkfs.fat -F32 %s 2>> /tmp/tonarchy-install.log", part1);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to format EFI partition: %s", part1);
-            show_message("Failed to format EFI partition");
-            return 0;
-        }
-        LOG_INFO("Formatted EFI partition");
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
 
-        snprintf(cmd, sizeof(cmd), "mkswap %s 2>> /tmp/tonarchy-install.log", part2);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to format swap: %s", part2);
-            show_message("Failed to format swap partition");
-            return 0;
-        }
-        LOG_INFO("Formatted swap partition");
+    pthread_mutex_lock(&ui_lock);
+    clear_screen();
+    draw_logo(cols);
 
-        snprintf(cmd, sizeof(cmd), "mkfs.ext4 -F %s 2>> /tmp/tonarchy-install.log", part3);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to format root: %s", part3);
-            show_message("Failed to format root partition");
-            return 0;
-        }
-        LOG_INFO("Formatted root partition");
-    } else {
-        snprintf(cmd, sizeof(cmd), "mkswap %s 2>> /tmp/tonarchy-install.log", part1);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to format swap: %s", part1);
-            show_message("Failed to format swap partition");
-            return 0;
+    int logo_start = (cols - 70) / 2;
+    printf(ANSI_CURSOR_POS ANSI_WHITE "Installing Tonarchy..." ANSI_RESET, 10, logo_start);
+
+    for (size_t i = 0; i < graph->count; i++) {
+        printf(ANSI_CURSOR_POS, 12 + (int)i, logo_start + 2);
+        switch (graph->state[i]) {
+        case STEP_PENDING:
+            printf(ANSI_GRAY "[ ] %s" ANSI_RESET, graph->steps[i].label);
+            break;
+        case STEP_RUNNING:
+            printf(ANSI_YELLOW "[*] %s..." ANSI_RESET, graph->steps[i].label);
+            break;
+        case STEP_DONE:
+            printf(ANSI_GREEN "[+] %s " ANSI_GRAY "(%.1fs)" ANSI_RESET, graph->steps[i].label, graph->elapsed[i]);
+            break;
+        case STEP_FAILED:
+            printf(ANSI_RED "[!] %s" ANSI_RESET, graph->steps[i].label);
+            break;
         }
-        LOG_INFO("Formatted swap partition");
+    }
 
-        snprintf(cmd, sizeof(cmd), "mkfs.ext4 -F %s 2>> /tmp/tonarchy-install.log", part2);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to format root: %s", part2);
-            show_message("Failed to format root partition");
-            return 0;
-        }
-        LOG_INFO("Formatted root partition");
+    install_status_row = 13 + (int)graph->count;
+    install_status_col = logo_start;
+    if (install_status[0]) {
+        printf(ANSI_CURSOR_POS ANSI_WHITE "%s" ANSI_RESET, install_status_row, install_status_col, install_status);
     }
 
-    printf("\033[%d;%dH\033[37mMounting partitions...\033[0m", 12, logo_start);
+    printf(ANSI_CURSOR_POS ANSI_GRAY "(Logging to /tmp/tonarchy-install.log)" ANSI_RESET,
+           14 + (int)graph->count, logo_start);
     fflush(stdout);
+    pthread_mutex_unlock(&ui_lock);
+}
 
-    if (uefi) {
-        snprintf(cmd, sizeof(cmd), "mount %s /mnt 2>> /tmp/tonarchy-install.log", part3);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to mount root: %s", part3);
-            show_message("Failed to mount root partition");
-            return 0;
-        }
-        LOG_INFO("Mounted root partition");
+static long find_ready_step(const Step_Graph *graph) {
+    for (size_t i = 0; i < graph->count; i++) {
+        if (graph->state[i] != STEP_PENDING) continue;
+
+        size_t d = 0;
+        while (d < graph->dep_count[i] && graph->state[graph->deps[i][d]] == STEP_DONE) d++;
+        if (d == graph->dep_count[i]) return (long)i;
+    }
+    return -1;
+}
 
-        snprintf(cmd, sizeof(cmd), "mkdir -p /mnt/boot 2>> /tmp/tonarchy-install.log");
-        system(cmd);
+static void *step_worker(void *arg) {
+    Step_Graph *graph = arg;
 
-        snprintf(cmd, sizeof(cmd), "mount %s /mnt/boot 2>> /tmp/tonarchy-install.log", part1);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to mount EFI: %s", part1);
-            show_message("Failed to mount EFI partition");
-            return 0;
+    pthread_mutex_lock(&graph->lock);
+    while (graph->failed < 0 && graph->finished < graph->count) {
+        long next = find_ready_step(graph);
+        if (next < 0) {
+            if (graph->running == 0) break;
+            pthread_cond_wait(&graph->cond, &graph->lock);
+            continue;
         }
-        LOG_INFO("Mounted EFI partition");
 
-        snprintf(cmd, sizeof(cmd), "swapon %s 2>> /tmp/tonarchy-install.log", part2);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to enable swap: %s", part2);
-            show_message("Failed to enable swap");
-            return 0;
+        const Install_Step *step = &graph->steps[next];
+        graph->state[next] = STEP_RUNNING;
+        graph->running++;
+        draw_step_board(graph);
+        pthread_mutex_unlock(&graph->lock);
+
+        LOG_INFO("Step started: %s", step->name);
+        double start = monotonic_seconds();
+        long span = trace_begin("step", step->name);
+        int ok = step->run(graph->ctx);
+        if (ok) sync_target();
+        trace_end(span, ok ? 0 : 1, 0);
+        double elapsed = monotonic_seconds() - start;
+
+        pthread_mutex_lock(&graph->lock);
+        graph->elapsed[next] = elapsed;
+        graph->running--;
+        graph->finished++;
+        if (ok) {
+            graph->state[next] = STEP_DONE;
+            LOG_INFO("Step finished: %s (%.2fs)", step->name, elapsed);
+        } else {
+            graph->state[next] = STEP_FAILED;
+            if (graph->failed < 0) graph->failed = next;
+            LOG_ERROR("Step failed: %s (%.2fs)", step->name, elapsed);
         }
-    } else {
-        snprintf(cmd, sizeof(cmd), "mount %s /mnt 2>> /tmp/tonarchy-install.log", part2);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to mount root: %s", part2);
-            show_message("Failed to mount root partition");
-            return 0;
+        draw_step_board(graph);
+        pthread_cond_broadcast(&graph->cond);
+    }
+    pthread_cond_broadcast(&graph->cond);
+    pthread_mutex_unlock(&graph->lock);
+
+    return NULL;
+}
+
+static int resolve_step_deps(Step_Graph *graph) {
+    for (size_t i = 0; i < graph->count; i++) {
+        graph->dep_count[i] = 0;
+        for (size_t d = 0; d < MAX_STEP_DEPS && graph->steps[i].deps[d]; d++) {
+            size_t j = 0;
+            while (j < graph->count && strcmp(graph->steps[j].name, graph->steps[i].deps[d]) != 0) j++;
+            if (j == graph->count) {
+                LOG_ERROR("Step %s depends on unknown step %s", graph->steps[i].name, graph->steps[i].deps[d]);
+                return 0;
+            }
+            graph->deps[i][graph->dep_count[i]++] = j;
         }
-        LOG_INFO("Mounted root partition");
+    }
 
-        snprintf(cmd, sizeof(cmd), "swapon %s 2>> /tmp/tonarchy-install.log", part1);
-        if (system(cmd) != 0) {
-            LOG_ERROR("Failed to enable swap: %s", part1);
-            show_message("Failed to enable swap");
-            return 0;
+    size_t placed = 0;
+    bool progress = true;
+    for (size_t i = 0; i < graph->count; i++) graph->state[i] = STEP_PENDING;
+    while (progress) {
+        progress = false;
+        long next = find_ready_step(graph);
+        if (next >= 0) {
+            graph->state[next] = STEP_DONE;
+            placed++;
+            progress = true;
         }
     }
-    LOG_INFO("Enabled swap");
-    LOG_INFO("Disk partitioning completed successfully");
+    for (size_t i = 0; i < graph->count; i++) graph->state[i] = STEP_PENDING;
 
-    show_message("Disk prepared successfully!");
+    if (placed != graph->count) {
+        LOG_ERROR("Install step graph contains a dependency cycle");
+        return 0;
+    }
     return 1;
 }
 
-static int install_packages_impl(const char *package_list) {
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+int run_install_steps(const Install_Step *steps, size_t count, const Install_Context *ctx, int max_workers) {
+    Step_State state[count];
+    double elapsed[count];
+    size_t deps[count][MAX_STEP_DEPS];
+    size_t dep_count[count];
+
+    Step_Graph graph = {
+        .steps = steps,
+        .count = count,
+        .ctx = ctx,
+        .state = state,
+        .elapsed = elapsed,
+        .deps = deps,
+        .dep_count = dep_count,
+        .failed = -1
+    };
+    memset(elapsed, 0, sizeof(elapsed));
 
-    clear_screen();
-    draw_logo(cols);
+    if (!resolve_step_deps(&graph)) {
+        show_message("Invalid install step graph");
+        return 0;
+    }
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[37mInstalling system packages...\033[0m", 10, logo_start);
-    printf("\033[%d;%dH\033[37mThis will take several minutes.\033[0m", 11, logo_start);
-    fflush(stdout);
+    pthread_mutex_init(&graph.lock, NULL);
+    pthread_cond_init(&graph.cond, NULL);
 
-    LOG_INFO("Starting package installation");
-    LOG_INFO("Packages: %s", package_list);
+    if (max_workers < 1) max_workers = 1;
+    if ((size_t)max_workers > count) max_workers = (int)count;
 
-    char cmd[4096];
-    snprintf(cmd, sizeof(cmd), "pacstrap -K /mnt %s 2>> /tmp/tonarchy-install.log", package_list);
+    LOG_INFO("Running %zu install steps on %d workers", count, max_workers);
+    double start = monotonic_seconds();
 
-    int result = system(cmd);
-    if (result != 0) {
-        LOG_ERROR("pacstrap failed with exit code %d", result);
-        show_message("Failed to install packages");
-        return 0;
+    pthread_t workers[max_workers];
+    int started = 0;
+    for (int i = 0; i < max_workers; i++) {
+        if (pthread_create(&workers[i], NULL, step_worker, &graph) != 0) {
+            LOG_WARN("Failed to start install worker %d", i);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) step_worker(&graph);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
     }
 
-    LOG_INFO("Package installation completed successfully");
-    show_message("Packages installed successfully!");
-    return 1;
-}
-
-static int configure_system_impl(
-        const char *username,
-        const char *password,
-        const char *hostname,
-        const char *keyboard,
-        const char *timezone,
-        const char *disk,
-        int use_dm
-    ) {
-    (void)disk;
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
-
-    clear_screen();
-    draw_logo(cols);
+    pthread_cond_destroy(&graph.cond);
+    pthread_mutex_destroy(&graph.lock);
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[37mConfiguring system...\033[0m", 10, logo_start);
-    printf("\033[%d;%dH\033[90m(Logging to /tmp/tonarchy-install.log)\033[0m", 11, logo_start);
-    fflush(stdout);
+    LOG_INFO("Install steps finished in %.2fs", monotonic_seconds() - start);
 
-    LOG_INFO("Starting system configuration");
-    LOG_INFO("User: %s, Hostname: %s, Timezone: %s, Keyboard: %s", username, hostname, timezone, keyboard);
+    if (graph.failed >= 0) {
+        logger_flush();
+        show_message(steps[graph.failed].error_msg);
+        return 0;
+    }
+    if (graph.finished != count) {
+        LOG_ERROR("Install stalled with %zu of %zu steps finished", graph.finished, count);
+        return 0;
+    }
+    return 1;
+}
 
-    CHECK_OR_FAIL(
-        system("genfstab -U /mnt >> /mnt/etc/fstab 2>> /tmp/tonarchy-install.log") == 0,
-        "Failed to generate fstab - check /tmp/tonarchy-install.log"
-    );
+static int step_partition(const Install_Context *ctx) {
+    return partition_disk(ctx->disk, ctx->layout, ctx->root_fs, ctx->swap, ctx->secure_discard);
+}
 
-    CHECK_OR_FAIL(
-        chroot_exec_fmt("ln -sf /usr/share/zoneinfo/%s /etc/localtime", timezone),
-        "Failed to configure timezone"
-    );
+static int step_packages(const Install_Context *ctx) {
+    if (!install_packages_impl(ctx->packages, prefetch_wait())) {
+        return 0;
+    }
 
-    if (!chroot_exec("hwclock --systohc")) {
-        LOG_WARN("Failed to set hardware clock");
+    if (!chroot_session_begin()) {
+        show_message("Failed to set up chroot");
+        return 0;
     }
+    return 1;
+}
 
-    CHECK_OR_FAIL(
-        write_file("/mnt/etc/locale.gen", "en_US.UTF-8 UTF-8\n"),
-        "Failed to write locale.gen"
-    );
+static int step_fstab(const Install_Context *ctx) {
+    return configure_fstab(ctx->layout);
+}
 
-    CHECK_OR_FAIL(
-        chroot_exec("locale-gen"),
-        "Failed to generate locales"
-    );
+static int step_locale(const Install_Context *ctx) {
+    return configure_locale(ctx->keyboard, ctx->timezone);
+}
 
-    CHECK_OR_FAIL(
-        write_file("/mnt/etc/locale.conf", "LANG=en_US.UTF-8\n"),
-        "Failed to write locale.conf"
-    );
+static int step_hostname(const Install_Context *ctx) {
+    return configure_hostname(ctx->hostname);
+}
 
-    CHECK_OR_FAIL(
-        write_file_fmt("/mnt/etc/vconsole.conf", "KEYMAP=%s\n", keyboard),
-        "Failed to write vconsole.conf"
-    );
+static int step_users(const Install_Context *ctx) {
+    return configure_users(ctx->username, ctx->password, ctx->password_hashed);
+}
 
-    CHECK_OR_FAIL(
-        write_file_fmt("/mnt/etc/hostname", "%s\n", hostname),
-        "Failed to write hostname"
-    );
+static int step_services(const Install_Context *ctx) {
+    (void)ctx;
+    return configure_services(0);
+}
 
-    char hosts_content[512];
-    snprintf(hosts_content, sizeof(hosts_content),
-             "127.0.0.1   localhost\n"
-             "::1         localhost\n"
-             "127.0.1.1   %s.localdomain %s\n",
-             hostname, hostname);
+static int step_storage(const Install_Context *ctx) {
+    return configure_storage(ctx->layout);
+}
 
-    CHECK_OR_FAIL(
-        write_file("/mnt/etc/hosts", hosts_content),
-        "Failed to write hosts file"
-    );
+static int step_bootloader(const Install_Context *ctx) {
+    return install_bootloader(ctx->disk, ctx->layout, ctx->batch);
+}
 
-    CHECK_OR_FAIL(
-        chroot_exec_fmt("useradd -m -G wheel -s /bin/bash %s", username),
-        "Failed to create user"
-    );
+static int step_common_configs(const Install_Context *ctx) {
+    return setup_common_configs(ctx->username);
+}
 
-    FILE *chpasswd_pipe = popen("arch-chroot /mnt chpasswd 2>> /tmp/tonarchy-install.log", "w");
-    if (!chpasswd_pipe) {
-        show_message("Failed to open chpasswd");
-        return 0;
-    }
-    fprintf(chpasswd_pipe, "%s:%s\n", username, password);
-    fprintf(chpasswd_pipe, "root:%s\n", password);
-    int chpasswd_status = pclose(chpasswd_pipe);
-    CHECK_OR_FAIL(
-        chpasswd_status == 0,
-        "Failed to set passwords"
-    );
+static int step_xfce(const Install_Context *ctx) {
+    return configure_xfce(ctx->username);
+}
 
-    create_directory("/mnt/etc/sudoers.d", 0750);
-    CHECK_OR_FAIL(
-        write_file("/mnt/etc/sudoers.d/wheel", "%wheel ALL=(ALL:ALL) ALL\n"),
-        "Failed to configure sudo"
-    );
-    chmod("/mnt/etc/sudoers.d/wheel", 0440);
+static int step_oxwm_build(const Install_Context *ctx) {
+    return build_oxwm(ctx->username);
+}
 
-    CHECK_OR_FAIL(
-        chroot_exec("systemctl enable NetworkManager"),
-        "Failed to enable NetworkManager"
-    );
+static int step_oxwm(const Install_Context *ctx) {
+    return configure_oxwm(ctx->username);
+}
 
-    CHECK_OR_FAIL(
-        chroot_exec("systemctl enable dbus"),
-        "Failed to enable dbus"
-    );
+typedef struct {
+    const char *key;
+    size_t offset;
+    size_t size;
+} Answer_Key;
+
+#define ANSWER_STRING(field) {#field, offsetof(Answer_File, field), sizeof(((Answer_File *)0)->field)}
+#define ANSWER_BOOL(field) {#field, offsetof(Answer_File, field), 0}
+
+static const Answer_Key ANSWER_KEYS[] = {
+    ANSWER_STRING(username),
+    ANSWER_STRING(password),
+    ANSWER_STRING(password_hash),
+    ANSWER_STRING(hostname),
+    ANSWER_STRING(keyboard),
+    ANSWER_STRING(timezone),
+    ANSWER_STRING(mode),
+    ANSWER_STRING(disk),
+    ANSWER_STRING(filesystem),
+    ANSWER_STRING(wifi_ssid),
+    ANSWER_STRING(wifi_password),
+    ANSWER_STRING(image),
+    ANSWER_STRING(capture),
+    ANSWER_BOOL(hibernate),
+    ANSWER_BOOL(secure_discard),
+    ANSWER_BOOL(reboot),
+};
 
-    if (use_dm) {
-        CHECK_OR_FAIL(
-            chroot_exec("systemctl enable lightdm"),
-            "Failed to enable display manager"
-        );
+static int answer_parse_value(char *p, char *value, size_t size) {
+    size_t len = 0;
+    char quote = *p;
+
+    if (quote == '"' || quote == '\'') {
+        p++;
+        while (*p && *p != quote) {
+            char c = *p++;
+            if (quote == '"' && c == '\\') {
+                c = *p++;
+                if (c == 'n') c = '\n';
+                else if (c == 't') c = '\t';
+                else if (c != '\\' && c != '"') return 0;
+            }
+            if (len + 1 >= size) return 0;
+            value[len++] = c;
+        }
+        if (*p != quote) return 0;
+        p++;
+    } else {
+        while (*p && !isspace((unsigned char)*p) && *p != '#') {
+            if (len + 1 >= size) return 0;
+            value[len++] = *p++;
+        }
+        if (len == 0) return 0;
     }
+    value[len] = '\0';
 
-    LOG_INFO("System configuration completed successfully");
-    show_message("System configured successfully!");
-    return 1;
+    while (isspace((unsigned char)*p)) p++;
+    return *p == '\0' || *p == '#';
 }
 
-static int get_root_uuid(const char *disk, char *uuid_out, size_t uuid_size) {
-    char cmd[512];
-    char root_part[64];
+int answer_file_load(const char *path, Answer_File *answers) {
+    memset(answers, 0, sizeof(*answers));
+    strcpy(answers->keyboard, "us");
+    strcpy(answers->mode, "beginner");
+    strcpy(answers->filesystem, "ext4");
+    answers->reboot = true;
 
-    part_path(root_part, sizeof(root_part), disk, 3);
-    snprintf(cmd, sizeof(cmd), "blkid -s UUID -o value %s", root_part);
-
-    FILE *fp = popen(cmd, "r");
+    FILE *fp = fopen(path, "r");
     if (!fp) {
-        LOG_ERROR("Failed to get UUID for %s", root_part);
+        LOG_ERROR("Cannot open answer file %s: %s", path, strerror(errno));
         return 0;
     }
 
-    if (fgets(uuid_out, uuid_size, fp) == NULL) {
-        pclose(fp);
-        LOG_ERROR("Failed to read UUID for %s", root_part);
-        return 0;
-    }
+    char line[1024];
+    char value[sizeof(line)];
+    int line_no = 0;
+    int ok = 1;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        if (!strchr(line, '\n') && !feof(fp)) {
+            LOG_ERROR("%s:%d: line too long", path, line_no);
+            ok = 0;
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == '#') continue;
+        if (strcmp(p, "[install]") == 0) continue;
+
+        char *eq = strchr(p, '=');
+        if (!eq) {
+            LOG_ERROR("%s:%d: expected key = value", path, line_no);
+            ok = 0;
+            continue;
+        }
+        char *key_end = eq;
+        while (key_end > p && isspace((unsigned char)key_end[-1])) key_end--;
+        *key_end = '\0';
+        char *v = eq + 1;
+        while (isspace((unsigned char)*v)) v++;
+
+        const Answer_Key *key = NULL;
+        for (size_t i = 0; i < sizeof(ANSWER_KEYS) / sizeof(ANSWER_KEYS[0]); i++) {
+            if (strcmp(ANSWER_KEYS[i].key, p) == 0) {
+                key = &ANSWER_KEYS[i];
+                break;
+            }
+        }
+        if (!key) {
+            LOG_ERROR("%s:%d: unknown key '%s'", path, line_no, p);
+            ok = 0;
+            continue;
+        }
 
-    uuid_out[strcspn(uuid_out, "\n")] = '\0';
-    pclose(fp);
+        size_t limit = key->size && key->size < sizeof(value) ? key->size : sizeof(value);
+        if (!answer_parse_value(v, value, limit)) {
+            LOG_ERROR("%s:%d: invalid or too long value for '%s'", path, line_no, key->key);
+            ok = 0;
+            continue;
+        }
 
-    if (strlen(uuid_out) == 0) {
-        LOG_ERROR("Empty UUID for %s", root_part);
-        return 0;
+        char *field = (char *)answers + key->offset;
+        if (key->size) {
+            memcpy(field, value, strlen(value) + 1);
+        } else if (strcmp(value, "true") == 0 || strcmp(value, "false") == 0) {
+            *(bool *)field = value[0] == 't';
+        } else {
+            LOG_ERROR("%s:%d: '%s' must be true or false", path, line_no, key->key);
+            ok = 0;
+        }
     }
+    fclose(fp);
 
-    LOG_INFO("Root partition UUID: %s", uuid_out);
-    return 1;
+    if (ok) {
+        LOG_INFO("Loaded answer file %s", path);
+    }
+    return ok;
 }
 
-static int install_bootloader(const char *disk) {
-    char cmd[2048];
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+static int keymap_exists(const char *keymap) {
+    Cmd cmd;
+    cmd_init(&cmd, "localectl");
+    cmd_arg(&cmd, "list-keymaps");
+    cmd.capture = true;
+    cmd.quiet = true;
+    if (!cmd_run(&cmd) || !cmd.output) {
+        cmd_free(&cmd);
+        LOG_WARN("Could not list keymaps, skipping keymap validation");
+        return 1;
+    }
 
-    clear_screen();
-    draw_logo(cols);
+    int found = 0;
+    size_t len = strlen(keymap);
+    for (char *line = cmd.output; line && *line; ) {
+        char *next = strchr(line, '\n');
+        size_t line_len = next ? (size_t)(next - line) : strlen(line);
+        if (line_len == len && strncmp(line, keymap, len) == 0) {
+            found = 1;
+            break;
+        }
+        line = next ? next + 1 : NULL;
+    }
+    cmd_free(&cmd);
+    return found;
+}
 
-    int logo_start = (cols - 70) / 2;
-    int uefi = is_uefi_system();
+static size_t split_disk_list(const char *list, char disks[][64], size_t max) {
+    size_t count = 0;
+    const char *p = list;
+    while (*p) {
+        p += strspn(p, " ,");
+        size_t len = strcspn(p, " ,");
+        if (len == 0) break;
+        if (count == max || len >= 64) return max + 1;
+        memcpy(disks[count], p, len);
+        disks[count][len] = '\0';
+        count++;
+        p += len;
+    }
+    return count;
+}
 
-    printf("\033[%d;%dH\033[37mInstalling bootloader (%s)...\033[0m", 10, logo_start, uefi ? "systemd-boot" : "GRUB");
-    fflush(stdout);
+static int disk_is_installable(const char *disk) {
+    if (!*disk || !validate_alphanumeric(disk)) return 0;
+    if (strncmp(disk, "loop", 4) == 0 || strncmp(disk, "sr", 2) == 0 ||
+        strncmp(disk, "zram", 4) == 0 || strncmp(disk, "ram", 3) == 0) {
+        return 0;
+    }
 
-    if (uefi) {
-        LOG_INFO("Installing systemd-boot");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/block/%s", disk);
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
 
-        if (!chroot_exec("bootctl install")) {
-            LOG_ERROR("bootctl install failed");
-            show_message("Failed to install bootloader");
-            return 0;
-        }
+    uint64_t read_only = 0;
+    snprintf(path, sizeof(path), "/sys/block/%s/ro", disk);
+    if (read_sysfs_u64(path, &read_only) && read_only) return 0;
 
-        char uuid[128];
-        if (!get_root_uuid(disk, uuid, sizeof(uuid))) {
-            show_message("Failed to get root partition UUID");
-            return 0;
-        }
+    uint64_t sectors = 0;
+    snprintf(path, sizeof(path), "/sys/block/%s/size", disk);
+    return read_sysfs_u64(path, &sectors) && sectors > 0;
+}
 
-        LOG_INFO("Creating loader.conf");
-        if (!write_file("/mnt/boot/loader/loader.conf",
-            "default arch.conf\n"
-            "timeout 3\n"
-            "console-mode max\n"
-            "editor no\n")) {
-            LOG_ERROR("Failed to write loader.conf");
-            show_message("Failed to create loader config");
-            return 0;
-        }
+int answer_file_validate(const Answer_File *answers) {
+    int ok = 1;
 
-        if (!create_directory("/mnt/boot/loader/entries", 0755)) {
-            LOG_ERROR("Failed to create boot entries directory");
-            return 0;
-        }
+    if (!*answers->username || !validate_alphanumeric(answers->username)) {
+        LOG_ERROR("Answer file: username must be non-empty and alphanumeric");
+        ok = 0;
+    }
+    if (!*answers->hostname || !validate_alphanumeric(answers->hostname)) {
+        LOG_ERROR("Answer file: hostname must be non-empty and alphanumeric");
+        ok = 0;
+    }
 
-        char boot_entry[512];
-        snprintf(boot_entry, sizeof(boot_entry),
-            "title   Tonarchy\n"
-            "linux   /vmlinuz-linux\n"
-            "initrd  /initramfs-linux.img\n"
-            "options root=UUID=%s rw\n",
-            uuid);
+    bool has_password = *answers->password;
+    bool has_hash = *answers->password_hash;
+    if (has_password == has_hash) {
+        LOG_ERROR("Answer file: set exactly one of password or password_hash");
+        ok = 0;
+    } else if (has_hash && (answers->password_hash[0] != '$' ||
+                            strpbrk(answers->password_hash, ":\n"))) {
+        LOG_ERROR("Answer file: password_hash must be a crypt(3) hash such as $6$... or $y$...");
+        ok = 0;
+    } else if (has_password && strchr(answers->password, '\n')) {
+        LOG_ERROR("Answer file: password must not contain newlines");
+        ok = 0;
+    }
 
-        LOG_INFO("Creating boot entry");
-        if (!write_file("/mnt/boot/loader/entries/arch.conf", boot_entry)) {
-            LOG_ERROR("Failed to write boot entry");
-            show_message("Failed to create boot entry");
-            return 0;
-        }
+    if (!*answers->keyboard || !validate_alphanumeric(answers->keyboard) ||
+        !keymap_exists(answers->keyboard)) {
+        LOG_ERROR("Answer file: unknown keymap '%s'", answers->keyboard);
+        ok = 0;
+    }
 
-        struct stat st;
-        if (stat("/mnt/boot/loader/entries/arch.conf", &st) != 0) {
-            LOG_ERROR("Boot entry file missing after creation");
-            show_message("Boot entry verification failed");
-            return 0;
-        }
+    char zone[PATH_MAX];
+    struct stat st;
+    snprintf(zone, sizeof(zone), "/usr/share/zoneinfo/%s", answers->timezone);
+    if (!*answers->timezone || answers->timezone[0] == '/' || strstr(answers->timezone, "..") ||
+        stat(zone, &st) != 0 || !S_ISREG(st.st_mode)) {
+        LOG_ERROR("Answer file: unknown timezone '%s'", answers->timezone);
+        ok = 0;
+    }
 
-        LOG_INFO("Syncing filesystem");
-        sync();
-        sleep(1);
+    if (strcmp(answers->mode, "beginner") != 0 && strcmp(answers->mode, "oxidized") != 0) {
+        LOG_ERROR("Answer file: mode must be 'beginner' or 'oxidized', got '%s'", answers->mode);
+        ok = 0;
+    }
 
-        if (!chroot_exec("sync")) {
-            LOG_WARN("Failed to sync in chroot");
-        }
+    if (!root_fs_find(answers->filesystem)) {
+        LOG_ERROR("Answer file: unsupported filesystem '%s'", answers->filesystem);
+        ok = 0;
+    }
 
-        LOG_INFO("systemd-boot installation completed");
-    } else {
-        snprintf(cmd, sizeof(cmd),
-            "arch-chroot /mnt pacman -S --noconfirm grub 2>> /tmp/tonarchy-install.log");
-        if (system(cmd) != 0) {
-            show_message("Failed to install GRUB package");
-            return 0;
+    char disks[MAX_TARGETS][64];
+    size_t disk_count = split_disk_list(answers->disk, disks, MAX_TARGETS);
+    if (disk_count == 0 || disk_count > MAX_TARGETS) {
+        LOG_ERROR("Answer file: disk must list between 1 and %d disks", MAX_TARGETS);
+        ok = 0;
+        disk_count = 0;
+    }
+    for (size_t i = 0; i < disk_count; i++) {
+        if (!disk_is_installable(disks[i])) {
+            LOG_ERROR("Answer file: '%s' is not an installable disk", disks[i]);
+            ok = 0;
         }
-
-        snprintf(cmd, sizeof(cmd),
-            "arch-chroot /mnt grub-install --target=i386-pc /dev/%s 2>> /tmp/tonarchy-install.log",
-            disk);
-        if (system(cmd) != 0) {
-            show_message("Failed to install GRUB");
-            return 0;
+        for (size_t j = 0; j < i; j++) {
+            if (strcmp(disks[i], disks[j]) == 0) {
+                LOG_ERROR("Answer file: disk '%s' listed twice", disks[i]);
+                ok = 0;
+            }
         }
+    }
 
-        snprintf(cmd, sizeof(cmd),
-            "arch-chroot /mnt grub-mkconfig -o /boot/grub/grub.cfg 2>> /tmp/tonarchy-install.log");
-        if (system(cmd) != 0) {
-            show_message("Failed to generate GRUB config");
-            return 0;
-        }
+    if (*answers->wifi_password && !*answers->wifi_ssid) {
+        LOG_ERROR("Answer file: wifi_password given without wifi_ssid");
+        ok = 0;
+    }
+
+    return ok;
+}
+
+static int connect_wifi_unattended(const Answer_File *answers) {
+    if (check_internet_connection()) {
+        return 1;
+    }
+    if (!*answers->wifi_ssid) {
+        LOG_ERROR("No internet connection and no wifi_ssid in answer file");
+        return 0;
     }
 
-    show_message("Bootloader installed successfully!");
+    LOG_INFO("Connecting to WiFi network %s", answers->wifi_ssid);
+    cmd_run_args("nmcli", "radio", "wifi", "on", NULL);
+    sleep(1);
+    cmd_run_args("nmcli", "device", "wifi", "rescan", NULL);
+
+    Cmd cmd;
+    cmd_init(&cmd, "nmcli");
+    cmd_arg(&cmd, "device");
+    cmd_arg(&cmd, "wifi");
+    cmd_arg(&cmd, "connect");
+    cmd_arg(&cmd, answers->wifi_ssid);
+    if (*answers->wifi_password) {
+        cmd_arg(&cmd, "password");
+        cmd_arg(&cmd, answers->wifi_password);
+    }
+    cmd.quiet = true;
+    int result = cmd_run(&cmd);
+    cmd_free(&cmd);
+    sleep(2);
+
+    if (!result || !check_internet_connection()) {
+        LOG_ERROR("Failed to connect to WiFi network %s", answers->wifi_ssid);
+        return 0;
+    }
     return 1;
 }
 
-static int setup_common_configs(const char *username) {
-    char cmd[4096];
-
-    create_directory("/mnt/usr/share/wallpapers", 0755);
-    system("cp /usr/share/wallpapers/wall1.jpg /mnt/usr/share/wallpapers/wall1.jpg");
+static int step_deploy_image(const Install_Context *ctx) {
+    Disk_Layout *layout = ctx->layout;
+    const Image_Header *header = &ctx->image->header;
+    int uefi = is_uefi_system();
+    if ((int)header->gpt != uefi) {
+        show_message(uefi ? "Image was captured on a BIOS system" : "Image was captured on a UEFI system");
+        return 0;
+    }
 
-    create_directory("/mnt/usr/share/tonarchy", 0755);
-    system("cp /usr/share/tonarchy/favicon.png /mnt/usr/share/tonarchy/favicon.png");
+    char dev[64];
+    snprintf(dev, sizeof(dev), "/dev/%s", ctx->disk);
+    LOG_INFO("Deploying %s to %s", ctx->image->path, dev);
 
-    create_directory("/mnt/usr/share/themes", 0755);
-    system("cp -r /usr/share/tonarchy/Tokyonight-Dark /mnt/usr/share/themes/");
+    if (!disk_probe(layout, dev)) {
+        show_message("Failed to read disk geometry");
+        return 0;
+    }
+    snprintf(layout->disk, sizeof(layout->disk), "%s", ctx->disk);
+    layout->root_fs = root_fs_find(header->root_fs);
+    layout->swap.kind = (Swap_Kind)header->swap_kind;
+    layout->swap.size_bytes = header->swap_size;
+    layout->swap.hibernate = header->hibernate;
+    layout->swap.resume_offset = header->resume_offset;
+    snprintf(layout->swap.reason, sizeof(layout->swap.reason), "from image");
+
+    if (!disk_plan(layout, uefi)) {
+        show_message("Disk is too small");
+        return 0;
+    }
 
-    LOG_INFO("Setting up Firefox profile");
-    snprintf(cmd, sizeof(cmd), "/mnt/home/%s/.config/firefox", username);
-    create_directory(cmd, 0755);
+    layout->discarded = disk_discard(layout, ctx->secure_discard);
 
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/firefox/default-release/* /mnt/home/%s/.config/firefox/", username);
-    system(cmd);
+    if (!disk_write_table(layout)) {
+        show_message("Failed to create partitions");
+        return 0;
+    }
 
-    snprintf(cmd, sizeof(cmd), "arch-chroot /mnt chown -R %s:%s /home/%s/.config/firefox", username, username, username);
-    system(cmd);
+    if (!image_deploy(ctx->image, layout)) {
+        show_message("Failed to write image");
+        return 0;
+    }
 
-    create_directory("/mnt/usr/lib/firefox/distribution", 0755);
-    system("cp /usr/share/tonarchy/firefox-policies/policies.json /mnt/usr/lib/firefox/distribution/");
+    if (!chroot_session_begin()) {
+        show_message("Failed to set up chroot");
+        return 0;
+    }
 
-    create_directory("/mnt/usr/share/applications", 0755);
-    write_file("/mnt/usr/share/applications/firefox.desktop",
-        "[Desktop Entry]\n"
-        "Name=Firefox\n"
-        "GenericName=Web Browser\n"
-        "Exec=sh -c 'firefox --profile $HOME/.config/firefox'\n"
-        "Type=Application\n"
-        "Icon=firefox\n"
-        "Categories=Network;WebBrowser;\n"
-        "MimeType=text/html;text/xml;application/xhtml+xml;application/vnd.mozilla.xul+xml;\n"
+    CHECK_OR_FAIL(
+        write_file(TARGET_PATH("/etc/machine-id"), "uninitialized\n"),
+        "Failed to reset machine-id"
     );
+    unlink(TARGET_PATH("/var/lib/systemd/random-seed"));
+    return 1;
+}
 
-    snprintf(cmd, sizeof(cmd), "/mnt/home/%s/.config", username);
-    create_directory(cmd, 0755);
-
-    snprintf(cmd, sizeof(cmd), "arch-chroot /mnt chown -R %s:%s /home/%s/.config", username, username, username);
-    system(cmd);
-
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/alacritty /mnt/home/%s/.config/alacritty", username);
-    system(cmd);
-
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/rofi /mnt/home/%s/.config/rofi", username);
-    system(cmd);
-
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/fastfetch /mnt/home/%s/.config/fastfetch", username);
-    system(cmd);
-
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/picom /mnt/home/%s/.config/picom", username);
-    system(cmd);
-
-    char nvim_path[256];
-    snprintf(nvim_path, sizeof(nvim_path), "/home/%s/.config/nvim", username);
-    git_clone_as_user(username, "https://github.com/tonybanters/nvim", nvim_path);
+static int step_deploy_locale(const Install_Context *ctx) {
+    CHECK_OR_FAIL(
+        chroot_exec_fmt("ln -sf /usr/share/zoneinfo/%s /etc/localtime", ctx->timezone),
+        "Failed to configure timezone"
+    );
 
-    snprintf(cmd, sizeof(cmd), "arch-chroot /mnt chown -R %s:%s /home/%s/.config", username, username, username);
-    system(cmd);
+    CHECK_OR_FAIL(
+        write_file_fmt(TARGET_PATH("/etc/vconsole.conf"), "KEYMAP=%s\n", ctx->keyboard),
+        "Failed to write vconsole.conf"
+    );
 
     return 1;
 }
 
-static int setup_autologin(const char *username) {
-    char autologin_exec[512];
-    snprintf(autologin_exec, sizeof(autologin_exec),
-             "ExecStart=-/sbin/agetty -o \"-p -f -- \\\\u\" --noclear --autologin %s %%I $TERM",
-             username);
-
-    Config_Entry autologin_entries[] = {
-        {"[Service]", ""},
-        {"ExecStart=", ""},
-        {autologin_exec, ""}
-    };
+static int step_deploy_users(const Install_Context *ctx) {
+    const char *captured = ctx->image->header.username;
 
-    Systemd_Override autologin = {
-        "getty@tty1.service",
-        "getty@tty1.service.d",
-        "autologin.conf",
-        autologin_entries,
-        3
-    };
+    if (strcmp(captured, ctx->username) != 0) {
+        LOG_INFO("Renaming user %s to %s", captured, ctx->username);
+        char *home = format_alloc("/home/%s", ctx->username);
+        int renamed = home &&
+            chroot_run_args("usermod", "-l", ctx->username, "-d", home, "-m", captured, NULL) &&
+            chroot_run_args("groupmod", "-n", ctx->username, captured, NULL);
+        free(home);
+        CHECK_OR_FAIL(renamed, "Failed to rename user");
 
-    if (!setup_systemd_override(&autologin)) {
-        LOG_ERROR("Failed to setup autologin");
-        return 0;
+        if (!setup_autologin(ctx->username)) {
+            return 0;
+        }
     }
 
-    return 1;
+    return set_passwords(ctx->username, ctx->password, ctx->password_hashed);
 }
 
-static const char *BASHRC_CONTENT =
-    "export PATH=\"$HOME/.local/bin:$PATH\"\n"
-    "export EDITOR=\"nvim\"\n"
-    "\n"
-    "alias ls='ls --color=auto'\n"
-    "alias la='ls -a'\n"
-    "alias ll='ls -la'\n"
-    "alias ..='cd ..'\n"
-    "alias ...='cd ../..'\n"
-    "alias grep='grep --color=auto'\n"
-    "\n"
-    "export PS1=\"\\[\\e[38;5;75m\\]\\u@\\h \\[\\e[38;5;113m\\]\\w \\[\\e[38;5;189m\\]\\$ \\[\\e[0m\\]\"\n"
-    "\n"
-    "fastfetch\n";
+static const Install_Step XFCE_STEPS[] = {
+    {"partition",  "Partitioning disk",           step_partition,      {NULL},                          "Failed to partition disk"},
+    {"packages",   "Installing system packages",  step_packages,       {"partition"},                   "Failed to install packages"},
+    {"fstab",      "Generating fstab",            step_fstab,          {"packages"},                    "Failed to configure system"},
+    {"locale",     "Configuring locale",          step_locale,         {"packages"},                    "Failed to configure system"},
+    {"hostname",   "Configuring hostname",        step_hostname,       {"packages"},                    "Failed to configure system"},
+    {"users",      "Creating user",               step_users,          {"packages"},                    "Failed to configure system"},
+    {"services",   "Enabling services",           step_services,       {"packages"},                    "Failed to configure system"},
+    {"storage",    "Tuning storage",              step_storage,        {"packages", "locale"},          "Failed to configure system"},
+    {"bootloader", "Installing bootloader",       step_bootloader,     {"fstab", "storage"},            "Failed to install bootloader"},
+    {"configs",    "Copying user configs",        step_common_configs, {"users"},                       "Failed to set up user configs"},
+    {"desktop",    "Configuring XFCE",            step_xfce,           {"configs"},                     "Failed to configure XFCE"},
+};
 
-static const char *BASH_PROFILE_CONTENT =
-    "if [ -z $DISPLAY ] && [ $XDG_VTNR = 1 ]; then\n"
-    "  exec startx\n"
-    "fi\n";
+static const Install_Step OXWM_STEPS[] = {
+    {"partition",  "Partitioning disk",           step_partition,      {NULL},                          "Failed to partition disk"},
+    {"packages",   "Installing system packages",  step_packages,       {"partition"},                   "Failed to install packages"},
+    {"fstab",      "Generating fstab",            step_fstab,          {"packages"},                    "Failed to configure system"},
+    {"locale",     "Configuring locale",          step_locale,         {"packages"},                    "Failed to configure system"},
+    {"hostname",   "Configuring hostname",        step_hostname,       {"packages"},                    "Failed to configure system"},
+    {"users",      "Creating user",               step_users,          {"packages"},                    "Failed to configure system"},
+    {"services",   "Enabling services",           step_services,       {"packages"},                    "Failed to configure system"},
+    {"storage",    "Tuning storage",              step_storage,        {"packages", "locale"},          "Failed to configure system"},
+    {"bootloader", "Installing bootloader",       step_bootloader,     {"fstab", "storage"},            "Failed to install bootloader"},
+    {"oxwm",       "Building OXWM from source",   step_oxwm_build,     {"users"},                       "Failed to install OXWM"},
+    {"configs",    "Copying user configs",        step_common_configs, {"users"},                       "Failed to set up user configs"},
+    {"desktop",    "Configuring OXWM",            step_oxwm,           {"configs", "oxwm"},             "Failed to configure OXWM"},
+};
 
-static int configure_xfce(const char *username) {
-    char cmd[4096];
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
+static const Install_Step DEPLOY_STEPS[] = {
+    {"image",      "Writing golden image",        step_deploy_image,   {NULL},                          "Failed to deploy image"},
+    {"fstab",      "Generating fstab",            step_fstab,          {"image"},                       "Failed to configure system"},
+    {"locale",     "Configuring timezone",        step_deploy_locale,  {"image"},                       "Failed to configure system"},
+    {"hostname",   "Configuring hostname",        step_hostname,       {"image"},                       "Failed to configure system"},
+    {"users",      "Configuring user",            step_deploy_users,   {"image"},                       "Failed to configure system"},
+    {"bootloader", "Installing bootloader",       step_bootloader,     {"fstab"},                       "Failed to install bootloader"},
+};
 
-    clear_screen();
-    draw_logo(cols);
+static void target_release(const Disk_Layout *layout) {
+    const Partition *swap_part = disk_find_partition(layout, PART_SWAP);
+    if (swap_part && !cmd_run_args("swapoff", swap_part->path, NULL)) {
+        LOG_WARN("Failed to disable swap on %s", swap_part->path);
+    }
+    sync_target();
+    if (!cmd_run_args("umount", "-R", target_root(), NULL)) {
+        LOG_WARN("Failed to unmount %s", target_root());
+    }
+}
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[37mConfiguring XFCE...\033[0m", 10, logo_start);
-    fflush(stdout);
+static int install_target(const char *disk, const Install_Context *base, int level, bool hibernate) {
+    LOG_INFO("Installing to %s (root %s)", disk, target_root());
+
+    char disk_dev[80];
+    snprintf(disk_dev, sizeof(disk_dev), "/dev/%s", disk);
+    Device_Profile disk_profile;
+    device_profile_probe(&disk_profile, disk_dev);
+
+    Swap_Plan swap;
+    plan_swap(&swap, &disk_profile, base->root_fs, hibernate);
+    char *packages = swap.kind == SWAP_ZRAM && !package_in_list(base->packages, "zram-generator")
+        ? format_alloc("%s zram-generator", base->packages)
+        : strdup(base->packages);
+    if (packages && !is_uefi_system() && !package_in_list(packages, "grub")) {
+        char *with_grub = format_alloc("%s grub", packages);
+        free(packages);
+        packages = with_grub;
+    }
+    if (!packages) {
+        LOG_ERROR("Failed to build package list");
+        return 0;
+    }
 
-    setup_common_configs(username);
+    Disk_Layout layout;
+    memset(&layout, 0, sizeof(layout));
+
+    Install_Context ctx = *base;
+    ctx.disk = disk;
+    ctx.layout = &layout;
+    ctx.swap = &swap;
+    ctx.packages = packages;
+
+    int installed;
+    long install_span = trace_begin("install", ctx.image ? "deploy image"
+                                    : level == BEGINNER ? "install beginner" : "install oxidized");
+    if (ctx.image) {
+        installed = run_install_steps(DEPLOY_STEPS, sizeof(DEPLOY_STEPS) / sizeof(DEPLOY_STEPS[0]), &ctx, INSTALL_WORKERS);
+    } else if (level == BEGINNER) {
+        installed = run_install_steps(XFCE_STEPS, sizeof(XFCE_STEPS) / sizeof(XFCE_STEPS[0]), &ctx, INSTALL_WORKERS);
+    } else {
+        installed = run_install_steps(OXWM_STEPS, sizeof(OXWM_STEPS) / sizeof(OXWM_STEPS[0]), &ctx, INSTALL_WORKERS);
+    }
+    chroot_session_end();
+    trace_end(install_span, installed ? 0 : 1, 0);
+    free(packages);
+
+    Trace_Span slowest[TRACE_SUMMARY_SPANS];
+    size_t slowest_count = trace_slowest(slowest, TRACE_SUMMARY_SPANS);
+    LOG_INFO("Slowest spans:");
+    for (size_t i = 0; i < slowest_count; i++) {
+        LOG_INFO("  %8.2fs  %-7s %s", (double)(slowest[i].end_ns - slowest[i].start_ns) / 1e9,
+                 slowest[i].category, slowest[i].name);
+    }
 
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/xfce4 /mnt/home/%s/.config/xfce4", username);
-    system(cmd);
+    if (!installed) {
+        char trace_path[PATH_MAX];
+        snprintf(trace_path, sizeof(trace_path), "/tmp/tonarchy-install%s%s.trace.json",
+                 ctx.batch ? "-" : "", ctx.batch ? disk : "");
+        trace_write(trace_path);
+        if (ctx.batch) target_release(&layout);
+        return 0;
+    }
 
-    snprintf(cmd, sizeof(cmd), "arch-chroot /mnt chown -R %s:%s /home/%s/.config/xfce4", username, username, username);
-    system(cmd);
+    trace_write(TARGET_PATH("/var/log/tonarchy-install.trace.json"));
+    logger_flush();
+    cmd_run_args("cp", install_log_path, TARGET_PATH("/var/log/tonarchy-install.log"), NULL);
 
-    Dotfile dotfiles[] = {
-        { ".xinitrc", "exec startxfce4\n", 0755 },
-        { ".bash_profile", BASH_PROFILE_CONTENT, 0644 },
-        { ".bashrc", BASHRC_CONTENT, 0644 }
-    };
+    if (ctx.batch || ctx.capture_path) target_release(&layout);
 
-    for (size_t i = 0; i < sizeof(dotfiles) / sizeof(dotfiles[0]); i++) {
-        if (!create_user_dotfile(username, &dotfiles[i])) {
-            LOG_ERROR("Failed to create dotfile: %s", dotfiles[i].filename);
+    if (ctx.capture_path) {
+        show_message("Capturing golden image...");
+        if (!image_capture(&layout, ctx.capture_path, ctx.username, level)) {
+            show_message("Failed to capture golden image");
             return 0;
         }
     }
-
-    if (!setup_autologin(username)) {
-        return 0;
-    }
-
     return 1;
 }
 
-static int configure_oxwm(const char *username) {
-    char cmd[4096];
-    int rows, cols;
-    get_terminal_size(&rows, &cols);
-
-    clear_screen();
-    draw_logo(cols);
+static void run_target_child(Target_Status *status, const Install_Context *base, int level, bool hibernate) {
+    target_status = status;
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[37mConfiguring OXWM...\033[0m", 10, logo_start);
-    printf("\033[%d;%dH\033[37mCloning and building from source...\033[0m", 11, logo_start);
-    fflush(stdout);
+    snprintf(install_log_path, sizeof(install_log_path), "/tmp/tonarchy-install-%s.log", status->disk);
+    logger_reopen(install_log_path);
 
-    LOG_INFO("Starting OXWM installation for user: %s", username);
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/%s", CHROOT_PATH, status->disk);
+    target_set_root(root);
 
-    char oxwm_path[256];
-    snprintf(oxwm_path, sizeof(oxwm_path), "/home/%s/oxwm", username);
+    int ok = create_directory(root, 0755) && install_target(status->disk, base, level, hibernate);
+    LOG_INFO("Target %s %s", status->disk, ok ? "installed" : "failed");
+    logger_close();
+    _exit(ok ? 0 : 1);
+}
 
-    if (!git_clone_as_user(username, "https://github.com/tonybanters/oxwm", oxwm_path)) {
-        LOG_ERROR("Failed to clone oxwm");
-        show_message("Failed to clone OXWM");
-        return 0;
+static void draw_target_board(const Target_Status *targets, size_t count, bool full) {
+    int rows, cols;
+    get_terminal_size(&rows, &cols);
+    int logo_start = (cols - 70) / 2;
+    double now = monotonic_seconds();
+
+    pthread_mutex_lock(&ui_lock);
+    if (full) {
+        clear_screen();
+        draw_logo(cols);
+        printf(ANSI_CURSOR_POS ANSI_WHITE "Installing Tonarchy on %zu disks..." ANSI_RESET, 10, logo_start, count);
+        printf(ANSI_CURSOR_POS ANSI_GRAY "(Logging to /tmp/tonarchy-install-<disk>.log)" ANSI_RESET,
+               13 + (int)count, logo_start);
     }
 
-    if (!chroot_exec_fmt("cd %s && cargo build --release", oxwm_path)) {
-        LOG_ERROR("Failed to build oxwm");
-        show_message("Failed to build OXWM");
-        return 0;
+    for (size_t i = 0; i < count; i++) {
+        const Target_Status *t = &targets[i];
+        printf(ANSI_CURSOR_POS ANSI_CLEAR_LINE, 12 + (int)i, logo_start + 2);
+        if (t->finished && t->failed) {
+            printf(ANSI_RED "[!] %-10s failed: %.50s" ANSI_RESET, t->disk, t->status);
+        } else if (t->finished) {
+            printf(ANSI_GREEN "[+] %-10s " ANSI_GRAY "done (%.0fs)" ANSI_RESET, t->disk, t->elapsed);
+        } else {
+            printf(ANSI_YELLOW "[*] %-10s %2zu/%-2zu %.32s" ANSI_GRAY " %5.0fs %.24s" ANSI_RESET,
+                   t->disk, t->steps_done, t->steps_total, t->step, now - t->started, t->status);
+        }
     }
+    fflush(stdout);
+    pthread_mutex_unlock(&ui_lock);
+}
 
-    if (!chroot_exec_fmt("cp %s/target/release/oxwm /usr/bin/oxwm", oxwm_path)) {
-        LOG_ERROR("Failed to install oxwm binary");
-        show_message("Failed to install OXWM");
-        return 0;
+static size_t run_targets(char disks[][64], size_t count, const Install_Context *base, int level, bool hibernate) {
+    Target_Status *targets = mmap(NULL, sizeof(*targets) * count, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (targets == MAP_FAILED) {
+        LOG_ERROR("Failed to allocate target status: %s", strerror(errno));
+        show_message("Failed to start installs");
+        return count;
     }
+    memset(targets, 0, sizeof(*targets) * count);
 
-    chroot_exec("chmod 755 /usr/bin/oxwm");
-
-    setup_common_configs(username);
-
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/gtk-3.0 /mnt/home/%s/.config/gtk-3.0", username);
-    system(cmd);
-
-    snprintf(cmd, sizeof(cmd), "cp -r /usr/share/tonarchy/gtk-4.0 /mnt/home/%s/.config/gtk-4.0", username);
-    system(cmd);
+    logger_flush();
+    fflush(stdout);
 
-    snprintf(cmd, sizeof(cmd), "cp /usr/share/tonarchy/gtkrc-2.0 /mnt/home/%s/.gtkrc-2.0", username);
-    system(cmd);
+    size_t running = 0;
+    for (size_t i = 0; i < count; i++) {
+        Target_Status *t = &targets[i];
+        snprintf(t->disk, sizeof(t->disk), "%s", disks[i]);
+        t->started = monotonic_seconds();
 
-    snprintf(cmd, sizeof(cmd), "/mnt/home/%s/.config/oxwm", username);
-    create_directory(cmd, 0755);
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_target_child(t, base, level, hibernate);
+        }
+        if (pid < 0) {
+            LOG_ERROR("Failed to start install for %s: %s", t->disk, strerror(errno));
+            snprintf(t->status, sizeof(t->status), "could not start");
+            t->finished = true;
+            t->failed = true;
+            continue;
+        }
+        t->pid = pid;
+        running++;
+        LOG_INFO("Installing to %s in process %d", t->disk, (int)pid);
+    }
 
-    snprintf(cmd, sizeof(cmd), "cp /mnt%s/templates/tonarchy-config.lua /mnt/home/%s/.config/oxwm/config.lua", oxwm_path, username);
-    system(cmd);
+    draw_target_board(targets, count, true);
+    struct timespec interval = { 0, TARGET_BOARD_INTERVAL_MS * 1000000L };
+    while (running > 0) {
+        int wstatus;
+        pid_t pid;
+        while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+            for (size_t i = 0; i < count; i++) {
+                Target_Status *t = &targets[i];
+                if (t->pid != pid || t->finished) continue;
+                t->finished = true;
+                t->failed = !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0;
+                t->elapsed = monotonic_seconds() - t->started;
+                running--;
+                if (t->failed) {
+                    LOG_ERROR("Install on %s failed after %.1fs (see /tmp/tonarchy-install-%s.log)",
+                              t->disk, t->elapsed, t->disk);
+                } else {
+                    LOG_INFO("Install on %s finished in %.1fs", t->disk, t->elapsed);
+                }
+            }
+        }
+        draw_target_board(targets, count, false);
+        if (running > 0) nanosleep(&interval, NULL);
+    }
 
-    snprintf(cmd, sizeof(cmd), "arch-chroot /mnt chown -R %s:%s /home/%s/.config", username, username, username);
-    system(cmd);
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (targets[i].failed) failed++;
+    }
+    munmap(targets, sizeof(*targets) * count);
+    return failed;
+}
 
-    Dotfile dotfiles[] = {
-        { ".xinitrc", "export GTK_THEME=Adwaita-dark\nxset r rate 200 35 &\npicom --config ~/.config/picom/picom.conf &\nxwallpaper --zoom /usr/share/wallpapers/wall1.jpg &\nexec oxwm\n", 0755 },
-        { ".bash_profile", BASH_PROFILE_CONTENT, 0644 },
-        { ".bashrc", BASHRC_CONTENT, 0644 }
-    };
+static int check_image_options(const char *image_path, const char *capture_path, size_t disk_count,
+                               Golden_Image *image) {
+    if (image_path && capture_path) {
+        LOG_ERROR("Capturing and deploying an image cannot be combined");
+        return 0;
+    }
+    if (capture_path && disk_count > 1) {
+        LOG_ERROR("An image can only be captured from a single disk install");
+        return 0;
+    }
 
-    for (size_t i = 0; i < sizeof(dotfiles) / sizeof(dotfiles[0]); i++) {
-        if (!create_user_dotfile(username, &dotfiles[i])) {
-            LOG_ERROR("Failed to create dotfile: %s", dotfiles[i].filename);
+    if (image_path) {
+        image->path = image_path;
+        if (!image_read_header(image_path, &image->header)) {
             return 0;
         }
+        LOG_INFO("Deploying %s image of user %s from %s", image->header.root_fs,
+                 image->header.username, image_path);
     }
 
-    if (!setup_autologin(username)) {
-        return 0;
+    if (capture_path) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", capture_path);
+        char *slash = strrchr(dir, '/');
+        if (!slash) {
+            snprintf(dir, sizeof(dir), ".");
+        } else {
+            slash[slash == dir ? 1 : 0] = '\0';
+        }
+        if (access(dir, W_OK) != 0) {
+            LOG_ERROR("Cannot write image to %s: %s", dir, strerror(errno));
+            return 0;
+        }
     }
-
-    LOG_INFO("OXWM installation completed successfully");
-    show_message("OXWM installed successfully!");
     return 1;
 }
 
-int main(void) {
-    logger_init("/tmp/tonarchy-install.log");
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+    if (argc == 2 && strcmp(argv[1], "--list-packages") == 0) {
+        return print_package_set() ? 0 : 1;
+    }
+
+    boot_marks = kernel_cmdline_has(BOOT_MARK_PARAM);
+    logger_init(install_log_path);
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--rank-mirrors") == 0) {
+        int ranked = print_mirror_ranking(argv[2], argc == 4 ? argv[3] : NULL);
+        logger_close();
+        return ranked ? 0 : 1;
+    }
     LOG_INFO("Tonarchy installer started");
 
-    if (!setup_wifi_if_needed()) {
+    bool secure_discard = false;
+    bool hibernate = false;
+    const char *config_path = NULL;
+    const char *image_path = NULL;
+    const char *capture_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--secure-discard") == 0) {
+            secure_discard = true;
+        } else if (strcmp(argv[i], "--hibernate") == 0) {
+            hibernate = true;
+        } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (strcmp(argv[i], "--deploy") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else {
+            LOG_WARN("Ignoring unknown argument: %s", argv[i]);
+        }
+    }
+
+    Answer_File answers;
+    const Answer_File *unattended = NULL;
+    if (config_path) {
+        int answers_ok = answer_file_load(config_path, &answers);
+        answers_ok = answer_file_validate(&answers) && answers_ok;
+        if (!answers_ok) {
+            logger_flush();
+            fprintf(stderr, "Invalid answer file %s, see /tmp/tonarchy-install.log\n", config_path);
+            logger_close();
+            return 1;
+        }
+        unattended = &answers;
+        secure_discard = secure_discard || answers.secure_discard;
+        hibernate = hibernate || answers.hibernate;
+        if (answers.image[0]) image_path = answers.image;
+        if (answers.capture[0]) capture_path = answers.capture;
+        LOG_INFO("Unattended install: mode=%s disk=%s filesystem=%s",
+                 answers.mode, answers.disk, answers.filesystem);
+    }
+
+    char disks[MAX_TARGETS][64];
+    size_t disk_count = 1;
+    if (unattended) {
+        disk_count = split_disk_list(answers.disk, disks, MAX_TARGETS);
+    }
+
+    Golden_Image image = { .path = NULL };
+    if (!check_image_options(image_path, capture_path, disk_count, &image)) {
+        logger_flush();
+        fprintf(stderr, "Invalid image options, see %s\n", install_log_path);
         logger_close();
         return 1;
     }
 
+    bool online = true;
+    if (!image.path) {
+        keyring_start();
+        int local = 0;
+        if (offline_repo_available()) {
+            online = unattended && *answers.wifi_ssid
+                ? connect_wifi_unattended(unattended)
+                : check_internet_connection();
+            local = offline_repo_enable(online);
+        }
+        if (!local) {
+            if (unattended ? !connect_wifi_unattended(unattended) : !setup_wifi_if_needed()) {
+                logger_close();
+                return 1;
+            }
+            online = true;
+            prefetch_start();
+        }
+    }
+
     char username[256] = "";
     char password[256] = "";
     char confirmed_password[256] = "";
@@ -1552,74 +6230,182 @@ int main(void) {
     char keyboard[256] = "";
     char timezone[256] = "";
 
-    if (!get_form_input(username, password, confirmed_password, hostname, keyboard, timezone)) {
+    if (unattended) {
+        const char *secret = *answers.password_hash ? answers.password_hash : answers.password;
+        memcpy(username, answers.username, sizeof(username));
+        memcpy(password, secret, strlen(secret) + 1);
+        memcpy(hostname, answers.hostname, sizeof(hostname));
+        memcpy(keyboard, answers.keyboard, sizeof(keyboard));
+        memcpy(timezone, answers.timezone, sizeof(timezone));
+    } else if (!get_form_input(username, password, confirmed_password, hostname, keyboard, timezone)) {
+        prefetch_cancel();
         logger_close();
         return 1;
     }
 
+    if (!image.path) {
+        mirrors_set_timezone(timezone);
+    }
+
     const char *levels[] = {
         "Beginner (XFCE desktop - perfect for starters)",
         "Oxidized (OXWM Beta)"
     };
 
-    int level = select_from_menu(levels, 2);
+    int level = image.path ? (int)image.header.level
+        : unattended ? (strcmp(answers.mode, "oxidized") == 0 ? OXIDIZED : BEGINNER)
+        : select_from_menu(levels, 2);
     if (level < 0) {
         LOG_INFO("Installation cancelled by user at level selection");
+        prefetch_cancel();
         logger_close();
         return 1;
     }
 
     LOG_INFO("Installation level selected: %d", level);
-
-    char disk[64] = "";
-    if (!select_disk(disk)) {
-        LOG_INFO("Installation cancelled by user at disk selection");
+    if (level == OXIDIZED && !online) {
+        LOG_ERROR("Oxidized mode builds OXWM from source and needs a network connection");
+        show_message("Oxidized mode needs a network connection");
         logger_close();
         return 1;
     }
 
-    LOG_INFO("Selected disk: %s", disk);
+    const char *fs_labels[sizeof(ROOT_FILESYSTEMS) / sizeof(ROOT_FILESYSTEMS[0])];
+    for (size_t i = 0; i < sizeof(ROOT_FILESYSTEMS) / sizeof(ROOT_FILESYSTEMS[0]); i++) {
+        fs_labels[i] = ROOT_FILESYSTEMS[i].label;
+    }
 
-    if (level == BEGINNER) {
-        CHECK_OR_FAIL(partition_disk(disk), "Failed to partition disk");
-        CHECK_OR_FAIL(install_packages_impl(XFCE_PACKAGES), "Failed to install packages");
-        CHECK_OR_FAIL(configure_system_impl(username, password, hostname, keyboard, timezone, disk, 0), "Failed to configure system");
-        CHECK_OR_FAIL(install_bootloader(disk), "Failed to install bootloader");
-        configure_xfce(username);
+    const Root_Fs *root_fs;
+    if (image.path) {
+        root_fs = root_fs_find(image.header.root_fs);
+    } else if (unattended) {
+        root_fs = root_fs_find(answers.filesystem);
     } else {
-        CHECK_OR_FAIL(partition_disk(disk), "Failed to partition disk");
-        CHECK_OR_FAIL(install_packages_impl(OXWM_PACKAGES), "Failed to install packages");
-        CHECK_OR_FAIL(configure_system_impl(username, password, hostname, keyboard, timezone, disk, 0), "Failed to configure system");
-        CHECK_OR_FAIL(install_bootloader(disk), "Failed to install bootloader");
-        configure_oxwm(username);
+        int fs_choice = select_from_menu(fs_labels, (int)(sizeof(fs_labels) / sizeof(fs_labels[0])));
+        if (fs_choice < 0) {
+            LOG_INFO("Installation cancelled by user at filesystem selection");
+            prefetch_cancel();
+            logger_close();
+            return 1;
+        }
+        root_fs = &ROOT_FILESYSTEMS[fs_choice];
+    }
+    LOG_INFO("Root filesystem selected: %s", root_fs->name);
+
+    const char *base_packages = level == BEGINNER ? XFCE_PACKAGES : OXWM_PACKAGES;
+    char *packages = root_fs->package
+        ? format_alloc("%s %s", base_packages, root_fs->package)
+        : strdup(base_packages);
+    if (!packages) {
+        LOG_ERROR("Failed to build package list");
+        prefetch_cancel();
+        logger_close();
+        return 1;
     }
 
-    system("cp /tmp/tonarchy-install.log /mnt/var/log/tonarchy-install.log");
+    char *prefetch_packages = format_alloc("%s%s%s", packages,
+        package_in_list(packages, "zram-generator") ? "" : " zram-generator",
+        is_uefi_system() || package_in_list(packages, "grub") ? "" : " grub");
+    prefetch_select(prefetch_packages ? prefetch_packages : packages);
+
+    if (!unattended && !select_disk(disks[0])) {
+        LOG_INFO("Installation cancelled by user at disk selection");
+        prefetch_cancel();
+        logger_close();
+        return 1;
+    }
+
+    for (size_t i = 0; i < disk_count; i++) {
+        LOG_INFO("Selected disk: %s", disks[i]);
+    }
+
+    Install_Context base = {
+        .username = username,
+        .password = password,
+        .password_hashed = unattended && *answers.password_hash,
+        .hostname = hostname,
+        .keyboard = keyboard,
+        .timezone = timezone,
+        .root_fs = root_fs,
+        .secure_discard = secure_discard,
+        .batch = disk_count > 1,
+        .packages = packages,
+        .image = image.path ? &image : NULL,
+        .capture_path = capture_path
+    };
 
-    clear_screen();
     int rows, cols;
-    get_terminal_size(&rows, &cols);
-    draw_logo(cols);
+    int logo_start;
+    if (disk_count > 1) {
+        bool download = !image.path && !offline_pacman_conf;
+        if (download) {
+            show_message("Downloading packages once for all disks...");
+        }
+        if (download && !prefetch_wait()) {
+            LOG_WARN("No shared package cache, every disk downloads its own packages");
+        }
+        if (!image.path) {
+            keyring_wait();
+        }
 
-    int logo_start = (cols - 70) / 2;
-    printf("\033[%d;%dH\033[1;32mInstallation complete!\033[0m\n", 10, logo_start);
-    printf("\033[%d;%dH\033[37mPress Enter to reboot...\033[0m\n", 12, logo_start);
+        size_t failed = run_targets(disks, disk_count, &base, level, hibernate);
+        if (failed == disk_count) {
+            logger_close();
+            return 1;
+        }
+
+        get_terminal_size(&rows, &cols);
+        logo_start = (cols - 70) / 2;
+        printf(ANSI_CURSOR_POS "\033[1;%dmInstalled %zu of %zu disks\033[0m", 15 + (int)disk_count, logo_start,
+               failed ? 33 : 32, disk_count - failed, disk_count);
+        printf(ANSI_CURSOR_POS ANSI_WHITE "Press Enter to reboot..." ANSI_RESET, 17 + (int)disk_count, logo_start);
+    } else {
+        int installed = install_target(disks[0], &base, level, hibernate);
+        if (!installed) {
+            logger_close();
+            return 1;
+        }
+
+        Trace_Span slowest[TRACE_SUMMARY_SPANS];
+        size_t slowest_count = trace_slowest(slowest, TRACE_SUMMARY_SPANS);
+
+        clear_screen();
+        get_terminal_size(&rows, &cols);
+        draw_logo(cols);
+
+        logo_start = (cols - 70) / 2;
+        printf("\033[%d;%dH\033[1;32mInstallation complete!\033[0m\n", 10, logo_start);
+        printf("\033[%d;%dH\033[37mPress Enter to reboot...\033[0m\n", 12, logo_start);
+
+        printf(ANSI_CURSOR_POS ANSI_GRAY "Slowest steps (trace in /var/log/tonarchy-install.trace.json):" ANSI_RESET, 14, logo_start);
+        for (size_t i = 0; i < slowest_count && 15 + (int)i < rows; i++) {
+            printf(ANSI_CURSOR_POS ANSI_GRAY "%8.2fs  %.58s" ANSI_RESET, 15 + (int)i, logo_start,
+                   (double)(slowest[i].end_ns - slowest[i].start_ns) / 1e9, slowest[i].name);
+        }
+    }
     fflush(stdout);
 
+    if (unattended && !answers.reboot) {
+        LOG_INFO("Tonarchy installer finished - reboot disabled by answer file");
+        logger_close();
+        return 0;
+    }
+
     char c;
     enable_raw_mode();
-    while (read(STDIN_FILENO, &c, 1) == 1) {
+    while (!unattended && read(STDIN_FILENO, &c, 1) == 1) {
         if (c == '\r' || c == '\n') {
             break;
         }
     }
     disable_raw_mode();
 
-    LOG_INFO("Tonarchy installer finished - scheduling reboot");
-    logger_close();
+    LOG_INFO("Tonarchy installer finished - rebooting");
 
     sync();
-    system("sleep 2 && reboot &");
+    sleep(2);
+    int rebooting = cmd_run_args("reboot", NULL);
+    logger_close();
 
-    exit(0);
+    exit(rebooting ? 0 : 1);
 }
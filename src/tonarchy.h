@@ -1,10 +1,12 @@
 #ifndef TONARCHY_H
 #define TONARCHY_H
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 500
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,9 +21,92 @@
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <spawn.h>
+#include <limits.h>
+#include <sys/mount.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/random.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 
 #define CHROOT_PATH "/mnt"
+#define TARGET_PATH(...) target_path((char[PATH_MAX]){0}, PATH_MAX, __VA_ARGS__)
 #define MAX_CMD_SIZE 4096
+#define FORM_FIELD_SIZE 256
+#define MAX_STEP_DEPS 4
+#define INSTALL_WORKERS 4
+#define MAX_TARGETS 8
+#define TARGET_BOARD_INTERVAL_MS 250
+#define COPY_WORKERS 4
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX 512
+#define LOG_BATCH_SIZE 65536
+#define LOG_FLUSH_INTERVAL_MS 10
+#define TRACE_SUMMARY_SPANS 8
+#define PACSTRAP_PROGRESS_INTERVAL_MS 500
+#define MAX_PARTITIONS 8
+#define GPT_ENTRY_COUNT 128
+#define GPT_ENTRY_SIZE 128
+#define PART_ALIGN_BYTES (1024ull * 1024)
+#define PART_WIPE_BYTES (1024ull * 1024)
+#define MAX_OPTIMAL_IO (16u * 1024 * 1024)
+#define EFI_PART_SIZE (1024ull * 1024 * 1024)
+#define ZRAM_MAX_RAM (16ull * 1024 * 1024 * 1024)
+#define ZRAM_MAX_SIZE (8ull * 1024 * 1024 * 1024)
+#define SWAPFILE_MAX_SIZE (8ull * 1024 * 1024 * 1024)
+#define IMAGE_MAGIC "TONIMG1"
+#define IMAGE_VERSION 1
+#define IMAGE_CHUNK_BYTES (4u * 1024 * 1024)
+#define IMAGE_PART_END UINT32_MAX
+#define IMAGE_PROGRESS_INTERVAL_MS 500
+#define SWAPFILE_PATH "/swap/swapfile"
+#define PARTITION_WAIT_ATTEMPTS 200
+#define EXT4_BLOCK_SIZE 4096
+#define PACMAN_CACHE_DIR "/var/cache/pacman/pkg"
+#define OFFLINE_REPO_DIR "/opt/tonarchy/repo"
+#define OFFLINE_REPO_NAME "tonarchy"
+#define OFFLINE_PACMAN_CONF "/tmp/tonarchy-offline-pacman.conf"
+#define KEYRING_DIR "/etc/pacman.d/gnupg"
+#define KEYRING_READY_MARKER "/run/tonarchy-keyring-ready"
+#define BOOT_MARK_PARAM "tonarchy.bootmarks"
+#define BOOT_MARK_PREFIX "tonarchy-boot: "
+#define PREFETCH_MIN_FREE_MB 3072
+#define PREFETCH_DB_DIR "/tmp/tonarchy-prefetch-db"
+#define MIRRORLIST_PATH "/etc/pacman.d/mirrorlist"
+#define MAX_MIRRORS 64
+#define MIRROR_PROBE_TIMEOUT_MS 4000
+#define MIRROR_SAMPLE_BYTES (256 * 1024)
+#define MIRROR_SCORE_BYTES (8 * 1024 * 1024)
+#define MIRROR_UNMEASURED_PENALTY_MS 60000.0
+#define MIRROR_FAILED_PENALTY_MS 1000000.0
+#define MIRROR_REGION_PRIOR 0.8
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119)
+#endif
+
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD _IO(0x12, 125)
+#endif
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12, 127)
+#endif
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 #define ANSI_ESC           "\033["
 #define ANSI_RESET         ANSI_ESC "0m"
@@ -29,10 +114,12 @@
 #define ANSI_WHITE         ANSI_ESC "37m"
 #define ANSI_GREEN         ANSI_ESC "32m"
 #define ANSI_YELLOW        ANSI_ESC "33m"
+#define ANSI_RED           ANSI_ESC "31m"
 #define ANSI_GRAY          ANSI_ESC "90m"
 #define ANSI_BLUE          ANSI_ESC "34m"
 #define ANSI_BLUE_BOLD     ANSI_ESC "1;34m"
 #define ANSI_CURSOR_POS    ANSI_ESC "%d;%dH"
+#define ANSI_CLEAR_LINE    ANSI_ESC "2K"
 
 typedef enum {
     LOG_LEVEL_DEBUG,
@@ -41,6 +128,22 @@ typedef enum {
     LOG_LEVEL_ERROR
 } Log_Level;
 
+typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t ns;
+    Log_Level level;
+    char text[LOG_LINE_MAX];
+} Log_Slot;
+
+typedef struct {
+    Log_Slot slots[LOG_RING_SLOTS];
+    _Atomic uint64_t write_pos;
+    _Atomic uint64_t dropped;
+    uint64_t read_pos;
+    uint64_t start_ns;
+    int fd;
+} Log_Ring;
+
 typedef struct {
     const char *repo_url;
     const char *name;
@@ -88,7 +191,354 @@ typedef struct {
     const char *error_msg;
 } Form_Field;
 
+typedef struct Cmd Cmd;
+typedef void (*Cmd_Line_Fn)(void *user, int stream, const char *line);
+
+struct Cmd {
+    char **argv;
+    size_t argc;
+    size_t cap;
+    const char *input;
+    const char *root;
+    bool capture;
+    bool quiet;
+    bool terminal;
+    bool new_group;
+    bool failed;
+    char *output;
+    size_t output_len;
+    pid_t pid;
+    int fds[2];
+    int status;
+    char line[2][1024];
+    size_t line_len[2];
+    long span;
+    size_t output_bytes;
+    Cmd_Line_Fn on_line;
+    void *user;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const char *cache_dir;
+    bool done;
+    int total;
+    int downloaded;
+    int installed;
+    double download_total_mib;
+    double install_total_mib;
+    double download_start;
+    double download_end;
+    double install_start;
+    uint64_t phase_base;
+    uint64_t phase_bytes;
+    double rate;
+} Pacstrap_Progress;
+
+typedef struct Copy_Job {
+    char *src;
+    char *dest;
+    struct Copy_Job *next;
+} Copy_Job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Copy_Job *head;
+    size_t pending;
+    uid_t uid;
+    gid_t gid;
+    bool failed;
+    unsigned long files;
+    unsigned long long bytes;
+    size_t roots;
+    char first_root[PATH_MAX];
+} Copy_Tree;
+
+typedef struct {
+    char name[160];
+    char category[16];
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int tid;
+    int status;
+    size_t output_bytes;
+} Trace_Span;
+
+typedef struct {
+    const char *source;
+    const char *target;
+    const char *fstype;
+    unsigned long flags;
+    const char *data;
+    bool optional;
+} Chroot_Mount;
+
+typedef struct {
+    pthread_mutex_t lock;
+    char mounts[16][PATH_MAX];
+    int mount_count;
+    bool active;
+} Chroot_Session;
+
+typedef enum {
+    PART_EFI,
+    PART_SWAP,
+    PART_ROOT
+} Part_Role;
+
+typedef enum {
+    DEVICE_HDD,
+    DEVICE_SSD,
+    DEVICE_NVME,
+    DEVICE_FLASH
+} Device_Class;
+
+typedef struct {
+    Device_Class device_class;
+    bool rotational;
+    bool removable;
+    uint64_t discard_granularity;
+    uint64_t nr_requests;
+    char transport[16];
+    const char *scheduler;
+    const char *mount_options;
+    bool fstrim_timer;
+} Device_Profile;
+
+typedef struct {
+    const char *name;
+    const char *label;
+    const char *package;
+    const char *module;
+} Root_Fs;
+
+typedef struct {
+    const char *name;
+    const char *mount_point;
+} Btrfs_Subvolume;
+
+typedef enum {
+    SWAP_ZRAM,
+    SWAP_FILE,
+    SWAP_PARTITION
+} Swap_Kind;
+
+typedef struct {
+    Swap_Kind kind;
+    uint64_t size_bytes;
+    bool hibernate;
+    uint64_t resume_offset;
+    char reason[160];
+} Swap_Plan;
+
+typedef struct {
+    Part_Role role;
+    int number;
+    const char *name;
+    const char *fs_type;
+    char path[64];
+    uint64_t start_lba;
+    uint64_t size_lba;
+    uint8_t uuid[16];
+    char uuid_str[37];
+    char fs_uuid[37];
+} Partition;
+
+typedef struct {
+    char disk[64];
+    char dev[PATH_MAX];
+    bool gpt;
+    uint32_t logical_sector;
+    uint32_t physical_sector;
+    uint32_t optimal_io;
+    uint64_t alignment;
+    uint64_t size_bytes;
+    uint8_t disk_uuid[16];
+    uint32_t mbr_signature;
+    bool discarded;
+    Device_Profile profile;
+    const Root_Fs *root_fs;
+    Swap_Plan swap;
+    Partition parts[MAX_PARTITIONS];
+    size_t part_count;
+} Disk_Layout;
+
+typedef struct {
+    const Disk_Layout *layout;
+    const Partition *part;
+    int ok;
+    double elapsed;
+} Format_Job;
+
+typedef struct {
+    uint32_t role;
+    uint32_t reserved;
+    uint64_t size_bytes;
+    char fs_type[16];
+} Image_Partition;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t gpt;
+    uint32_t level;
+    uint32_t part_count;
+    char root_fs[16];
+    char username[64];
+    uint32_t swap_kind;
+    uint32_t hibernate;
+    uint64_t swap_size;
+    uint64_t resume_offset;
+    Image_Partition parts[MAX_PARTITIONS];
+} Image_Header;
+
+typedef struct {
+    uint32_t part;
+    uint32_t zero;
+    uint64_t offset;
+    uint64_t length;
+} Image_Extent;
+
+typedef struct {
+    const char *path;
+    Image_Header header;
+} Golden_Image;
+
+typedef struct {
+    char username[256];
+    char password[256];
+    char password_hash[256];
+    char hostname[256];
+    char keyboard[256];
+    char timezone[256];
+    char mode[32];
+    char disk[256];
+    char filesystem[32];
+    char wifi_ssid[128];
+    char wifi_password[256];
+    char image[PATH_MAX];
+    char capture[PATH_MAX];
+    bool hibernate;
+    bool secure_discard;
+    bool reboot;
+} Answer_File;
+
+typedef struct {
+    const char *username;
+    const char *password;
+    bool password_hashed;
+    const char *hostname;
+    const char *keyboard;
+    const char *timezone;
+    const char *disk;
+    Disk_Layout *layout;
+    const Root_Fs *root_fs;
+    const Swap_Plan *swap;
+    bool secure_discard;
+    bool batch;
+    const char *packages;
+    Golden_Image *image;
+    const char *capture_path;
+} Install_Context;
+
+typedef struct {
+    char disk[64];
+    pid_t pid;
+    bool finished;
+    bool failed;
+    double started;
+    double elapsed;
+    size_t steps_done;
+    size_t steps_total;
+    char step[96];
+    char status[160];
+} Target_Status;
+
+typedef struct {
+    const char *name;
+    const char *label;
+    int (*run)(const Install_Context *ctx);
+    const char *deps[MAX_STEP_DEPS];
+    const char *error_msg;
+} Install_Step;
+
+typedef enum {
+    MIRROR_IDLE,
+    MIRROR_CONNECTING,
+    MIRROR_READING,
+    MIRROR_MEASURED,
+    MIRROR_REACHABLE,
+    MIRROR_FAILED
+} Mirror_State;
+
+typedef struct {
+    char url[512];
+    char region[64];
+    char host[256];
+    char port[8];
+    char path[512];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd;
+    Mirror_State state;
+    char header[2048];
+    size_t header_len;
+    bool header_done;
+    int http_status;
+    long body_bytes;
+    double started_at;
+    double first_byte_at;
+    double connect_ms;
+    double bytes_per_sec;
+    double score;
+} Mirror;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Mirror mirrors[MAX_MIRRORS];
+    int count;
+    char path[256];
+    char timezone[256];
+} Mirror_Ranking;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const char *selected;
+    pid_t pid;
+    bool started;
+    bool closing;
+    bool cancelled;
+    bool finished;
+    bool cached;
+} Package_Prefetch;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool started;
+    bool finished;
+    bool ready;
+} Keyring_Init;
+
+typedef enum {
+    STEP_PENDING,
+    STEP_RUNNING,
+    STEP_DONE,
+    STEP_FAILED
+} Step_State;
+
 void logger_init(const char *log_path);
+void logger_reopen(const char *log_path);
+void logger_flush(void);
+long trace_begin(const char *category, const char *name);
+void trace_end(long id, int status, size_t output_bytes);
+int trace_write(const char *path);
+size_t trace_slowest(Trace_Span *out, size_t max);
 void logger_close(void);
 void log_msg(Log_Level level, const char *fmt, ...);
 
@@ -97,10 +547,45 @@ void log_msg(Log_Level level, const char *fmt, ...);
 #define LOG_WARN(...)  log_msg(LOG_LEVEL_WARN, __VA_ARGS__)
 #define LOG_ERROR(...) log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
 
+void cmd_init(Cmd *cmd, const char *program);
+void cmd_arg(Cmd *cmd, const char *arg);
+void cmd_argf(Cmd *cmd, const char *fmt, ...);
+void cmd_args_split(Cmd *cmd, const char *list);
+void cmd_free(Cmd *cmd);
+int cmd_spawn(Cmd *cmd);
+int cmd_wait(Cmd *cmd);
+int cmd_run(Cmd *cmd);
+int cmd_run_args(const char *program, ...);
+
+const char *target_root(void);
+void target_set_root(const char *root);
+char *target_path(char *out, size_t size, const char *fmt, ...);
 int write_file(const char *path, const char *content);
 int write_file_fmt(const char *path, const char *fmt, ...);
+char *read_file(const char *path);
 int set_file_perms(const char *path, mode_t mode, const char *owner, const char *group);
 int create_directory(const char *path, mode_t mode);
+void device_profile_probe(Device_Profile *profile, const char *dev);
+void plan_swap(Swap_Plan *plan, const Device_Profile *profile, const Root_Fs *root_fs, bool hibernate);
+int disk_probe(Disk_Layout *layout, const char *dev);
+int disk_plan(Disk_Layout *layout, bool gpt);
+int disk_write_table(const Disk_Layout *layout);
+int disk_discard(const Disk_Layout *layout, bool secure);
+int format_partitions(const Disk_Layout *layout);
+const Partition *disk_find_partition(const Disk_Layout *layout, Part_Role role);
+int image_read_header(const char *path, Image_Header *header);
+int image_capture(const Disk_Layout *layout, const char *path, const char *username, int level);
+int image_deploy(const Golden_Image *image, Disk_Layout *layout);
+int sync_target(void);
+int lookup_target_user(const char *username, uid_t *uid, gid_t *gid);
+void copy_tree_init(Copy_Tree *tree, uid_t uid, gid_t gid);
+void copy_tree_add(Copy_Tree *tree, const char *src, const char *dest);
+int copy_tree_run(Copy_Tree *tree, int workers);
+int copy_tree(const char *src, const char *dest, uid_t uid, gid_t gid);
+int chroot_session_begin(void);
+void chroot_session_end(void);
+int chroot_run(const Cmd *cmd);
+int chroot_run_args(const char *program, ...);
 int chroot_exec(const char *cmd);
 int chroot_exec_fmt(const char *fmt, ...);
 int chroot_exec_as_user(const char *username, const char *cmd);
@@ -110,12 +595,21 @@ int make_clean_install(const char *build_dir);
 int create_user_dotfile(const char *username, const Dotfile *dotfile);
 int setup_systemd_override(const Systemd_Override *override);
 
+int rank_mirrors(const char *mirrorlist_path);
+int print_mirror_ranking(const char *mirrorlist_path, const char *timezone);
+void mirrors_set_timezone(const char *timezone);
+int answer_file_load(const char *path, Answer_File *answers);
+int answer_file_validate(const Answer_File *answers);
+
+int run_install_steps(const Install_Step *steps, size_t count, const Install_Context *ctx, int max_workers);
+
 void show_message(const char *message);
 
 #define CHECK_OR_FAIL(expr, user_msg) \
     do { \
         if (!(expr)) { \
             LOG_ERROR("%s", #expr); \
+            logger_flush(); \
             show_message(user_msg); \
             return 0; \
         } \